@@ -8,6 +8,18 @@
 #include <vector>
 #include <sstream>
 #include <cassert>
+#include <deque>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std::chrono_literals;
 
@@ -76,18 +88,31 @@ public:
      * Если в пуле нет свободных соединений, но количество созданных соединений уже достигло значения `poolSize`,
      * то поток должен ждать, пока не освободится какое-то соединение.
      */
-    ConnectionPtr GetConnection(std::string threadId){
+    ConnectionPtr GetConnection(std::string /* threadId */){
         std::unique_lock<std::mutex> lock(mt_);
-        cv_.wait(lock, [this](){return free_ > 0;});
-        --free_;
-        if (connections_.size() == 0) {
-            auto NewPtr = std::make_shared<FakeConnection>(stoi(threadId));
-            ++connectionsAlive_;
-            return NewPtr;
+        cv_.wait(lock, [this](){return free_ > 0 && available_;});
+        return TakeConnection();
+    }
+
+    /*
+     * То же, что `GetConnection`, но ждать свободного соединения не дольше `timeout`.
+     * Если за это время соединение не освободилось или "база данных" недоступна, возвращает nullptr.
+     */
+    ConnectionPtr TryGetConnection(std::string /* threadId */, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mt_);
+        if (!cv_.wait_for(lock, timeout, [this](){return free_ > 0 && available_;})) {
+            return nullptr;
         }
-        ConnectionPtr FreePtr = connections_.back();
-        connections_.pop_back();
-        return FreePtr;
+        return TakeConnection();
+    }
+
+    /*
+     * Пометить "базу данных" доступной или недоступной. Пока она недоступна, новые соединения не выдаются.
+     */
+    void SetBackendAvailable(bool available) {
+        std::unique_lock<std::mutex> lock(mt_);
+        available_ = available;
+        cv_.notify_all();
     }
 
     /*
@@ -101,6 +126,20 @@ public:
         cv_.notify_one();
     }
 private:
+    /*
+     * Взять свободное соединение или создать новое. Вызывается под `mt_`, когда `free_ > 0`.
+     */
+    ConnectionPtr TakeConnection() {
+        --free_;
+        if (connections_.size() == 0) {
+            auto NewPtr = std::make_shared<FakeConnection>(static_cast<int>(connectionsAlive_));
+            ++connectionsAlive_;
+            return NewPtr;
+        }
+        ConnectionPtr FreePtr = connections_.back();
+        connections_.pop_back();
+        return FreePtr;
+    }
 
     std::condition_variable cv_;
     std::vector<ConnectionPtr> connections_;
@@ -108,6 +147,507 @@ private:
     size_t connectionsAlive_ = 0;
     size_t free_;
     size_t poolSize_;
+    bool available_ = true;
+};
+
+/*
+ * Журнал сообщений на диске: директория с сегментами `segment-N.log`, в которые сообщения только дописываются.
+ * Сегмент -- файл фиксированного размера, отображенный в память; запись в нем -- длина сообщения плюс один
+ * (uint32) и само сообщение, нулевая длина означает конец записанной части (новый файл заполнен нулями).
+ * Позиция, до которой сообщения уже отправлены, сохраняется в файле `checkpoint` через временный файл и rename;
+ * сегменты до нее удаляются. После перезапуска журнал продолжает с сохраненной позиции, так что сообщения,
+ * отправленные после последней контрольной точки, будут отправлены повторно.
+ * Перезапуск процесса сообщения переживают сразу после `Append`: их данные уже в страничном кэше. Чтобы они пережили
+ * и падение или отключение питания машины, `Sync` (и `Checkpoint` перед сохранением позиции) сбрасывает записанную
+ * часть сегментов на диск через msync и делает fsync директории; дописанное после последнего `Sync` при этом теряется.
+ * Методы не потокобезопасны. Чтобы не держать блокировку, пока данные сбрасываются на диск, сброс разделен на шаги:
+ * `PrepareFlush` и `FinishFlush` вызываются под той же блокировкой, что и остальные методы, а медленный `WriteFlush` --
+ * без нее (одновременно может идти только один сброс, и сегменты удаляет только `FinishFlush`).
+ */
+class SpillLog {
+public:
+    static constexpr size_t kSegmentSize = 1 << 20;
+
+    explicit SpillLog(const std::string& dir) : dir_(dir) {
+        std::filesystem::create_directories(dir_);
+        Recover();
+    }
+
+    SpillLog(const SpillLog&) = delete;
+    SpillLog& operator=(const SpillLog&) = delete;
+
+    ~SpillLog() {
+        for (Segment& segment : segments_) {
+            Close(segment);
+        }
+    }
+
+    /*
+     * Дописать сообщение. Возвращает false, если не удалось создать новый сегмент.
+     */
+    bool Append(const std::string& message) {
+        const size_t record = sizeof(uint32_t) + message.size();
+        if (segments_.empty() || segments_.back().end + record > segments_.back().size) {
+            const size_t index = segments_.empty() ? 0 : segments_.back().index + 1;
+            if (!Create(index, std::max(kSegmentSize, record))) return false;
+        }
+        Segment& segment = segments_.back();
+        // Сначала данные, потом длина: пока длина не записана, запись не видна при восстановлении
+        std::memcpy(segment.data + segment.end + sizeof(uint32_t), message.data(), message.size());
+        const uint32_t header = static_cast<uint32_t>(message.size()) + 1;
+        std::memcpy(segment.data + segment.end, &header, sizeof(header));
+        segment.end += record;
+        ++pending_;
+        pendingBytes_ += message.size();
+        return true;
+    }
+
+    /*
+     * Прочитать самое старое неотправленное сообщение. Возвращает false, если журнал пуст.
+     */
+    bool Peek(std::string& message) {
+        if (pending_ == 0) return false;
+        while (readOffset_ == segments_[readSegment_].end) {
+            ++readSegment_;
+            readOffset_ = 0;
+        }
+        const Segment& segment = segments_[readSegment_];
+        uint32_t header;
+        std::memcpy(&header, segment.data + readOffset_, sizeof(header));
+        message.assign(segment.data + readOffset_ + sizeof(header), header - 1);
+        return true;
+    }
+
+    /*
+     * Отметить сообщение, прочитанное `Peek`, отправленным.
+     */
+    void Pop() {
+        const Segment& segment = segments_[readSegment_];
+        uint32_t header;
+        std::memcpy(&header, segment.data + readOffset_, sizeof(header));
+        readOffset_ += sizeof(header) + header - 1;
+        --pending_;
+        pendingBytes_ -= header - 1;
+    }
+
+    /*
+     * Что нужно сбросить на диск: несброшенные части сегментов, директорию и, для контрольной точки, позицию.
+     */
+    struct Flush {
+        struct Range {
+            uint64_t index;  // сегмент
+            char* data;
+            size_t length;
+            size_t end;      // до какого места сегмент будет сброшен
+        };
+
+        std::vector<Range> ranges;
+        uint64_t directoryVersion = 0;  // 0, если директорию сбрасывать не нужно
+        bool checkpoint = false;
+        uint64_t position[2] = {0, 0};
+        size_t consumed = 0;            // сколько первых сегментов удалить после сохранения позиции
+    };
+
+    /*
+     * Собрать, что сбросить на диск: сообщения, дописанные после предыдущего сброса, новые сегменты и,
+     * если `checkpoint`, позицию отправленных сообщений.
+     */
+    Flush PrepareFlush(bool checkpoint) const {
+        static const size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        Flush flush;
+        for (size_t i = readSegment_; i < segments_.size(); ++i) {
+            const Segment& segment = segments_[i];
+            if (segment.synced == segment.end) continue;
+            const size_t start = segment.synced / pageSize * pageSize;
+            flush.ranges.push_back({segment.index, segment.data + start, segment.end - start, segment.end});
+        }
+        if (dirVersion_ != dirSynced_) flush.directoryVersion = dirVersion_;
+        if (checkpoint && !segments_.empty()) {
+            flush.checkpoint = true;
+            flush.position[0] = segments_[readSegment_].index;
+            flush.position[1] = readOffset_;
+            flush.consumed = readSegment_;
+        }
+        return flush;
+    }
+
+    /*
+     * Сбросить собранное на диск: msync сегментов, затем позиция через временный файл с fsync и rename,
+     * затем fsync директории. Позиция сохраняется только после того, как сообщения за ней сброшены на диск.
+     */
+    bool WriteFlush(const Flush& flush) const {
+        for (const Flush::Range& range : flush.ranges) {
+            if (::msync(range.data, range.length, MS_SYNC) != 0) return false;
+        }
+        if (flush.checkpoint) {
+            const std::string temp = dir_ + "/checkpoint.tmp";
+            int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0) return false;
+            const bool written = ::write(fd, flush.position, sizeof(flush.position)) == sizeof(flush.position) &&
+                                 ::fsync(fd) == 0;
+            ::close(fd);
+            if (!written || ::rename(temp.c_str(), (dir_ + "/checkpoint").c_str()) != 0) return false;
+        }
+        return !(flush.checkpoint || flush.directoryVersion) || SyncDirectory();
+    }
+
+    /*
+     * Запомнить результат `WriteFlush` и после сохраненной позиции удалить полностью отправленные сегменты.
+     */
+    void FinishFlush(const Flush& flush, bool written) {
+        if (!written) return;
+        for (const Flush::Range& range : flush.ranges) {
+            for (Segment& segment : segments_) {
+                if (segment.index == range.index) segment.synced = std::max(segment.synced, range.end);
+            }
+        }
+        dirSynced_ = std::max(dirSynced_, flush.directoryVersion);
+        for (size_t i = 0; i < flush.consumed; ++i, --readSegment_) {
+            Close(segments_.front());
+            ::unlink(SegmentPath(segments_.front().index).c_str());
+            segments_.pop_front();
+        }
+    }
+
+    /*
+     * Сбросить на диск сообщения, дописанные после предыдущего сброса, и новые сегменты.
+     */
+    bool Sync() {
+        const Flush flush = PrepareFlush(false);
+        const bool written = WriteFlush(flush);
+        FinishFlush(flush, written);
+        return written;
+    }
+
+    /*
+     * Сохранить позицию отправленных сообщений и удалить полностью отправленные сегменты.
+     */
+    bool Checkpoint() {
+        const Flush flush = PrepareFlush(true);
+        const bool written = WriteFlush(flush);
+        FinishFlush(flush, written);
+        return written;
+    }
+
+    /*
+     * Сколько сообщений еще не отправлено и сколько в них байт.
+     */
+    size_t Pending() const {
+        return pending_;
+    }
+
+    uint64_t PendingBytes() const {
+        return pendingBytes_;
+    }
+
+private:
+    struct Segment {
+        uint64_t index;
+        int fd;
+        char* data;
+        size_t size;
+        size_t end;  // конец записанной части
+        size_t synced;  // до какого места записанная часть сброшена на диск
+    };
+
+    bool SyncDirectory() const {
+        int fd = ::open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return false;
+        const bool synced = ::fsync(fd) == 0;
+        ::close(fd);
+        return synced;
+    }
+
+    std::string SegmentPath(uint64_t index) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/segment-%08llu.log", static_cast<unsigned long long>(index));
+        return dir_ + name;
+    }
+
+    /*
+     * Создать сегмент: место под него выделяется заранее (иначе при заполненном диске запись в отображение
+     * закончилась бы SIGBUS, а не ошибкой), а под своим именем файл появляется через rename уже нужного размера,
+     * так что после падения в директории не остается недосозданных сегментов.
+     */
+    bool Create(uint64_t index, size_t size) {
+        const std::string path = SegmentPath(index), temp = path + ".tmp";
+        int fd = ::open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        if (::posix_fallocate(fd, 0, static_cast<off_t>(size)) != 0 || ::rename(temp.c_str(), path.c_str()) != 0) {
+            ::close(fd);
+            ::unlink(temp.c_str());
+            return false;
+        }
+        if (!Map(fd, index, size)) {
+            ::close(fd);
+            ::unlink(path.c_str());
+            return false;
+        }
+        ++dirVersion_;
+        return true;
+    }
+
+    bool Map(int fd, uint64_t index, size_t size) {
+        void* data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) return false;
+        segments_.push_back({index, fd, static_cast<char*>(data), size, 0, 0});
+        return true;
+    }
+
+    static void Close(Segment& segment) {
+        ::munmap(segment.data, segment.size);
+        ::close(segment.fd);
+    }
+
+    /*
+     * Открыть сегменты, оставшиеся от прошлого запуска, и найти в них неотправленные сообщения.
+     */
+    void Recover() {
+        uint64_t position[2] = {0, 0};
+        int fd = ::open((dir_ + "/checkpoint").c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            if (::read(fd, position, sizeof(position)) != sizeof(position)) position[0] = position[1] = 0;
+            ::close(fd);
+        }
+        std::vector<uint64_t> indexes;
+        for (const auto& entry : std::filesystem::directory_iterator(dir_)) {
+            const std::string name = entry.path().filename().string();
+            unsigned long long index;
+            int length = 0;
+            if (std::sscanf(name.c_str(), "segment-%llu.log%n", &index, &length) != 1) continue;
+            if (static_cast<size_t>(length) == name.size()) {
+                indexes.push_back(index);
+            } else if (name.compare(length, std::string::npos, ".tmp") == 0) {
+                // Сегмент, который не успели создать до падения
+                ::unlink(entry.path().c_str());
+            }
+        }
+        std::sort(indexes.begin(), indexes.end());
+        for (uint64_t index : indexes) {
+            const std::string path = SegmentPath(index);
+            if (index < position[0]) {
+                ::unlink(path.c_str());
+                continue;
+            }
+            int segmentFd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+            struct stat st;
+            if (segmentFd < 0 || ::fstat(segmentFd, &st) != 0) {
+                throw std::system_error(errno, std::generic_category(), path);
+            }
+            if (st.st_size < static_cast<off_t>(sizeof(uint32_t))) {
+                // Пустой или обрезанный сегмент (например, созданный прежней версией без rename): в нем нет сообщений
+                ::close(segmentFd);
+                ::unlink(path.c_str());
+                continue;
+            }
+            if (!Map(segmentFd, index, static_cast<size_t>(st.st_size))) {
+                throw std::system_error(errno, std::generic_category(), path);
+            }
+            Segment& segment = segments_.back();
+            const size_t start = index == position[0] ? std::min<size_t>(position[1], segment.size) : 0;
+            size_t offset = 0;
+            while (offset + sizeof(uint32_t) <= segment.size) {
+                uint32_t header;
+                std::memcpy(&header, segment.data + offset, sizeof(header));
+                if (header == 0 || offset + sizeof(header) + header - 1 > segment.size) break;
+                if (offset >= start) {
+                    ++pending_;
+                    pendingBytes_ += header - 1;
+                }
+                offset += sizeof(header) + header - 1;
+            }
+            segment.end = offset;
+            if (segments_.size() == 1) readOffset_ = std::min(start, segment.end);
+        }
+    }
+
+    std::string dir_;
+    std::deque<Segment> segments_;
+    size_t readSegment_ = 0;  // позиция следующего неотправленного сообщения
+    size_t readOffset_ = 0;
+    size_t pending_ = 0;
+    uint64_t pendingBytes_ = 0;
+    uint64_t dirVersion_ = 0;  // сколько раз создавались сегменты
+    uint64_t dirSynced_ = 0;   // до какого `dirVersion_` директория сброшена на диск
+};
+
+/*
+ * Отправка сообщений через пул без блокировки производителей.
+ * `Send` ждет соединения не дольше `timeout`; если его нет (все заняты или "база данных" недоступна),
+ * сообщение дописывается в журнал на диске (`SpillLog`). Фоновый поток отправляет сообщения из журнала
+ * в порядке записи, когда соединения освобождаются, и каждые `kCheckpointEvery` сообщений сохраняет
+ * контрольную точку. Пока в журнале есть сообщения, новые тоже идут в журнал, чтобы не обогнать старые.
+ * Пока поток ждет соединения, он сбрасывает журнал на диск (`SpillLog::Sync`).
+ * Ограничение: чтобы сохранить порядок, сообщения из журнала отправляются по одному через одно соединение, так что
+ * после первого сброса в журнал пропускная способность очереди -- одно соединение, сколько бы их ни было в пуле.
+ * Если производители шлют быстрее, журнал не опустеет, пока они не замедлятся; следить за этим можно
+ * по `PendingMessages` и `DrainRate`.
+ * Неотправленные сообщения переживают перезапуск: их отправит следующий `WriteBehindQueue` с той же директорией.
+ */
+class WriteBehindQueue {
+public:
+    static constexpr size_t kCheckpointEvery = 64;
+
+    WriteBehindQueue(ConnectionPool& pool, const std::string& dir, std::chrono::milliseconds timeout = 5ms)
+        : pool_(pool), log_(dir), timeout_(timeout) {
+        if (log_.Pending() > 0) busySince_ = std::chrono::steady_clock::now();
+        drainer_ = std::thread([this](){ Drain(); });
+    }
+
+    WriteBehindQueue(const WriteBehindQueue&) = delete;
+    WriteBehindQueue& operator=(const WriteBehindQueue&) = delete;
+
+    ~WriteBehindQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        drainer_.join();
+        log_.Checkpoint();
+    }
+
+    /*
+     * Отправить сообщение или записать его в журнал. Возвращает false, если сообщение не отправлено и не
+     * записано в журнал (например, на диске кончилось место): оно потеряно, решать, что с ним делать, вызывающему.
+     * Ждать соединения дольше `timeout`, минуя журнал, нельзя: производитель заблокировался бы, пока "база данных"
+     * недоступна, а сообщение обогнало бы более старые сообщения из журнала.
+     */
+    bool Send(const std::string& threadId, const std::string& message) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (log_.Pending() == 0) {
+            lock.unlock();
+            ConnectionPtr connection = pool_.TryGetConnection(threadId, timeout_);
+            if (connection) {
+                connection->WriteSomething(message);
+                pool_.FreeConnection(connection);
+                return true;
+            }
+            lock.lock();
+        }
+        if (!log_.Append(message)) {
+            ++dropped_;
+            return false;
+        }
+        if (log_.Pending() == 1) busySince_ = std::chrono::steady_clock::now();
+        ++spilled_;
+        cv_.notify_all();
+        return true;
+    }
+
+    /*
+     * Дождаться, пока журнал опустеет. Возвращает false, если за `timeout` этого не произошло.
+     */
+    bool WaitDrained(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return drainedCv_.wait_for(lock, timeout, [this](){ return log_.Pending() == 0; });
+    }
+
+    /*
+     * Сколько сообщений было записано в журнал и сколько из журнала отправлено.
+     */
+    size_t SpilledMessages() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return spilled_;
+    }
+
+    size_t DrainedMessages() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return drained_;
+    }
+
+    /*
+     * Сколько сообщений `Send` не смог ни отправить, ни записать в журнал.
+     */
+    size_t DroppedMessages() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return dropped_;
+    }
+
+    /*
+     * Сколько сообщений и байт ждут отправки в журнале.
+     */
+    size_t PendingMessages() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return log_.Pending();
+    }
+
+    uint64_t PendingBytes() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return log_.PendingBytes();
+    }
+
+    /*
+     * Скорость отправки из журнала: сообщений в секунду за то время, пока журнал был непуст.
+     */
+    double DrainRate() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto busy = busyTime_;
+        if (log_.Pending() > 0) busy += std::chrono::steady_clock::now() - busySince_;
+        const double seconds = std::chrono::duration<double>(busy).count();
+        return seconds > 0 ? drained_ / seconds : 0;
+    }
+
+private:
+    void Drain() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        size_t sinceCheckpoint = 0;
+        std::string message;
+        while (true) {
+            cv_.wait(lock, [this](){ return stop_ || log_.Pending() > 0; });
+            if (stop_) return;
+            log_.Peek(message);
+            lock.unlock();
+            ConnectionPtr connection = pool_.TryGetConnection("0", 50ms);
+            const bool sent = connection != nullptr;
+            if (sent) {
+                connection->WriteSomething(message);
+                pool_.FreeConnection(connection);
+            }
+            lock.lock();
+            if (!sent) {
+                // Пока соединения нет, журнал хотя бы сбрасывается на диск
+                FlushLog(lock, false);
+                continue;
+            }
+            log_.Pop();
+            ++drained_;
+            const bool empty = log_.Pending() == 0;
+            if (empty) {
+                busyTime_ += std::chrono::steady_clock::now() - busySince_;
+                drainedCv_.notify_all();
+            }
+            if (++sinceCheckpoint == kCheckpointEvery || empty) {
+                FlushLog(lock, true);
+                sinceCheckpoint = 0;
+            }
+        }
+    }
+
+    /*
+     * Сбросить журнал на диск, не держа `mutex_` во время msync и fsync, чтобы `Send` мог дописывать в журнал.
+     */
+    void FlushLog(std::unique_lock<std::mutex>& lock, bool checkpoint) {
+        const SpillLog::Flush flush = log_.PrepareFlush(checkpoint);
+        lock.unlock();
+        const bool written = log_.WriteFlush(flush);
+        lock.lock();
+        log_.FinishFlush(flush, written);
+    }
+
+    ConnectionPool& pool_;
+    SpillLog log_;
+    std::chrono::milliseconds timeout_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::condition_variable drainedCv_;
+    std::thread drainer_;
+    bool stop_ = false;
+    size_t spilled_ = 0;
+    size_t drained_ = 0;
+    size_t dropped_ = 0;
+    std::chrono::steady_clock::time_point busySince_;
+    std::chrono::steady_clock::duration busyTime_{0};
 };
 
 // Код, помогающий в отладке
@@ -176,6 +716,38 @@ int main() {
     for (auto& thread : threads) {
         thread.join();
     }
+
+    // Пока "база данных" недоступна, сообщения копятся в журнале на диске и переживают перезапуск
+    const std::string spillDir = (std::filesystem::temp_directory_path() / "connect_pool_spill").string();
+    std::filesystem::remove_all(spillDir);
+    pool.SetBackendAvailable(false);
+    {
+        WriteBehindQueue queue(pool, spillDir);
+        for (int i = 0; i < 3; ++i) {
+            const bool accepted = queue.Send("0", "Spilled message #" + std::to_string(i));
+            assert(accepted);
+        }
+        assert(queue.SpilledMessages() == 3 && queue.PendingMessages() == 3 && queue.DroppedMessages() == 0);
+    }
+    {
+        WriteBehindQueue queue(pool, spillDir);
+        assert(queue.PendingMessages() == 3);
+        pool.SetBackendAvailable(true);
+        assert(queue.WaitDrained(5s));
+        assert(queue.DrainedMessages() == 3 && queue.PendingBytes() == 0 && queue.DrainRate() > 0);
+    }
+    {
+        // Следы падения во время создания сегмента не мешают открыть журнал
+        std::FILE* empty = std::fopen((spillDir + "/segment-00000100.log").c_str(), "w");
+        std::FILE* unfinished = std::fopen((spillDir + "/segment-00000101.log.tmp").c_str(), "w");
+        std::fclose(empty);
+        std::fclose(unfinished);
+        WriteBehindQueue queue(pool, spillDir);
+        assert(queue.PendingMessages() == 0);
+        assert(queue.Send("0", "After a crash"));
+    }
+    assert(!std::filesystem::exists(spillDir + "/segment-00000101.log.tmp"));
+    std::filesystem::remove_all(spillDir);
 }
 
 /*
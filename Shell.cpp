@@ -6,155 +6,7469 @@
 #include <iostream>
 #include <cassert>
 #include <iostream>
+#include <unordered_map>
+#include <list>
+#include <chrono>
+#include <cerrno>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <iterator>
+#include <cstdio>
+#include <atomic>
+#include <deque>
+#include <unordered_set>
+#include <memory>
+#include <functional>
+#include <string_view>
+#include <streambuf>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <system_error>
+#include <memory_resource>
+#include <cstddef>
+#include <charconv>
+#include <poll.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <csignal>
+#include <pwd.h>
+#include <grp.h>
+#include <climits>
+#include <limits>
+#include <ctime>
 namespace fs = std::filesystem;
-/* класс Shell, представляющий собой среду для выполнения некоторых команд
- * над файловой системой. По аналогии с настоящим шеллом он поддерживает несколько команд:
- * - ls [directory] -- вывести содержимое указанной директории. Если директория не указана, то используется текущая директория (current working directory, cwd)
- * - cat <file> -- вывести содержимое файла
- * - mkdir <directory> -- создать директорию
- * - rmdir <directory> -- удалить пустую директорию
- * - rm <file> -- удалить файл
- * - cd <directory> -- сделать <directory> текущей директорией
- * - echo [text] -- вывести текст
- *
- * Если в конце строки указать "> <file>", то результат выполнения команды будет записан в файл <file>, при этом старое содержимое файла будет удалено.
- * Если в конце строки указать ">> <file>", то результат выполнения команды будет записан в конец файла <file>.
- *
- * Все операции должны производиться с настоящей файловой системой.
- * В случае возникновения ошибок во время выполнения команды шелл должен вернуть код ответа 1, в случае успеха вернуть 0.
- * Также на оценку влияет потенциальная расширяемость набора команд.
+
+/*
+ * Описание ошибки, из-за которой команда вернула код ответа 1.
  */
-class Shell {
+struct CommandError {
+    int code = 0;         // errno или 0, если ошибка не связана с системным вызовом
+    std::string path;     // путь, с которым не удалась операция (может быть пустым)
+    std::string message;
+};
+
+/*
+ * Счетчики, по которым можно судить о том, сколько работы шелл проделал с файловой системой.
+ */
+struct ShellStats {
+    size_t appendCalls = 0;   // сколько раз результат команды дописывался в файл через `>>`
+    size_t appendOpens = 0;   // сколько раз файл на самом деле открывался для дозаписи
+    size_t appendWrites = 0;  // сколько системных вызовов write понадобилось для дозаписи
+    size_t syncGroups = 0;    // сколько раз сбрасывалась группа отложенных fsync
+    size_t syncCalls = 0;     // сколько всего было вызовов fsync/fdatasync
+    std::chrono::nanoseconds syncTime{0};  // суммарное время, проведенное в fsync/fdatasync
+    size_t scriptCacheHits = 0;    // сколько скриптов было загружено из кэша байткода
+    size_t scriptCacheMisses = 0;  // сколько скриптов пришлось компилировать
+    size_t prefetchIssued = 0;   // сколько путей скрипт заранее запросил у предвыборки
+    size_t prefetchHits = 0;     // сколько чтений файлов пришлось на уже выполненную предвыборку
+    size_t prefetchMisses = 0;   // сколько чтений файлов во время скрипта предвыборка не успела или не смогла покрыть
+    size_t prefetchWasted = 0;   // сколько предвыбранных файлов так и не было прочитано
+    size_t indexDirsScanned = 0;  // сколько директорий было прочитано при построении индекса имен
+    size_t indexDirsReused = 0;   // сколько директорий `index update` взял из старого индекса без чтения
+    size_t programLookups = 0;    // сколько раз внешняя команда искалась по директориям PATH
+    size_t programCacheHits = 0;  // сколько раз путь внешней команды нашелся в кэше
+    size_t syncCopied = 0;        // сколько файлов `sync` скопировал целиком
+    size_t syncUpdated = 0;       // сколько больших файлов `sync` обновил по разнице
+    size_t syncDeleted = 0;       // сколько лишних записей удалил `sync --delete`
+    uint64_t syncBytesWritten = 0;  // сколько байт `sync` записал в файлы назначения
+    size_t dedupeDuplicates = 0;    // сколько копий нашел `dedupe`
+    size_t dedupeFullyRead = 0;     // сколько файлов `dedupe` прочитал целиком
+    uint64_t dedupeBytesRead = 0;   // сколько байт `dedupe` прочитал для сравнения
+    uint64_t dedupeReclaimed = 0;   // сколько байт `dedupe` освободил заменой копий ссылками
+    size_t countSpills = 0;         // сколько раз `count` сбрасывал хэш-таблицы на диск
+    size_t throttleWaits = 0;       // сколько операций ввода-вывода ждали бюджета `SetIoLimit`
+    std::chrono::nanoseconds throttleTime{0};  // суммарное время этого ожидания
+};
+
+/*
+ * Фоновая предвыборка файлов, которые скоро понадобятся командам скрипта.
+ * Для файлов, содержимое которых будет прочитано, в фоновом потоке вызывается posix_fadvise(WILLNEED), чтобы
+ * ядро начало читать их в page cache, пока выполняются предыдущие команды. Для остальных путей делается lstat,
+ * чтобы прогреть кэш записей директорий и inode.
+ * Попадания считаются только между `Begin` и `End`.
+ */
+class Prefetcher {
 public:
-    Shell(const std::filesystem::path& cwd_) {cwd = fs::current_path();}
+    explicit Prefetcher(ShellStats& stats) : stats_(stats) {}
+
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher& operator=(const Prefetcher&) = delete;
+
+    ~Prefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_one();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    void Begin() {
+        active_.store(true, std::memory_order_relaxed);
+    }
+
+    void End() {
+        active_.store(false, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.prefetchWasted += queue_.size() + done_.size();
+        queue_.clear();
+        queued_.clear();
+        done_.clear();
+    }
+
     /*
-     * Выполнить команду.
-     * Команда подается в виде строки. Вывод команды попадает в поток `out`.
-     * Если в команде вывод был перенаправлен в файл с помощью `>` или `>>`, то в `out` ничего не выводится.
-     * Если команда была выполнена, то метод должен вернуть 0, иначе 1.
-     * Перед выполнением команды рекомендуем вывести в поток `out` строку вида "$ <строка команды>\n", чтобы
-     * во время отладки было понятно, какие ответы соответствуют каким введенным командам.
+     * Запросить предвыборку пути. `contents` -- будет ли прочитано содержимое файла.
+     */
+    void Prefetch(const std::string& path, bool contents) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (queued_.count(path) || done_.count(path)) return;
+        ++stats_.prefetchIssued;
+        queued_.insert(path);
+        queue_.emplace_back(path, contents);
+        if (!thread_.joinable()) {
+            thread_ = std::thread([this]() { Run(); });
+        }
+        cv_.notify_one();
+    }
+
+    bool Active() const {
+        return active_.load(std::memory_order_relaxed);
+    }
+
+    /*
+     * Отметить, что содержимое файла `path` сейчас читается.
+     */
+    void NoteRead(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (done_.erase(path)) {
+            ++stats_.prefetchHits;
+        } else {
+            ++stats_.prefetchMisses;
+        }
+    }
+
+private:
+    void Run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+            if (stop_) return;
+            auto [path, contents] = std::move(queue_.front());
+            queue_.pop_front();
+            lock.unlock();
+
+            // Попаданием считается только файл, который действительно удалось предвыбрать: файлы, которые
+            // создадут предыдущие команды скрипта, в момент предвыборки еще не существуют
+            bool fetched = false;
+            if (contents) {
+                int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+                if (fd >= 0) {
+                    fetched = ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0;
+                    ::close(fd);
+                }
+            } else {
+                struct stat st;
+                ::lstat(path.c_str(), &st);
+            }
+
+            lock.lock();
+            if (queued_.erase(path) && fetched) {
+                done_.insert(path);
+            }
+        }
+    }
+
+    ShellStats& stats_;
+    std::atomic<bool> active_{false};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::pair<std::string, bool>> queue_;
+    std::unordered_set<std::string> queued_;
+    std::unordered_set<std::string> done_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+/*
+ * Группа отложенных fsync для режима надежной записи.
+ * `>` пишет во временный файл рядом с целевым, который при сбросе группы синхронизируется и атомарно
+ * переименовывается в целевой. Для файлов, дописанных через `>>`, при сбросе вызывается fdatasync.
+ * Каждая родительская директория синхронизируется один раз на группу, а не один раз на файл.
+ * Группа копится не дольше `window`, после чего ее нужно сбросить вызовом `Commit`.
+ */
+class SyncGroup {
+public:
+    SyncGroup(ShellStats& stats, std::chrono::milliseconds window = std::chrono::milliseconds(5))
+        : stats_(stats), window_(window) {
+        umask_ = ::umask(0);
+        ::umask(umask_);
+    }
+
+    SyncGroup(const SyncGroup&) = delete;
+    SyncGroup& operator=(const SyncGroup&) = delete;
+
+    ~SyncGroup() {
+        Commit();
+    }
+
+    /*
+     * Создать временный файл, содержимое которого при сбросе группы заменит файл `path`.
+     * Возвращает дескриптор, в который нужно писать, или -1 при ошибке.
+     */
+    int CreateTemp(const std::string& path) {
+        std::string tmp = path + ".tmpXXXXXX";
+        int fd = ::mkostemp(tmp.data(), O_CLOEXEC);
+        if (fd < 0) return -1;
+        struct stat st;
+        ::fchmod(fd, ::stat(path.c_str(), &st) == 0 ? (st.st_mode & 07777) : (0666 & ~umask_));
+        Touch();
+        replaces_[path] = Replace{fd, std::move(tmp)};
+        return fd;
+    }
+
+    /*
+     * Отказаться от замены `path`, например, если запись во временный файл не удалась.
+     */
+    void Discard(const std::string& path) {
+        auto it = replaces_.find(path);
+        if (it == replaces_.end()) return;
+        ::close(it->second.fd);
+        ::unlink(it->second.tmp.c_str());
+        replaces_.erase(it);
+    }
+
+    /*
+     * Запомнить, что в файл `path` через дескриптор `fd` были дописаны данные.
+     */
+    void AddAppended(const std::string& path, int fd) {
+        if (appended_.count(path)) return;
+        int copy = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (copy < 0) {
+            TimedSync(fd, true);
+            return;
+        }
+        Touch();
+        appended_.emplace(path, copy);
+    }
+
+    bool HasPendingReplace(const std::string& path) const {
+        return replaces_.count(path) != 0;
+    }
+
+    bool HasPendingReplaces() const {
+        return !replaces_.empty();
+    }
+
+    bool Expired() const {
+        return (!replaces_.empty() || !appended_.empty()) && std::chrono::steady_clock::now() - first_ >= window_;
+    }
+
+    /*
+     * Синхронизировать все накопленные файлы, переименовать временные файлы в целевые и синхронизировать
+     * затронутые директории.
+     */
+    bool Commit() {
+        if (replaces_.empty() && appended_.empty()) return true;
+        ++stats_.syncGroups;
+        bool ok = true;
+        std::set<std::string> dirs;
+        for (auto& [path, replace] : replaces_) {
+            bool synced = TimedSync(replace.fd, true);
+            ::close(replace.fd);
+            if (synced && ::rename(replace.tmp.c_str(), path.c_str()) == 0) {
+                dirs.insert(fs::path(path).parent_path().string());
+            } else {
+                ::unlink(replace.tmp.c_str());
+                ok = false;
+            }
+        }
+        replaces_.clear();
+        for (auto& [path, fd] : appended_) {
+            ok = TimedSync(fd, true) && ok;
+            ::close(fd);
+            dirs.insert(fs::path(path).parent_path().string());
+        }
+        appended_.clear();
+        for (const std::string& dir : dirs) {
+            int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) {
+                ok = false;
+                continue;
+            }
+            ok = TimedSync(fd, false) && ok;
+            ::close(fd);
+        }
+        return ok;
+    }
+
+private:
+    struct Replace {
+        int fd;
+        std::string tmp;
+    };
+
+    void Touch() {
+        if (replaces_.empty() && appended_.empty()) {
+            first_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    bool TimedSync(int fd, bool dataOnly) {
+        auto start = std::chrono::steady_clock::now();
+        int rc = dataOnly ? ::fdatasync(fd) : ::fsync(fd);
+        stats_.syncTime += std::chrono::steady_clock::now() - start;
+        ++stats_.syncCalls;
+        return rc == 0;
+    }
+
+    ShellStats& stats_;
+    std::chrono::milliseconds window_;
+    mode_t umask_;
+    std::chrono::steady_clock::time_point first_;
+    std::unordered_map<std::string, Replace> replaces_;
+    std::unordered_map<std::string, int> appended_;
+};
+
+/*
+ * Бюджет ввода-вывода тяжелых команд: два ведра токенов -- байты в секунду и операции в секунду.
+ * Операция ждет, пока оба ведра не станут неотрицательными, и затем списывает свою стоимость целиком, уходя
+ * в минус: так проходит и кусок больше секундного бюджета, а следующая операция ждет дольше. Ведро
+ * накапливает не больше `kBurst` секунды бюджета, чтобы после простоя не было долгого всплеска.
+ * Пределы можно менять во время работы: ожидающие потоки пересчитывают ожидание по новым пределам.
+ * Пока ограничений нет, `Charge` -- это одна проверка флага.
+ */
+class IoThrottle {
+public:
+    static constexpr uint64_t kChunk = 1 << 20;  // больше за одну операцию при ограничении не читается и не пишется
+
+    explicit IoThrottle(ShellStats& stats) : stats_(stats) {}
+
+    IoThrottle(const IoThrottle&) = delete;
+    IoThrottle& operator=(const IoThrottle&) = delete;
+
+    /*
+     * Задать пределы (0 -- без ограничения).
+     */
+    void SetLimits(uint64_t bytesPerSecond, uint64_t opsPerSecond) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Refill(Clock::now());
+            bytes_.rate = static_cast<double>(bytesPerSecond);
+            ops_.rate = static_cast<double>(opsPerSecond);
+            active_.store(bytesPerSecond > 0 || opsPerSecond > 0, std::memory_order_relaxed);
+        }
+        cv_.notify_all();
+    }
+
+    bool Active() const {
+        return active_.load(std::memory_order_relaxed);
+    }
+
+    /*
+     * Сколько из `length` байт обработать за одну операцию: при ограничении не больше `kChunk`,
+     * чтобы ожидание распределялось равномерно, а не приходилось на один большой вызов.
+     */
+    uint64_t Chunk(uint64_t length) const {
+        return Active() ? std::min(length, kChunk) : length;
+    }
+
+    /*
+     * Списать с бюджета `bytes` байт и `ops` операций, дождавшись, пока бюджет это позволит.
+     */
+    void Charge(uint64_t bytes, uint64_t ops = 1) {
+        if (Active()) Wait(bytes, ops);
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr double kBurst = 0.1;
+
+    struct Bucket {
+        double rate = 0;   // 0 -- без ограничения
+        double level = 0;
+    };
+
+    void Refill(Clock::time_point now) {
+        const double seconds = std::chrono::duration<double>(now - refilled_).count();
+        refilled_ = now;
+        for (Bucket* bucket : {&bytes_, &ops_}) {
+            bucket->level = bucket->rate > 0 ? std::min(bucket->level + bucket->rate * seconds, bucket->rate * kBurst) : 0;
+        }
+    }
+
+    void Wait(uint64_t bytes, uint64_t ops) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        const Clock::time_point start = Clock::now();
+        bool waited = false;
+        while (true) {
+            Refill(Clock::now());
+            double seconds = 0;
+            for (const Bucket* bucket : {&bytes_, &ops_}) {
+                if (bucket->level < 0) seconds = std::max(seconds, -bucket->level / bucket->rate);
+            }
+            if (seconds <= 0) break;
+            waited = true;
+            cv_.wait_for(lock, std::chrono::duration<double>(seconds));
+        }
+        if (bytes_.rate > 0) bytes_.level -= static_cast<double>(bytes);
+        if (ops_.rate > 0) ops_.level -= static_cast<double>(ops);
+        if (waited) {
+            ++stats_.throttleWaits;
+            stats_.throttleTime += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+        }
+    }
+
+    ShellStats& stats_;
+    std::atomic<bool> active_{false};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    Clock::time_point refilled_ = Clock::now();
+    Bucket bytes_;
+    Bucket ops_;
+};
+
+/*
+ * Буферизованный приемник вывода команд.
+ * Мелкие куски вывода копируются во встроенный буфер (быстрый путь без виртуальных вызовов), большие куски
+ * можно передать по указателю через `AppendRef` -- тогда они не копируются, а при сбросе отдаются вместе
+ * с буфером одним списком сегментов (для файлов это один вызов writev).
+ */
+class OutputSink {
+public:
+    static constexpr size_t kBufferSize = 8 * 1024;
+    static constexpr size_t kMaxSegments = 64;
+
+    OutputSink() = default;
+    OutputSink(const OutputSink&) = delete;
+    OutputSink& operator=(const OutputSink&) = delete;
+    virtual ~OutputSink() = default;
+
+    void Append(const char* data, size_t size) {
+        if (size <= kBufferSize - used_) {
+            std::memcpy(buffer_ + used_, data, size);
+            used_ += size;
+        } else {
+            AppendSlow(data, size);
+        }
+    }
+
+    void Append(std::string_view text) {
+        Append(text.data(), text.size());
+    }
+
+    void Append(char c) {
+        if (used_ == kBufferSize) Flush();
+        buffer_[used_++] = c;
+    }
+
+    /*
+     * Добавить кусок без копирования. Память должна оставаться валидной до следующего вызова `Flush`.
+     */
+    void AppendRef(const char* data, size_t size) {
+        if (segmentCount_ + 2 > kMaxSegments) Flush();
+        CloseRun();
+        segments_[segmentCount_++] = {const_cast<char*>(data), size};
+    }
+
+    /*
+     * Протолкнуть вывод дальше буферов нижележащего потока (для команд, которые выводят что-то постепенно).
+     */
+    virtual void Sync() {}
+
+    /*
+     * Отдать все накопленное. Возвращает false, если какая-то запись в этот приемник не удалась.
+     */
+    bool Flush() {
+        CloseRun();
+        if (segmentCount_ > 0) {
+            ok_ = WriteSegments(segments_, segmentCount_) && ok_;
+        }
+        segmentCount_ = 0;
+        used_ = runStart_ = 0;
+        return ok_;
+    }
+
+protected:
+    virtual bool WriteSegments(const struct iovec* segments, size_t count) = 0;
+
+private:
+    void CloseRun() {
+        if (used_ > runStart_) {
+            segments_[segmentCount_++] = {buffer_ + runStart_, used_ - runStart_};
+            runStart_ = used_;
+        }
+    }
+
+    void AppendSlow(const char* data, size_t size) {
+        if (size >= kBufferSize / 2) {
+            AppendRef(data, size);
+            Flush();
+            return;
+        }
+        Flush();
+        std::memcpy(buffer_, data, size);
+        used_ = size;
+    }
+
+    char buffer_[kBufferSize];
+    size_t used_ = 0;
+    size_t runStart_ = 0;
+    struct iovec segments_[kMaxSegments];
+    size_t segmentCount_ = 0;
+    bool ok_ = true;
+};
+
+/*
+ * Приемник, пишущий в файловый дескриптор через writev.
+ */
+class FdSink : public OutputSink {
+public:
+    explicit FdSink(int fd) : fd_(fd) {}
+
+    ~FdSink() override {
+        Flush();
+    }
+
+    static bool WriteAll(int fd, const struct iovec* segments, size_t count) {
+        struct iovec pending[kMaxSegments];
+        std::copy(segments, segments + count, pending);
+        struct iovec* current = pending;
+        while (count > 0) {
+            ssize_t written = ::writev(fd, current, static_cast<int>(count));
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            size_t left = static_cast<size_t>(written);
+            while (count > 0 && left >= current->iov_len) {
+                left -= current->iov_len;
+                ++current;
+                --count;
+            }
+            if (count > 0) {
+                current->iov_base = static_cast<char*>(current->iov_base) + left;
+                current->iov_len -= left;
+            }
+        }
+        return true;
+    }
+
+protected:
+    bool WriteSegments(const struct iovec* segments, size_t count) override {
+        return WriteAll(fd_, segments, count);
+    }
+
+private:
+    int fd_;
+};
+
+/*
+ * Адаптер приемника к `std::ostream`: вывод команд, которые пишут в приемник, попадает в поток.
+ */
+class OstreamSink : public OutputSink {
+public:
+    explicit OstreamSink(std::ostream& out) : out_(out) {}
+
+    ~OstreamSink() override {
+        Flush();
+    }
+
+    void Sync() override {
+        out_.flush();
+    }
+
+protected:
+    bool WriteSegments(const struct iovec* segments, size_t count) override {
+        for (size_t i = 0; i < count; ++i) {
+            out_.write(static_cast<const char*>(segments[i].iov_base), static_cast<std::streamsize>(segments[i].iov_len));
+        }
+        return out_.good();
+    }
+
+private:
+    std::ostream& out_;
+};
+
+/*
+ * Кэш открытых на дозапись файлов.
+ * Вместо того, чтобы на каждый `>>` открывать, писать и закрывать файл, держим открытыми не более `maxHandles`
+ * дескрипторов (вытесняем давно не использовавшиеся) и копим дописываемые данные в буфере.
+ * Буфер сбрасывается на диск, если он стал больше `bufferLimit`, если данные лежат в нем дольше `flushInterval`,
+ * при вызове `FlushAll` и при уничтожении кэша.
+ * Дескрипторы и буферы хранятся по файлу (устройство и inode), а не по пути, так что данные, дописанные в один
+ * файл через разные пути (символические или жесткие ссылки), пишутся ровно в том порядке, в котором они были дописаны.
+ * Перед дозаписью через закэшированный путь проверяется, что он все еще указывает на тот же файл: если его переименовали,
+ * удалили или заменили (внешней программой, `sync`, `decompress` и т.п.), файл открывается заново.
+ * Если запись не удалась, недописанные данные остаются в буфере, а ошибка запоминается до вызова `TakeError`.
+ */
+class AppendCache {
+public:
+    AppendCache(ShellStats& stats, size_t maxHandles = 16, size_t bufferLimit = 64 * 1024,
+                std::chrono::milliseconds flushInterval = std::chrono::milliseconds(50))
+        : stats_(stats), maxHandles_(maxHandles), bufferLimit_(bufferLimit), flushInterval_(flushInterval) {}
+
+    AppendCache(const AppendCache&) = delete;
+    AppendCache& operator=(const AppendCache&) = delete;
+
+    ~AppendCache() {
+        CloseAll();
+    }
+
+    /*
+     * В режиме надежной записи каждый сброшенный буфер регистрируется в группе отложенных fsync.
+     */
+    void SetSyncGroup(SyncGroup* group) {
+        sync_ = group;
+    }
+
+    /*
+     * Дописать данные в конец файла `path` (путь должен быть уже разрешен относительно cwd).
+     * Возвращает false, если файл не удалось открыть или записать.
+     */
+    bool Append(std::string_view path, const char* data, size_t size) {
+        ++stats_.appendCalls;
+        Handle* handle;
+        auto alias = paths_.find(path);
+        if (alias != paths_.end() && !Current(alias)) {
+            // Путь теперь указывает на другой файл (его переименовали или удалили): старый дескриптор забываем
+            // (ошибка сброса его данных запоминается до `TakeError`)
+            Forget(alias);
+            alias = paths_.end();
+        }
+        if (alias != paths_.end()) {
+            handle = &handles_.at(alias->second);
+            lru_.splice(lru_.begin(), lru_, handle->lruPos);
+        } else {
+            handle = Open(path);
+            if (!handle) return false;
+        }
+
+        if (handle->buffer.empty()) {
+            handle->firstPending = std::chrono::steady_clock::now();
+        }
+        handle->buffer.append(data, size);
+        if (handle->buffer.size() >= bufferLimit_) {
+            return Flush(*handle);
+        }
+        return true;
+    }
+
+    /*
+     * Сбросить на диск все накопленные данные, если самые старые из них ждут дольше `flushInterval`.
+     */
+    bool FlushExpired() {
+        auto now = std::chrono::steady_clock::now();
+        bool ok = true;
+        for (auto& [id, handle] : handles_) {
+            if (!handle.buffer.empty() && now - handle.firstPending >= flushInterval_) {
+                ok = Flush(handle) && ok;
+            }
+        }
+        return ok;
+    }
+
+    /*
+     * Сбросить на диск все накопленные данные. Дескрипторы остаются открытыми.
+     */
+    bool FlushAll() {
+        bool ok = true;
+        for (auto& [id, handle] : handles_) {
+            ok = Flush(handle) && ok;
+        }
+        return ok;
+    }
+
+    /*
+     * Сбросить данные и закрыть все дескрипторы.
+     * Нужно вызывать, когда закэшированные пути могли начать указывать на другие файлы (например, после `rm`).
+     */
+    bool CloseAll() {
+        bool ok = FlushAll();
+        for (auto& [id, handle] : handles_) {
+            ::close(handle.fd);
+        }
+        handles_.clear();
+        paths_.clear();
+        lru_.clear();
+        return ok;
+    }
+
+    /*
+     * Сбросить данные и закрыть дескриптор файла, дописанного через `path`, если он есть в кэше.
+     */
+    bool Close(std::string_view path) {
+        auto alias = paths_.find(path);
+        if (alias == paths_.end()) return true;
+        return CloseHandle(handles_.find(alias->second));
+    }
+
+    /*
+     * Вернуть errno первой неудачной записи после предыдущего вызова (или 0) и путь, через который
+     * дописывался этот файл, и забыть эту ошибку.
+     */
+    int TakeError(std::string& path) {
+        const int code = error_;
+        path = std::move(errorPath_);
+        error_ = 0;
+        errorPath_.clear();
+        return code;
+    }
+
+private:
+    struct FileId {
+        dev_t dev;
+        ino_t ino;
+
+        bool operator==(const FileId& other) const {
+            return dev == other.dev && ino == other.ino;
+        }
+    };
+
+    struct FileIdHash {
+        size_t operator()(const FileId& id) const {
+            return std::hash<uint64_t>()(static_cast<uint64_t>(id.ino) * 1000003 ^ static_cast<uint64_t>(id.dev));
+        }
+    };
+
+    // Ключи `paths_` указывают на строки в `names`, которые не перемещаются в памяти
+    struct Handle {
+        int fd;
+        std::string buffer;
+        std::list<FileId>::iterator lruPos;
+        std::chrono::steady_clock::time_point firstPending;
+        std::list<std::string> names;  // пути, через которые дописывался файл
+    };
+
+    /*
+     * Открыть файл `path` и найти его в кэше по inode или добавить в кэш.
+     */
+    Handle* Open(std::string_view path) {
+        const std::string name(path);
+        int fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        if (fd < 0) return nullptr;
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            int code = errno;
+            ::close(fd);
+            errno = code;
+            return nullptr;
+        }
+        ++stats_.appendOpens;
+        const FileId id{st.st_dev, st.st_ino};
+        auto it = handles_.find(id);
+        if (it != handles_.end()) {
+            ::close(fd);
+            lru_.splice(lru_.begin(), lru_, it->second.lruPos);
+        } else {
+            if (handles_.size() >= maxHandles_ && !Evict()) {
+                int code = errno;
+                ::close(fd);
+                errno = code;
+                return nullptr;
+            }
+            lru_.push_front(id);
+            it = handles_.emplace(id, Handle{fd, {}, lru_.begin(), {}, {}}).first;
+        }
+        Handle& handle = it->second;
+        handle.names.push_back(name);
+        paths_.emplace(handle.names.back(), id);
+        return &handle;
+    }
+
+    bool Flush(Handle& handle) {
+        if (handle.buffer.empty()) return true;
+        size_t done = 0;
+        while (done < handle.buffer.size()) {
+            ssize_t written = ::write(handle.fd, handle.buffer.data() + done, handle.buffer.size() - done);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                // Недописанное остается в буфере: его можно дописать следующим сбросом
+                const int code = errno;
+                handle.buffer.erase(0, done);
+                if (!error_) error_ = code, errorPath_ = handle.names.front();
+                errno = code;
+                return false;
+            }
+            ++stats_.appendWrites;
+            done += static_cast<size_t>(written);
+        }
+        handle.buffer.clear();
+        if (sync_) {
+            sync_->AddAppended(handle.names.front(), handle.fd);
+        }
+        return true;
+    }
+
+    /*
+     * Проверить, что закэшированный путь все еще указывает на тот же файл, что и дескриптор.
+     */
+    bool Current(std::unordered_map<std::string_view, FileId>::iterator alias) const {
+        struct stat st;
+        // Ключ указывает на строку из `names`, поэтому он заканчивается нулем
+        if (::stat(alias->first.data(), &st) != 0) return false;
+        return FileId{st.st_dev, st.st_ino} == alias->second;
+    }
+
+    /*
+     * Забыть путь `alias`; дескриптор закрывается, если через другие пути файл больше не дописывается.
+     */
+    bool Forget(std::unordered_map<std::string_view, FileId>::iterator alias) {
+        auto it = handles_.find(alias->second);
+        std::list<std::string>& names = it->second.names;
+        if (names.size() == 1) return CloseHandle(it);
+        const char* key = alias->first.data();
+        paths_.erase(alias);
+        names.remove_if([key](const std::string& name) { return name.data() == key; });
+        return true;
+    }
+
+    bool CloseHandle(std::unordered_map<FileId, Handle, FileIdHash>::iterator it) {
+        bool ok = Flush(it->second);
+        ::close(it->second.fd);
+        for (const std::string& name : it->second.names) {
+            paths_.erase(name);
+        }
+        lru_.erase(it->second.lruPos);
+        handles_.erase(it);
+        return ok;
+    }
+
+    bool Evict() {
+        auto it = handles_.find(lru_.back());
+        // Пока данные не записаны, файл не вытесняется, чтобы они не потерялись
+        return Flush(it->second) && CloseHandle(it);
+    }
+
+    ShellStats& stats_;
+    SyncGroup* sync_ = nullptr;
+    size_t maxHandles_;
+    size_t bufferLimit_;
+    std::chrono::milliseconds flushInterval_;
+    std::unordered_map<FileId, Handle, FileIdHash> handles_;
+    std::unordered_map<std::string_view, FileId> paths_;
+    std::list<FileId> lru_;
+    int error_ = 0;
+    std::string errorPath_;
+};
+
+/*
+ * Скрипт, скомпилированный в компактный байткод.
+ * Скрипт состоит из команд, присваиваний `NAME=value` и циклов `for NAME in <words>; do ...; done`,
+ * разделенных переводами строк или `;`. В словах подставляются значения переменных `$NAME` и `${NAME}`.
+ * Все строки скрипта хранятся в таблице `strings`, слово -- это последовательность частей (литерал или переменная),
+ * а код -- последовательность 32-битных инструкций с операндами:
+ * - Exec <n> <word>...       -- подставить переменные в слова и выполнить получившуюся команду
+ * - Set <name> <word>        -- присвоить переменной значение слова
+ * - ForBegin <n> <word>...   -- начать цикл по словам (после подстановки переменных и разбиения по пробелам)
+ * - ForNext <name> <target>  -- присвоить переменной следующее значение цикла или закончить цикл и перейти на <target>
+ * - Jump <target>            -- перейти на инструкцию <target>
+ * Скомпилированный скрипт можно сохранить в файл и загрузить обратно, не разбирая текст скрипта заново.
+ */
+struct ScriptProgram {
+    enum Op : uint32_t {
+        Exec, Set, ForBegin, ForNext, Jump
+    };
+
+    std::vector<std::string> strings;
+    std::vector<uint32_t> parts;  // (индекс строки << 1) | 1, если часть -- имя переменной
+    std::vector<uint32_t> words;  // пары (первая часть, количество частей)
+    std::vector<uint32_t> code;
+
+    /*
+     * Хэш текста скрипта, по которому ищется скомпилированный байткод (FNV-1a).
+     */
+    static uint64_t Hash(const std::string& source) {
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : source) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    /*
+     * Скомпилировать текст скрипта. Возвращает false при синтаксической ошибке.
+     */
+    bool Compile(const std::string& source) {
+        std::vector<std::string> statements(1);
+        for (char c : source) {
+            if (c == '\n' || c == ';') {
+                statements.emplace_back();
+            } else {
+                statements.back() += c;
+            }
+        }
+
+        std::unordered_map<std::string, uint32_t> interned;
+        std::vector<size_t> loops;
+        bool expectDo = false;
+        for (const std::string& statement : statements) {
+            std::istringstream iss(statement);
+            std::vector<std::string> tokens;
+            std::string token;
+            while (iss >> token) {
+                tokens.push_back(token);
+            }
+            if (tokens.empty() || tokens[0][0] == '#') continue;
+
+            if (tokens[0] == "do") {
+                if (!expectDo) return false;
+                expectDo = false;
+                tokens.erase(tokens.begin());
+                if (tokens.empty()) continue;
+            } else if (expectDo) {
+                return false;
+            }
+
+            if (tokens[0] == "done") {
+                if (tokens.size() != 1 || loops.empty()) return false;
+                code.push_back(Jump);
+                code.push_back(static_cast<uint32_t>(loops.back()));
+                code[loops.back() + 2] = static_cast<uint32_t>(code.size());
+                loops.pop_back();
+            } else if (tokens[0] == "for") {
+                if (tokens.size() < 3 || !IsName(tokens[1]) || tokens[2] != "in") return false;
+                EmitWords(ForBegin, tokens.begin() + 3, tokens.end(), interned);
+                loops.push_back(code.size());
+                code.push_back(ForNext);
+                code.push_back(Intern(tokens[1], interned));
+                code.push_back(0);
+                expectDo = true;
+            } else if (size_t eq = tokens[0].find('='); tokens.size() == 1 && eq != std::string::npos &&
+                                                          IsName(tokens[0].substr(0, eq))) {
+                code.push_back(Set);
+                code.push_back(Intern(tokens[0].substr(0, eq), interned));
+                code.push_back(CompileWord(tokens[0].substr(eq + 1), interned));
+            } else {
+                EmitWords(Exec, tokens.begin(), tokens.end(), interned);
+            }
+        }
+        return loops.empty() && !expectDo;
+    }
+
+    /*
+     * Подставить переменные в слово `word`. Если `split`, то результат разбивается по пробелам на несколько слов.
+     */
+    template <typename Words>
+    void ExpandWord(uint32_t word, const std::unordered_map<std::string, std::string>& variables, bool split,
+                    Words& result) const {
+        std::string value;
+        for (uint32_t i = 0; i < words[2 * word + 1]; ++i) {
+            uint32_t part = parts[words[2 * word] + i];
+            const std::string& text = strings[part >> 1];
+            if (part & 1) {
+                auto it = variables.find(text);
+                if (it != variables.end()) value += it->second;
+            } else {
+                value += text;
+            }
+        }
+        if (!split) {
+            result.emplace_back(value.data(), value.size());
+            return;
+        }
+        std::istringstream iss(value);
+        std::string token;
+        while (iss >> token) {
+            result.emplace_back(token.data(), token.size());
+        }
+    }
+
+    /*
+     * Сохранить байткод вместе с текстом скрипта `source`: по нему `Load` проверяет, что файл относится именно
+     * к этому скрипту, а не к другому с тем же хэшем.
+     */
+    bool Save(const fs::path& file, const std::string& source) const {
+        std::string data;
+        auto put = [&data](uint64_t value, size_t size) {
+            data.append(reinterpret_cast<const char*>(&value), size);
+        };
+        data.append(kMagic, 4);
+        put(kVersion, 4);
+        put(source.size(), 8);
+        data += source;
+        put(strings.size(), 4);
+        for (const std::string& str : strings) {
+            put(str.size(), 4);
+            data += str;
+        }
+        for (const std::vector<uint32_t>* table : {&parts, &words, &code}) {
+            put(table->size(), 4);
+            data.append(reinterpret_cast<const char*>(table->data()), table->size() * sizeof(uint32_t));
+        }
+
+        fs::path tmp = file;
+        tmp += ".tmp" + std::to_string(::getpid());
+        {
+            std::ofstream to(tmp, std::ios::binary | std::ios::trunc);
+            if (!to.write(data.data(), data.size())) return false;
+        }
+        std::error_code ec;
+        fs::rename(tmp, file, ec);
+        return !ec;
+    }
+
+    /*
+     * Загрузить байткод, ранее сохраненный для скрипта `source`.
+     * Поврежденный или устаревший файл, файл другого скрипта и файл, принадлежащий другому пользователю, не загружаются.
+     */
+    bool Load(const fs::path& file, const std::string& source) {
+        std::ifstream from(file, std::ios::binary);
+        if (!from.is_open()) return false;
+        struct stat st;
+        if (::stat(file.c_str(), &st) != 0 || st.st_uid != ::geteuid()) return false;
+        std::string data((std::istreambuf_iterator<char>(from)), std::istreambuf_iterator<char>());
+        size_t pos = 0;
+        auto get = [&](size_t size, uint64_t& value) {
+            value = 0;
+            if (data.size() - pos < size) return false;
+            std::memcpy(&value, data.data() + pos, size);
+            pos += size;
+            return true;
+        };
+        uint64_t value;
+        if (data.compare(0, 4, kMagic, 4) != 0) return false;
+        pos = 4;
+        if (!get(4, value) || value != kVersion || !get(8, value) || value != source.size() ||
+            data.compare(pos, source.size(), source) != 0) {
+            return false;
+        }
+        pos += source.size();
+        if (!get(4, value)) return false;
+        strings.resize(value);
+        for (std::string& str : strings) {
+            if (!get(4, value) || data.size() - pos < value) return false;
+            str.assign(data, pos, value);
+            pos += value;
+        }
+        for (std::vector<uint32_t>* table : {&parts, &words, &code}) {
+            if (!get(4, value) || (data.size() - pos) / sizeof(uint32_t) < value) return false;
+            table->resize(value);
+            std::memcpy(table->data(), data.data() + pos, value * sizeof(uint32_t));
+            pos += value * sizeof(uint32_t);
+        }
+        return pos == data.size() && Validate();
+    }
+
+private:
+    static constexpr char kMagic[] = "SHBC";
+    static constexpr uint32_t kVersion = 2;
+
+    static bool IsName(const std::string& name) {
+        if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) return false;
+        return std::all_of(name.begin(), name.end(), [](char c) {
+            return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+        });
+    }
+
+    uint32_t Intern(const std::string& str, std::unordered_map<std::string, uint32_t>& interned) {
+        auto [it, inserted] = interned.emplace(str, static_cast<uint32_t>(strings.size()));
+        if (inserted) strings.push_back(str);
+        return it->second;
+    }
+
+    uint32_t CompileWord(const std::string& word, std::unordered_map<std::string, uint32_t>& interned) {
+        const uint32_t first = static_cast<uint32_t>(parts.size());
+        std::string literal;
+        for (size_t i = 0; i < word.size();) {
+            size_t nameBegin = i + 1, nameEnd = i + 1;
+            if (word[i] == '$' && i + 1 < word.size() && word[i + 1] == '{') {
+                nameBegin = i + 2;
+                nameEnd = word.find('}', nameBegin);
+                if (nameEnd == std::string::npos || !IsName(word.substr(nameBegin, nameEnd - nameBegin))) {
+                    nameEnd = nameBegin;
+                }
+            } else if (word[i] == '$') {
+                while (nameEnd < word.size() && (std::isalnum(static_cast<unsigned char>(word[nameEnd])) ||
+                                                 word[nameEnd] == '_')) {
+                    ++nameEnd;
+                }
+                if (!IsName(word.substr(nameBegin, nameEnd - nameBegin))) nameEnd = nameBegin;
+            }
+            if (word[i] != '$' || nameEnd == nameBegin) {
+                literal += word[i++];
+                continue;
+            }
+            if (!literal.empty()) {
+                parts.push_back(Intern(literal, interned) << 1);
+                literal.clear();
+            }
+            parts.push_back(Intern(word.substr(nameBegin, nameEnd - nameBegin), interned) << 1 | 1);
+            i = word[i + 1] == '{' ? nameEnd + 1 : nameEnd;
+        }
+        if (!literal.empty()) {
+            parts.push_back(Intern(literal, interned) << 1);
+        }
+        words.push_back(first);
+        words.push_back(static_cast<uint32_t>(parts.size()) - first);
+        return static_cast<uint32_t>(words.size() / 2 - 1);
+    }
+
+    void EmitWords(Op op, std::vector<std::string>::const_iterator begin, std::vector<std::string>::const_iterator end,
+                   std::unordered_map<std::string, uint32_t>& interned) {
+        code.push_back(op);
+        code.push_back(static_cast<uint32_t>(end - begin));
+        for (auto it = begin; it != end; ++it) {
+            code.push_back(CompileWord(*it, interned));
+        }
+    }
+
+    /*
+     * Проверить, что все индексы в загруженном байткоде корректны.
+     */
+    bool Validate() const {
+        const size_t wordCount = words.size() / 2;
+        if (words.size() % 2) return false;
+        for (uint32_t part : parts) {
+            if ((part >> 1) >= strings.size()) return false;
+        }
+        for (size_t i = 0; i < wordCount; ++i) {
+            if (words[2 * i] > parts.size() || words[2 * i + 1] > parts.size() - words[2 * i]) return false;
+        }
+        for (size_t pc = 0; pc < code.size();) {
+            const size_t left = code.size() - pc;
+            switch (code[pc]) {
+                case Exec:
+                case ForBegin:
+                    if (left < 2 || code[pc + 1] > left - 2) return false;
+                    for (size_t k = 0; k < code[pc + 1]; ++k) {
+                        if (code[pc + 2 + k] >= wordCount) return false;
+                    }
+                    pc += 2 + code[pc + 1];
+                    break;
+                case Set:
+                    if (left < 3 || code[pc + 1] >= strings.size() || code[pc + 2] >= wordCount) return false;
+                    pc += 3;
+                    break;
+                case ForNext:
+                    if (left < 3 || code[pc + 1] >= strings.size() || code[pc + 2] > code.size()) return false;
+                    pc += 3;
+                    break;
+                case Jump:
+                    if (left < 2 || code[pc + 1] >= code.size() || code[code[pc + 1]] != ForNext) return false;
+                    pc += 2;
+                    break;
+                default:
+                    return false;
+            }
+        }
+        return true;
+    }
+};
+
+/*
+ * Индекс имен файлов под некоторым корнем (`index build`, `index update`, `locate`).
+ * Файл индекса отображается в память целиком и читается без разбора: в нем лежат отсортированные пути
+ * относительно корня в front-coding (длина общего с предыдущим путем префикса и остаток), а также таблица
+ * mtime всех директорий, по которой `index update` перечитывает только изменившиеся директории.
+ */
+class NameIndex {
+public:
+    struct Entry {
+        std::string path;  // путь относительно корня
+        bool dir;
+    };
+
+    NameIndex() = default;
+    NameIndex(const NameIndex&) = delete;
+    NameIndex& operator=(const NameIndex&) = delete;
+
+    ~NameIndex() {
+        if (data_) ::munmap(const_cast<char*>(data_), size_);
+    }
+
+    /*
+     * Отобразить в память файл индекса. Возвращает false (с errno), если файла нет или он поврежден.
+     */
+    bool Open(const fs::path& file) {
+        int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(kHeaderSize)) {
+            ::close(fd);
+            errno = EINVAL;
+            return false;
+        }
+        void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) return false;
+        data_ = static_cast<const char*>(data);
+        size_ = st.st_size;
+
+        uint32_t version, rootSize;
+        std::memcpy(&version, data_ + 4, 4);
+        std::memcpy(&rootSize, data_ + 8, 4);
+        std::memcpy(&scanTime_, data_ + 12, 8);
+        std::memcpy(&entryCount_, data_ + 20, 8);
+        std::memcpy(&dirCount_, data_ + 28, 8);
+        if (std::memcmp(data_, kMagic, 4) != 0 || version != kVersion || rootSize > size_ - kHeaderSize ||
+            dirCount_ > (size_ - kHeaderSize - rootSize) / sizeof(int64_t)) {
+            errno = EINVAL;
+            return false;
+        }
+        root_ = std::string_view(data_ + kHeaderSize, rootSize);
+        dirMtimes_ = data_ + kHeaderSize + rootSize;
+        entries_ = dirMtimes_ + dirCount_ * sizeof(int64_t);
+        return true;
+    }
+
+    std::string_view Root() const {
+        return root_;
+    }
+
+    /*
+     * Вызвать `onMatch(path)` для каждого пути, содержащего `pattern`, в порядке сортировки.
+     * Благодаря front-coding в каждом пути просматривается только та часть, которой не было в предыдущем пути:
+     * если предыдущий путь содержал `pattern` внутри общего префикса, то и этот путь его содержит.
+     * Возвращает false, если индекс поврежден.
+     */
+    template <typename Callback>
+    bool Locate(std::string_view pattern, Callback&& onMatch) const {
+        std::string path;
+        size_t matchEnd = std::string::npos;  // конец первого вхождения в предыдущем пути
+        return Decode(path, [&](size_t shared, bool) {
+            if (matchEnd == std::string::npos || matchEnd > shared) {
+                size_t from = shared >= pattern.size() ? shared - pattern.size() + 1 : 0;
+                size_t pos = Find(path.data() + from, path.size() - from, pattern);
+                matchEnd = pos == std::string::npos ? pos : from + pos + pattern.size();
+            }
+            if (matchEnd != std::string::npos) onMatch(std::string_view(path));
+        });
+    }
+
+    /*
+     * Вызвать `onEntry(path, dir, mtime)` для каждого пути; `mtime` имеет смысл только для директорий.
+     */
+    template <typename Callback>
+    bool ForEach(Callback&& onEntry) const {
+        std::string path;
+        uint64_t dir = 1;  // mtime корня лежит в таблице первым
+        return Decode(path, [&](size_t, bool isDir) {
+            int64_t mtime = 0;
+            if (isDir && dir < dirCount_) std::memcpy(&mtime, dirMtimes_ + dir++ * sizeof(int64_t), sizeof(mtime));
+            onEntry(std::string_view(path), isDir, mtime);
+        });
+    }
+
+    /*
+     * Обойти дерево под `root` и собрать все пути в `entries`. Если передан `previous` -- индекс того же корня, то
+     * директории, не изменившиеся с момента его построения, не читаются заново: их содержимое берется из него.
+     */
+    static bool Scan(const std::string& root, const NameIndex* previous, ShellStats& stats,
+                     std::vector<Entry>& entries, std::vector<int64_t>& dirMtimes, int64_t& scanTime) {
+        struct KnownDir {
+            int64_t mtime = -1;
+            std::vector<std::pair<std::string, bool>> children;
+        };
+        std::unordered_map<std::string, KnownDir> known;
+        if (previous) {
+            int64_t rootMtime;
+            std::memcpy(&rootMtime, previous->dirMtimes_, sizeof(rootMtime));
+            known[""].mtime = previous->dirCount_ ? rootMtime : -1;
+            bool ok = previous->ForEach([&](std::string_view path, bool dir, int64_t mtime) {
+                size_t slash = path.rfind('/');
+                std::string parent(slash == std::string_view::npos ? std::string_view() : path.substr(0, slash));
+                known[parent].children.emplace_back(path.substr(slash + 1), dir);
+                if (dir) known[std::string(path)].mtime = mtime;
+            });
+            if (!ok) known.clear();
+        }
+        // Директория, измененная в тот же тик часов, что и начало предыдущего обхода, могла измениться уже
+        // после того, как ее прочитали, поэтому переиспользуются только директории со строго более старым mtime
+        const int64_t previousScan = previous ? previous->scanTime_ : 0;
+        struct timespec now;
+        ::clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        scanTime = now.tv_sec * 1000000000LL + now.tv_nsec;
+
+        int rootFd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (rootFd < 0) return false;
+        std::unordered_map<std::string, int64_t> mtimes;
+        std::vector<std::string> stack(1);
+        std::vector<std::pair<std::string, bool>> children;
+        while (!stack.empty()) {
+            std::string dir = std::move(stack.back());
+            stack.pop_back();
+            int fd = dir.empty() ? ::dup(rootFd) : ::openat(rootFd, dir.c_str(),
+                                                             O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            struct stat st;
+            if (fd < 0 || ::fstat(fd, &st) != 0) {
+                if (fd >= 0) ::close(fd);
+                continue;
+            }
+            const int64_t mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+            mtimes[dir] = mtime;
+
+            auto it = known.find(dir);
+            if (it != known.end() && it->second.mtime == mtime && mtime < previousScan) {
+                ++stats.indexDirsReused;
+                children.swap(it->second.children);
+                ::close(fd);
+            } else {
+                ++stats.indexDirsScanned;
+                children.clear();
+                DIR* stream = ::fdopendir(fd);
+                if (!stream) {
+                    ::close(fd);
+                    continue;
+                }
+                while (const struct dirent* entry = ::readdir(stream)) {
+                    if (entry->d_name[0] == '.' &&
+                        (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) {
+                        continue;
+                    }
+                    bool isDir = entry->d_type == DT_DIR;
+                    if (entry->d_type == DT_UNKNOWN) {
+                        struct stat child;
+                        isDir = ::fstatat(::dirfd(stream), entry->d_name, &child, AT_SYMLINK_NOFOLLOW) == 0 &&
+                                S_ISDIR(child.st_mode);
+                    }
+                    children.emplace_back(entry->d_name, isDir);
+                }
+                ::closedir(stream);
+            }
+
+            for (auto& [name, isDir] : children) {
+                std::string path = dir.empty() ? std::move(name) : dir + '/' + name;
+                if (isDir) stack.push_back(path);
+                entries.push_back({std::move(path), isDir});
+            }
+        }
+        ::close(rootFd);
+
+        std::sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+            return lhs.path < rhs.path;
+        });
+        dirMtimes.clear();
+        dirMtimes.push_back(mtimes[""]);
+        for (const Entry& entry : entries) {
+            if (entry.dir) dirMtimes.push_back(mtimes.count(entry.path) ? mtimes[entry.path] : 0);
+        }
+        return true;
+    }
+
+    /*
+     * Записать индекс в файл `file` (через временный файл и rename, так что читатели видят либо старый, либо новый
+     * индекс целиком).
+     */
+    static bool Write(const fs::path& file, const std::string& root, const std::vector<Entry>& entries,
+                      const std::vector<int64_t>& dirMtimes, int64_t scanTime) {
+        std::string data;
+        auto put = [&data](uint64_t value, size_t size) {
+            data.append(reinterpret_cast<const char*>(&value), size);
+        };
+        auto putVarint = [&data](uint64_t value) {
+            for (; value >= 0x80; value >>= 7) data += static_cast<char>(value | 0x80);
+            data += static_cast<char>(value);
+        };
+        data.append(kMagic, 4);
+        put(kVersion, 4);
+        put(root.size(), 4);
+        put(scanTime, 8);
+        put(entries.size(), 8);
+        put(dirMtimes.size(), 8);
+        data += root;
+        data.append(reinterpret_cast<const char*>(dirMtimes.data()), dirMtimes.size() * sizeof(int64_t));
+        std::string_view previous;
+        for (const Entry& entry : entries) {
+            size_t shared = 0;
+            const size_t limit = std::min(previous.size(), entry.path.size());
+            while (shared < limit && previous[shared] == entry.path[shared]) ++shared;
+            putVarint(shared << 1 | entry.dir);
+            putVarint(entry.path.size() - shared);
+            data.append(entry.path, shared, std::string::npos);
+            previous = entry.path;
+        }
+
+        fs::path tmp = file;
+        tmp += ".tmp" + std::to_string(::getpid());
+        {
+            std::ofstream to(tmp, std::ios::binary | std::ios::trunc);
+            if (!to.write(data.data(), data.size())) return false;
+        }
+        std::error_code ec;
+        fs::rename(tmp, file, ec);
+        return !ec;
+    }
+
+    /*
+     * Позиция первого вхождения `pattern` в `text` или npos.
+     * Кандидаты ищутся по 16 позиций за раз: совпадение первого и последнего символов образца проверяется
+     * SSE2-сравнением, и только для найденных кандидатов сравнивается образец целиком.
+     */
+    static size_t Find(const char* text, size_t size, std::string_view pattern) {
+        const size_t length = pattern.size();
+        if (length == 0) return 0;
+        if (size < length) return std::string::npos;
+        size_t pos = 0;
+#ifdef __SSE2__
+        const __m128i first = _mm_set1_epi8(pattern[0]);
+        const __m128i last = _mm_set1_epi8(pattern[length - 1]);
+        for (; pos + length - 1 + 16 <= size; pos += 16) {
+            const __m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + pos));
+            const __m128i blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + pos + length - 1));
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, blockFirst),
+                                                            _mm_cmpeq_epi8(last, blockLast)));
+            for (; mask; mask &= mask - 1) {
+                const size_t candidate = pos + __builtin_ctz(mask);
+                if (std::memcmp(text + candidate, pattern.data(), length) == 0) return candidate;
+            }
+        }
+#endif
+        size_t found = std::string_view(text + pos, size - pos).find(pattern);
+        return found == std::string_view::npos ? found : pos + found;
+    }
+
+private:
+    static constexpr char kMagic[] = "SHIX";
+    static constexpr uint32_t kVersion = 1;
+    static constexpr size_t kHeaderSize = 36;
+
+    /*
+     * Раскодировать пути по порядку в `path`, вызывая `onEntry(shared, dir)` после каждого.
+     */
+    template <typename Callback>
+    bool Decode(std::string& path, Callback&& onEntry) const {
+        const char* pos = entries_;
+        const char* end = data_ + size_;
+        auto getVarint = [&pos, end](uint64_t& value) {
+            value = 0;
+            for (int shift = 0; pos < end && shift < 64; shift += 7) {
+                const unsigned char byte = *pos++;
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) return true;
+            }
+            return false;
+        };
+        for (uint64_t i = 0; i < entryCount_; ++i) {
+            uint64_t header, suffix;
+            if (!getVarint(header) || !getVarint(suffix) || (header >> 1) > path.size() ||
+                suffix > static_cast<uint64_t>(end - pos)) {
+                return false;
+            }
+            path.resize(header >> 1);
+            path.append(pos, suffix);
+            pos += suffix;
+            onEntry(static_cast<size_t>(header >> 1), (header & 1) != 0);
+        }
+        return pos == end;
+    }
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    std::string_view root_;
+    int64_t scanTime_ = 0;
+    uint64_t entryCount_ = 0;
+    uint64_t dirCount_ = 0;
+    const char* dirMtimes_ = nullptr;
+    const char* entries_ = nullptr;
+};
+
+/*
+ * Сортировка имен файлов для `ls`.
+ * Имена сортируются побайтово (как strcmp) поразрядной MSD-сортировкой: элементы раскладываются по очередному
+ * байту имени, и каждая корзина сортируется дальше независимо. Строки при этом не сравниваются целиком и не
+ * копируются -- переставляются только указатели. Для больших директорий корзины первого уровня сортируются
+ * в нескольких потоках.
+ * Вся временная память берется из `resource` (обычно арены команды).
+ */
+class NameSorter {
+public:
+    struct Item {
+        const char* name;
+        uint32_t size;
+        int64_t key;     // размер или mtime для сортировки по `-S`/`-t`
+        uint32_t index;  // номер записи в порядке чтения директории
+    };
+
+    static constexpr size_t kInsertionThreshold = 32;
+    static constexpr size_t kParallelThreshold = 64 * 1024;
+
+    /*
+     * Отсортировать `items` по именам.
+     */
+    static void SortByName(Item* items, size_t count, std::pmr::memory_resource* resource) {
+        if (count < 2) return;
+        std::pmr::vector<Item> temp(count, resource);
+        size_t threads = count >= kParallelThreshold ? std::thread::hardware_concurrency() : 1;
+        if (threads <= 1) {
+            SortRange(items, temp.data(), count, 0);
+            return;
+        }
+
+        // Первый уровень раскладывается здесь, а корзины разбирают потоки: они не пересекаются ни в `items`,
+        // ни в `temp`
+        size_t offsets[kBuckets + 1];
+        Partition(items, temp.data(), count, 0, offsets);
+        std::atomic<size_t> next{1};  // в корзине 0 имена закончились -- они уже равны
+        auto worker = [&]() {
+            for (size_t bucket; (bucket = next++) < kBuckets;) {
+                const size_t begin = offsets[bucket], size = offsets[bucket + 1] - begin;
+                if (size > 1) SortRange(items + begin, temp.data() + begin, size, 1);
+            }
+        };
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < threads; ++i) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+    }
+
+    /*
+     * Устойчиво отсортировать `items` по убыванию `key` (при равных ключах остается порядок по именам).
+     * Поразрядная LSD-сортировка по байтам ключа; проходы, в которых у всех ключей одинаковый байт, пропускаются.
+     */
+    static void SortByKeyDescending(Item* items, size_t count, std::pmr::memory_resource* resource) {
+        if (count < 2) return;
+        std::pmr::vector<Item> temp(count, resource);
+        Item* from = items;
+        Item* to = temp.data();
+        // Убывание знакового ключа -- это возрастание ~(key ^ знаковый бит) как беззнакового
+        auto digit = [](const Item& item, int shift) {
+            return (~(static_cast<uint64_t>(item.key) ^ (uint64_t(1) << 63)) >> shift) & 0xff;
+        };
+        for (int shift = 0; shift < 64; shift += 8) {
+            size_t counts[256] = {};
+            for (size_t i = 0; i < count; ++i) {
+                ++counts[digit(from[i], shift)];
+            }
+            if (counts[digit(from[0], shift)] == count) continue;
+            size_t offset = 0;
+            for (size_t& value : counts) {
+                offset += value;
+                value = offset - value;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                to[counts[digit(from[i], shift)]++] = from[i];
+            }
+            std::swap(from, to);
+        }
+        if (from != items) std::copy(from, from + count, items);
+    }
+
+private:
+    static constexpr size_t kBuckets = 257;  // корзина 0 -- имя уже закончилось, остальные -- байт + 1
+
+    static size_t Bucket(const Item& item, size_t depth) {
+        return depth < item.size ? static_cast<unsigned char>(item.name[depth]) + 1 : 0;
+    }
+
+    /*
+     * Разложить `items` по байту `depth` (через `temp`); границы корзин записываются в `offsets`.
+     */
+    static void Partition(Item* items, Item* temp, size_t count, size_t depth, size_t* offsets) {
+        size_t counts[kBuckets] = {};
+        for (size_t i = 0; i < count; ++i) {
+            ++counts[Bucket(items[i], depth)];
+        }
+        offsets[0] = 0;
+        for (size_t bucket = 0; bucket < kBuckets; ++bucket) {
+            offsets[bucket + 1] = offsets[bucket] + counts[bucket];
+        }
+        size_t positions[kBuckets];
+        std::copy(offsets, offsets + kBuckets, positions);
+        for (size_t i = 0; i < count; ++i) {
+            temp[positions[Bucket(items[i], depth)]++] = items[i];
+        }
+        std::copy(temp, temp + count, items);
+    }
+
+    static void SortRange(Item* items, Item* temp, size_t count, size_t depth) {
+        if (count < kInsertionThreshold) {
+            // Первые `depth` байт у всех элементов совпадают, сравниваем только остаток
+            auto less = [depth](const Item& lhs, const Item& rhs) {
+                const size_t size = std::min(lhs.size, rhs.size) - depth;
+                const int cmp = std::memcmp(lhs.name + depth, rhs.name + depth, size);
+                return cmp < 0 || (cmp == 0 && lhs.size < rhs.size);
+            };
+            for (size_t i = 1; i < count; ++i) {
+                Item item = items[i];
+                size_t j = i;
+                for (; j > 0 && less(item, items[j - 1]); --j) {
+                    items[j] = items[j - 1];
+                }
+                items[j] = item;
+            }
+            return;
+        }
+        size_t offsets[kBuckets + 1];
+        Partition(items, temp, count, depth, offsets);
+        for (size_t bucket = 1; bucket < kBuckets; ++bucket) {
+            const size_t begin = offsets[bucket], size = offsets[bucket + 1] - begin;
+            if (size > 1) SortRange(items + begin, temp + begin, size, depth + 1);
+        }
+    }
+};
+
+/*
+ * Архивы для команды `archive` в формате ustar (их читает и создает обычный tar). Длинные имена записываются
+ * GNU-расширением 'L'/'K'; при распаковке понимаются также pax-заголовки с path/linkpath.
+ *
+ * При создании архива файлы читаются несколькими потоками заранее (но не дальше окна `kReadAhead` записей и
+ * `kReadAheadBytes` байт), а в архив записываются строго по порядку обхода большими последовательными блоками.
+ * При распаковке архив отображается в память; директории создаются по порядку, а файлы создаются и
+ * записываются прямо из отображения несколькими потоками. Жесткие и символические ссылки создаются в самом
+ * конце, так что запись файла не может пройти через ссылку из того же архива.
+ */
+class TarArchive {
+public:
+    using OwnerNames = std::function<std::string_view(bool group, uint32_t id)>;
+
+    static constexpr size_t kBlockSize = 512;
+    static constexpr size_t kRecordSize = 20 * kBlockSize;
+    static constexpr size_t kWriteBufferSize = 1 << 20;
+    static constexpr size_t kInlineFileLimit = 1 << 20;  // файлы больше этого читает сам пишущий поток, по частям
+    static constexpr size_t kReadAhead = 1024;
+    static constexpr size_t kReadAheadBytes = 64 << 20;
+    // Потоки в основном ждут ввода-вывода, поэтому их число не привязано к числу ядер
+    static constexpr size_t kThreads = 8;
+
+    /*
+     * Записать содержимое директории `root` (пути в архиве относительны нее) в файл `archive`.
+     * Возвращает 0 или код ошибки; путь, на котором она произошла, записывается в `errorPath`.
+     */
+    static int Create(const std::string& archive, const std::string& root, const OwnerNames& owners,
+                      std::string& errorPath) {
+        int rootFd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (rootFd < 0) return errorPath = root, errno;
+        int outFd = ::open(archive.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (outFd < 0) {
+            int code = errno;
+            ::close(rootFd);
+            return errorPath = archive, code;
+        }
+        struct stat self;
+        ::fstat(outFd, &self);
+        std::vector<Member> members;
+        int code = Walk(rootFd, "", self, members, errorPath);
+        if (code == 0) code = WriteMembers(rootFd, outFd, members, owners, errorPath);
+        if (::close(outFd) != 0 && code == 0) code = errno, errorPath = archive;
+        ::close(rootFd);
+        return code;
+    }
+
+    /*
+     * Распаковать архив `archive` в директорию `root` (она создается при необходимости).
+     * Пути, ведущие за пределы `root` (абсолютные или с ".."), считаются ошибкой.
+     */
+    static int Extract(const std::string& archive, const std::string& root, std::string& errorPath) {
+        int fd = ::open(archive.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return errorPath = archive, errno;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return errorPath = archive, EINVAL;
+        }
+        void* mapping = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) return errorPath = archive, errno;
+        ::madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+        std::error_code ec;
+        fs::create_directories(root, ec);
+        int rootFd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        int code = rootFd < 0 ? (errorPath = root, errno)
+                              : ExtractMembers(static_cast<const char*>(mapping), st.st_size, rootFd, archive, errorPath);
+        if (rootFd >= 0) ::close(rootFd);
+        ::munmap(mapping, st.st_size);
+        return code;
+    }
+
+private:
+    struct Member {
+        std::string path;  // у директорий -- с завершающим '/'
+        struct stat st;
+        std::string link;
+        std::string data;  // содержимое небольшого файла, прочитанное заранее
+        bool ready = false;
+    };
+
+    static int Walk(int dirFd, const std::string& prefix, const struct stat& skip, std::vector<Member>& members,
+                    std::string& errorPath) {
+        int streamFd = ::dup(dirFd);
+        DIR* stream = streamFd < 0 ? nullptr : ::fdopendir(streamFd);
+        if (!stream) {
+            if (streamFd >= 0) ::close(streamFd);
+            return errorPath = prefix, errno;
+        }
+        std::vector<std::string> names;
+        while (const struct dirent* entry = ::readdir(stream)) {
+            if (!(entry->d_name[0] == '.' &&
+                  (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))) {
+                names.emplace_back(entry->d_name);
+            }
+        }
+        ::closedir(stream);
+        std::sort(names.begin(), names.end());
+
+        for (const std::string& name : names) {
+            Member member;
+            member.path = prefix + name;
+            if (::fstatat(dirFd, name.c_str(), &member.st, AT_SYMLINK_NOFOLLOW) != 0) {
+                return errorPath = member.path, errno;
+            }
+            // Сам архив, если он создается внутри архивируемой директории, не записывается
+            if (member.st.st_dev == skip.st_dev && member.st.st_ino == skip.st_ino) continue;
+            if (S_ISLNK(member.st.st_mode)) {
+                char target[PATH_MAX];
+                ssize_t size = ::readlinkat(dirFd, name.c_str(), target, sizeof(target));
+                if (size < 0) return errorPath = member.path, errno;
+                member.link.assign(target, size);
+                members.push_back(std::move(member));
+            } else if (S_ISREG(member.st.st_mode)) {
+                members.push_back(std::move(member));
+            } else if (S_ISDIR(member.st.st_mode)) {
+                member.path += '/';
+                const std::string childPrefix = member.path;
+                members.push_back(std::move(member));
+                int childFd = ::openat(dirFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (childFd < 0) return errorPath = childPrefix, errno;
+                int code = Walk(childFd, childPrefix, skip, members, errorPath);
+                ::close(childFd);
+                if (code) return code;
+            }
+        }
+        return 0;
+    }
+
+    static bool ReadFile(int rootFd, const std::string& path, size_t size, std::string& data) {
+        int fd = ::openat(rootFd, path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) return false;
+        data.resize(size);
+        errno = 0;
+        size_t done = 0;
+        while (done < size) {
+            ssize_t count = ::read(fd, data.data() + done, size - done);
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0) break;
+            done += count;
+        }
+        int code = errno;
+        ::close(fd);
+        // Файл, укоротившийся после обхода, дополняется нулями до размера из заголовка
+        std::fill(data.begin() + done, data.end(), '\0');
+        errno = code;
+        return done == size || code == 0;
+    }
+
+    static int WriteMembers(int rootFd, int outFd, std::vector<Member>& members, const OwnerNames& owners,
+                            std::string& errorPath) {
+        std::mutex mutex;
+        std::condition_variable readyChanged;  // пишущий поток ждет готовности очередной записи
+        std::condition_variable spaceChanged;  // читатели ждут, пока окно упреждающего чтения сдвинется
+        size_t written = 0, buffered = 0, readersWaiting = 0;
+        int failure = 0;
+        std::string failurePath;
+        std::atomic<size_t> next{0};
+
+        auto reader = [&]() {
+            for (size_t i; (i = next++) < members.size();) {
+                Member& member = members[i];
+                const bool read = S_ISREG(member.st.st_mode) && member.st.st_size > 0 &&
+                                  static_cast<size_t>(member.st.st_size) <= kInlineFileLimit;
+                const size_t size = read ? member.st.st_size : 0;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ++readersWaiting;
+                    spaceChanged.wait(lock, [&]() {
+                        return failure || (i < written + kReadAhead && (i == written || buffered + size <= kReadAheadBytes));
+                    });
+                    --readersWaiting;
+                    if (failure) return;
+                    buffered += size;
+                }
+                bool ok = !read || ReadFile(rootFd, member.path, size, member.data);
+                int code = errno;
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!ok && !failure) failure = code, failurePath = member.path;
+                member.ready = true;
+                if (i == written || failure) readyChanged.notify_one();
+            }
+        };
+        std::vector<std::thread> pool;
+        for (size_t i = 0; i < std::min(kThreads, members.size()); ++i) {
+            pool.emplace_back(reader);
+        }
+
+        std::vector<char> buffer;
+        buffer.reserve(kWriteBufferSize);
+        int code = 0;
+        auto flush = [&]() {
+            if (code == 0 && !WriteAll(outFd, buffer.data(), buffer.size())) code = errno;
+            buffer.clear();
+        };
+        auto emit = [&](const char* data, size_t size) {
+            if (buffer.size() + size > kWriteBufferSize) flush();
+            if (size >= kWriteBufferSize) {
+                if (code == 0 && !WriteAll(outFd, data, size)) code = errno;
+            } else {
+                buffer.insert(buffer.end(), data, data + size);
+            }
+        };
+        auto pad = [&](uint64_t size) {
+            static const char zeros[kBlockSize] = {};
+            emit(zeros, (kBlockSize - size % kBlockSize) % kBlockSize);
+        };
+        auto emitHeader = [&](std::string_view name, char type, uint64_t size, std::string_view link,
+                              const struct stat& st) {
+            // Имена, не помещающиеся в поля ustar, записываются отдельной записью перед заголовком
+            char block[kBlockSize];
+            for (auto [text, longType] : {std::pair<std::string_view, char>(name, 'L'), {link, 'K'}}) {
+                if (text.size() <= 100 || (longType == 'L' && SplitName(text, nullptr))) continue;
+                struct stat none = {};
+                FillHeader(block, "././@LongLink", longType, text.size() + 1, "", none, "root", "root");
+                emit(block, kBlockSize);
+                emit(text.data(), text.size());
+                emit("", 1);
+                pad(text.size() + 1);
+            }
+            FillHeader(block, name, type, size, link, st, owners(false, st.st_uid), owners(true, st.st_gid));
+            emit(block, kBlockSize);
+        };
+
+        for (size_t i = 0; i < members.size() && code == 0; ++i) {
+            Member& member = members[i];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                readyChanged.wait(lock, [&]() { return member.ready || failure; });
+                if (failure) {
+                    code = failure;
+                    errorPath = failurePath;
+                    break;
+                }
+            }
+            const uint64_t size = S_ISREG(member.st.st_mode) ? member.st.st_size : 0;
+            emitHeader(member.path, S_ISDIR(member.st.st_mode) ? '5' : S_ISLNK(member.st.st_mode) ? '2' : '0', size,
+                       member.link, member.st);
+            if (!member.data.empty() || size == 0) {
+                emit(member.data.data(), member.data.size());
+            } else {
+                // Большой файл копируется по частям; если он изменил размер, в архив попадает ровно `size` байт
+                flush();
+                int fd = ::openat(rootFd, member.path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+                if (fd < 0) {
+                    code = errno;
+                    errorPath = member.path;
+                    break;
+                }
+                ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                for (uint64_t left = size; left > 0 && code == 0;) {
+                    buffer.resize(std::min<uint64_t>(left, kWriteBufferSize));
+                    ssize_t count = ::read(fd, buffer.data(), buffer.size());
+                    if (count < 0 && errno == EINTR) continue;
+                    if (count < 0) code = errno, errorPath = member.path;
+                    if (count <= 0) std::fill(buffer.begin(), buffer.end(), '\0');
+                    else buffer.resize(count);
+                    left -= buffer.size();
+                    flush();
+                }
+                ::close(fd);
+            }
+            pad(size);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            buffered -= member.data.size();
+            std::string().swap(member.data);
+            written = i + 1;
+            if (readersWaiting) spaceChanged.notify_all();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!failure) failure = code ? code : -1;  // останавливает читателей, если запись прервалась
+            spaceChanged.notify_all();
+        }
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+        if (code) {
+            if (errorPath.empty()) errorPath = "archive";
+            return code;
+        }
+
+        // Конец архива -- два нулевых блока, а весь архив дополняется до целой записи, как это делает tar
+        static const char zeros[2 * kBlockSize] = {};
+        emit(zeros, sizeof(zeros));
+        uint64_t total = ::lseek(outFd, 0, SEEK_CUR) + buffer.size();
+        while (total % kRecordSize) {
+            emit(zeros, kBlockSize);
+            total += kBlockSize;
+        }
+        flush();
+        return code;
+    }
+
+    static bool WriteAll(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t count = ::write(fd, data, size);
+            if (count < 0 && errno == EINTR) continue;
+            if (count < 0) return false;
+            data += count;
+            size -= count;
+        }
+        return true;
+    }
+
+    /*
+     * Разбить длинное имя на поля prefix (до 155 байт) и name (до 100 байт) заголовка ustar.
+     * Возвращает false, если это невозможно; иначе, если `header` не нулевой, заполняет его поля.
+     */
+    static bool SplitName(std::string_view name, char* header) {
+        if (name.size() <= 100) {
+            if (header) std::memcpy(header, name.data(), name.size());
+            return true;
+        }
+        for (size_t slash = name.find('/'); slash != std::string_view::npos; slash = name.find('/', slash + 1)) {
+            if (slash > 155) break;
+            if (name.size() - slash - 1 <= 100 && slash + 1 < name.size()) {
+                if (header) {
+                    std::memcpy(header, name.data() + slash + 1, name.size() - slash - 1);
+                    std::memcpy(header + 345, name.data(), slash);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void WriteNumber(char* field, size_t width, uint64_t value) {
+        if (value < (uint64_t(1) << (3 * (width - 1)))) {
+            for (size_t i = width - 1; i-- > 0; value >>= 3) {
+                field[i] = static_cast<char>('0' + (value & 7));
+            }
+            field[width - 1] = '\0';
+            return;
+        }
+        // Не помещается в восьмеричное поле: двоичная запись GNU tar со старшим битом в первом байте
+        for (size_t i = width; i-- > 1; value >>= 8) {
+            field[i] = static_cast<char>(value & 0xff);
+        }
+        field[0] = static_cast<char>(0x80);
+    }
+
+    static uint64_t ParseNumber(const char* field, size_t width) {
+        uint64_t value = 0;
+        if (static_cast<unsigned char>(field[0]) & 0x80) {
+            for (size_t i = 1; i < width; ++i) {
+                value = value << 8 | static_cast<unsigned char>(field[i]);
+            }
+            return value;
+        }
+        for (size_t i = 0; i < width && (field[i] == ' ' || (field[i] >= '0' && field[i] <= '7')); ++i) {
+            if (field[i] != ' ') value = value << 3 | (field[i] - '0');
+        }
+        return value;
+    }
+
+    static unsigned Checksum(const char* block) {
+        unsigned sum = 0;
+        for (size_t i = 0; i < kBlockSize; ++i) {
+            sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(block[i]);
+        }
+        return sum;
+    }
+
+    static void FillHeader(char* block, std::string_view name, char type, uint64_t size, std::string_view link,
+                           const struct stat& st, std::string_view user, std::string_view group) {
+        std::memset(block, 0, kBlockSize);
+        if (!SplitName(name, block)) std::memcpy(block, name.data(), 100);
+        WriteNumber(block + 100, 8, st.st_mode & 07777);
+        WriteNumber(block + 108, 8, st.st_uid);
+        WriteNumber(block + 116, 8, st.st_gid);
+        WriteNumber(block + 124, 12, size);
+        WriteNumber(block + 136, 12, st.st_mtim.tv_sec > 0 ? st.st_mtim.tv_sec : 0);
+        block[156] = type;
+        std::memcpy(block + 157, link.data(), std::min<size_t>(link.size(), 100));
+        std::memcpy(block + 257, "ustar\0" "00", 8);
+        std::memcpy(block + 265, user.data(), std::min<size_t>(user.size(), 31));
+        std::memcpy(block + 297, group.data(), std::min<size_t>(group.size(), 31));
+        std::snprintf(block + 148, 8, "%06o", Checksum(block));
+        block[155] = ' ';
+    }
+
+    /*
+     * Путь из архива безопасен, если он относительный и не выходит из корня распаковки.
+     */
+    static bool SafePath(std::string_view path) {
+        if (path.empty() || path[0] == '/') return false;
+        for (size_t pos = 0; pos <= path.size();) {
+            size_t end = std::min(path.find('/', pos), path.size());
+            if (path.substr(pos, end - pos) == "..") return false;
+            pos = end + 1;
+        }
+        return true;
+    }
+
+    static int ExtractMembers(const char* data, size_t size, int rootFd, const std::string& archive,
+                              std::string& errorPath) {
+        struct FileTask {
+            std::string path;
+            mode_t mode;
+            time_t mtime;
+            const char* data;
+            uint64_t size;
+        };
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<FileTask> tasks;
+        bool finished = false;
+        int failure = 0;
+        std::string failurePath;
+        auto fail = [&](int code, const std::string& path) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!failure) failure = code, failurePath = path;
+        };
+
+        auto writer = [&]() {
+            for (;;) {
+                FileTask task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [&]() { return !tasks.empty() || finished; });
+                    if (tasks.empty()) return;
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                int fd = ::openat(rootFd, task.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                                  task.mode);
+                if (fd < 0 || !WriteAll(fd, task.data, task.size)) {
+                    fail(errno, task.path);
+                } else {
+                    struct timespec times[2] = {{task.mtime, 0}, {task.mtime, 0}};
+                    ::futimens(fd, times);
+                }
+                if (fd >= 0) ::close(fd);
+            }
+        };
+        std::vector<std::thread> pool;
+        for (size_t i = 0; i < kThreads; ++i) {
+            pool.emplace_back(writer);
+        }
+
+        std::unordered_set<std::string> directories{""};
+        auto makeDirectory = [&](const std::string& path) {
+            // Создаем и недостающих предков: заголовков директорий в архиве может и не быть
+            if (directories.count(path)) return true;
+            for (size_t slash = path.find('/');; slash = path.find('/', slash + 1)) {
+                const std::string prefix = path.substr(0, slash);
+                if (directories.insert(prefix).second && ::mkdirat(rootFd, prefix.c_str(), 0755) != 0 &&
+                    errno != EEXIST) {
+                    return false;
+                }
+                if (slash == std::string::npos) return true;
+            }
+        };
+        auto parentOf = [](const std::string& path) {
+            size_t slash = path.rfind('/');
+            return slash == std::string::npos ? std::string() : path.substr(0, slash);
+        };
+
+        struct Deferred {
+            std::string path, link;
+            char type;
+            mode_t mode;
+            time_t mtime;
+        };
+        std::vector<Deferred> deferred;
+        std::string longName, longLink;
+        int code = 0;
+        size_t pos = 0;
+        for (; pos + kBlockSize <= size; ) {
+            const char* block = data + pos;
+            if (std::all_of(block, block + kBlockSize, [](char c) { return c == '\0'; })) break;
+            if (ParseNumber(block + 148, 8) != Checksum(block)) {
+                code = EINVAL;
+                break;
+            }
+            const uint64_t memberSize = ParseNumber(block + 124, 12);
+            const char* payload = block + kBlockSize;
+            if (memberSize > size - pos - kBlockSize) {
+                code = EINVAL;
+                break;
+            }
+            pos += kBlockSize + (memberSize + kBlockSize - 1) / kBlockSize * kBlockSize;
+            const char type = block[156];
+
+            if (type == 'L' || type == 'K') {
+                (type == 'L' ? longName : longLink).assign(payload, strnlen(payload, memberSize));
+                continue;
+            }
+            if (type == 'x') {
+                // pax: записи вида "<длина> <ключ>=<значение>\n"
+                for (std::string_view records(payload, memberSize); !records.empty();) {
+                    long long length;
+                    size_t space = records.find(' ');
+                    // Запись не короче "<длина> \n" и заканчивается переводом строки
+                    if (space == std::string_view::npos || !ParseInteger(records.substr(0, space), length) ||
+                        length < static_cast<long long>(space) + 2 || static_cast<size_t>(length) > records.size() ||
+                        records[length - 1] != '\n') {
+                        break;
+                    }
+                    std::string_view record = records.substr(space + 1, length - space - 2);
+                    records.remove_prefix(length);
+                    size_t eq = record.find('=');
+                    if (eq == std::string_view::npos) continue;
+                    if (record.substr(0, eq) == "path") longName = record.substr(eq + 1);
+                    if (record.substr(0, eq) == "linkpath") longLink = record.substr(eq + 1);
+                }
+                continue;
+            }
+            if (type == 'g') continue;
+
+            std::string path = std::move(longName);
+            if (path.empty()) {
+                const std::string_view prefix(block + 345, strnlen(block + 345, 155));
+                path.assign(prefix);
+                if (!path.empty()) path += '/';
+                path.append(block, strnlen(block, 100));
+            }
+            std::string link = std::move(longLink);
+            if (link.empty()) link.assign(block + 157, strnlen(block + 157, 100));
+            longName.clear();
+            longLink.clear();
+            while (!path.empty() && path.back() == '/') path.pop_back();
+            if (!SafePath(path) || (type == '1' && !SafePath(link))) {
+                code = EINVAL;
+                errorPath = path;
+                break;
+            }
+            const mode_t mode = ParseNumber(block + 100, 8) & 07777;
+            const time_t mtime = ParseNumber(block + 136, 12);
+
+            if (type == '5') {
+                if (!makeDirectory(path)) {
+                    code = errno;
+                    errorPath = path;
+                    break;
+                }
+                deferred.push_back({path, "", type, mode, mtime});
+            } else if (type == '0' || type == '\0' || type == '7') {
+                if (!makeDirectory(parentOf(path))) {
+                    code = errno;
+                    errorPath = path;
+                    break;
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks.push_back({std::move(path), mode, mtime, payload, memberSize});
+                changed.notify_one();
+            } else if (type == '1' || type == '2') {
+                if (!makeDirectory(parentOf(path))) {
+                    code = errno;
+                    errorPath = path;
+                    break;
+                }
+                deferred.push_back({std::move(path), std::move(link), type, mode, mtime});
+            }
+        }
+        if (code == 0 && pos + kBlockSize > size) code = EINVAL;  // нет завершающих нулевых блоков
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = true;
+            if (code) tasks.clear();
+            changed.notify_all();
+        }
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+        if (code == 0 && failure) {
+            code = failure;
+            errorPath = failurePath;
+        }
+        if (code) {
+            if (errorPath.empty()) errorPath = archive;
+            return code;
+        }
+
+        // Сначала жесткие ссылки (их цели уже записаны), потом символические, потом права и время директорий
+        // (начиная с самых глубоких, чтобы их mtime не сбросили последующие изменения)
+        std::stable_sort(deferred.begin(), deferred.end(), [](const Deferred& lhs, const Deferred& rhs) {
+            auto rank = [](char type) { return type == '1' ? 0 : type == '2' ? 1 : 2; };
+            return rank(lhs.type) < rank(rhs.type);
+        });
+        for (auto it = deferred.begin(); it != deferred.end(); ++it) {
+            if (it->type == '5') {
+                std::reverse(it, deferred.end());
+                break;
+            }
+        }
+        for (const Deferred& entry : deferred) {
+            bool ok = true;
+            if (entry.type == '1') {
+                ::unlinkat(rootFd, entry.path.c_str(), 0);
+                ok = ::linkat(rootFd, entry.link.c_str(), rootFd, entry.path.c_str(), 0) == 0;
+            } else if (entry.type == '2') {
+                ::unlinkat(rootFd, entry.path.c_str(), 0);
+                ok = ::symlinkat(entry.link.c_str(), rootFd, entry.path.c_str()) == 0;
+            } else {
+                struct timespec times[2] = {{entry.mtime, 0}, {entry.mtime, 0}};
+                ok = ::fchmodat(rootFd, entry.path.c_str(), entry.mode, 0) == 0 &&
+                     ::utimensat(rootFd, entry.path.c_str(), times, AT_SYMLINK_NOFOLLOW) == 0;
+            }
+            if (!ok) {
+                errorPath = entry.path;
+                return errno;
+            }
+        }
+        return 0;
+    }
+
+    static bool ParseInteger(std::string_view text, long long& value) {
+        auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        return ec == std::errc() && end == text.data() + text.size();
+    }
+};
+
+/*
+ * Инкрементальная синхронизация директорий для команды `sync`.
+ * Оба дерева обходятся параллельно, и файлы сравниваются по (размер, mtime): совпадающие не трогаются вовсе.
+ * Новые файлы копируются через copy_file_range (ядро копирует данные само, а на CoW-файловых системах может
+ * просто разделить блоки). В больших измененных файлах ищутся блоки старой версии, которые встречаются в новой
+ * (по скользящей контрольной сумме, как в rsync), и записываются только отличающиеся данные.
+ * Копирование файлов выполняется несколькими потоками.
+ */
+class TreeSync {
+public:
+    static constexpr size_t kThreads = 8;
+    static constexpr uint64_t kDeltaThreshold = 1 << 20;  // меньшие файлы проще скопировать целиком
+
+    struct Result {
+        size_t copied = 0;      // файлов скопировано целиком
+        size_t updated = 0;     // больших файлов обновлено по разнице
+        size_t deleted = 0;     // лишних записей удалено
+        uint64_t written = 0;   // байт записано в файлы назначения
+    };
+
+    /*
+     * Привести `dst` к содержимому `src`. Если `deleteExtraneous`, то записи `dst`, которых нет в `src`, удаляются.
+     * Возвращает 0 или код ошибки; путь, на котором она произошла, записывается в `errorPath`.
+     */
+    static int Run(const std::string& src, const std::string& dst, bool deleteExtraneous, IoThrottle& throttle,
+                   Result& result, std::string& errorPath) {
+        std::error_code ec;
+        fs::create_directories(dst, ec);
+        if (ec) return errorPath = dst, ec.value();
+        Tree source, target;
+        std::thread targetWalk([&]() { Walk(dst, target); });
+        Walk(src, source);
+        targetWalk.join();
+        if (source.error) return errorPath = src + source.errorPath, source.error;
+        if (target.error) return errorPath = dst + target.errorPath, target.error;
+
+        // Лишние записи удаляются первыми: на их месте может появиться запись другого типа
+        if (deleteExtraneous) {
+            for (const auto& [path, node] : target.nodes) {
+                if (path.empty() || source.nodes.count(path)) continue;
+                // Если лишней оказалась родительская директория, то она уже удалена вместе с содержимым
+                const size_t slash = path.rfind('/');
+                if (slash != std::string::npos && !source.nodes.count(path.substr(0, slash))) continue;
+                throttle.Charge(0);
+                fs::remove_all(dst + "/" + path, ec);
+                if (ec) return errorPath = dst + "/" + path, ec.value();
+                ++result.deleted;
+            }
+        }
+
+        std::vector<Job> jobs;
+        std::vector<std::pair<std::string, const Node*>> directories;
+        for (const auto& [path, node] : source.nodes) {
+            const std::string to = path.empty() ? dst : dst + "/" + path;
+            const std::string from = path.empty() ? src : src + "/" + path;
+            auto existing = target.nodes.find(path);
+            const Node* old = existing == target.nodes.end() ? nullptr : &existing->second;
+            if (old && (old->mode & S_IFMT) != (node.mode & S_IFMT)) {
+                fs::remove_all(to, ec);
+                if (ec) return errorPath = to, ec.value();
+                old = nullptr;
+            }
+            if (S_ISDIR(node.mode)) {
+                if (!old && ::mkdir(to.c_str(), 0700) != 0 && errno != EEXIST) return errorPath = to, errno;
+                directories.emplace_back(to, &node);
+            } else if (S_ISLNK(node.mode)) {
+                if (old && old->link == node.link) continue;
+                ::unlink(to.c_str());
+                if (::symlink(node.link.c_str(), to.c_str()) != 0) return errorPath = to, errno;
+            } else if (!old || old->size != node.size || old->mtime != node.mtime) {
+                const bool delta = old && node.size >= kDeltaThreshold && old->size >= kDeltaThreshold;
+                jobs.push_back({from, to, &node, delta});
+            }
+        }
+
+        std::atomic<size_t> next{0};
+        std::mutex mutex;
+        int failure = 0;
+        auto worker = [&]() {
+            Result local;
+            for (size_t i; (i = next++) < jobs.size();) {
+                const Job& job = jobs[i];
+                const bool ok = job.delta ? UpdateDelta(job, throttle, local) : CopyFile(job, throttle, local);
+                if (!ok) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!failure) failure = errno, errorPath = job.to;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            result.copied += local.copied;
+            result.updated += local.updated;
+            result.written += local.written;
+        };
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < std::min(kThreads, jobs.size()); ++i) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+        if (failure) return failure;
+
+        // Права и время директорий выставляются в конце, начиная с самых глубоких
+        for (auto it = directories.rbegin(); it != directories.rend(); ++it) {
+            struct timespec times[2] = {{0, UTIME_OMIT}, ToTimespec(it->second->mtime)};
+            if (::chmod(it->first.c_str(), it->second->mode & 07777) != 0 ||
+                ::utimensat(AT_FDCWD, it->first.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0) {
+                return errorPath = it->first, errno;
+            }
+        }
+        return 0;
+    }
+
+private:
+    struct Node {
+        mode_t mode;
+        uint64_t size;
+        int64_t mtime;  // в наносекундах
+        std::string link;
+    };
+
+    struct Tree {
+        std::map<std::string, Node> nodes;  // по относительному пути; "" -- корень
+        int error = 0;
+        std::string errorPath;
+    };
+
+    struct Job {
+        std::string from, to;
+        const Node* node;
+        bool delta;
+    };
+
+    static struct timespec ToTimespec(int64_t ns) {
+        return {static_cast<time_t>(ns / 1000000000), static_cast<long>(ns % 1000000000)};
+    }
+
+    static void Walk(const std::string& root, Tree& tree) {
+        int rootFd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (rootFd < 0) {
+            tree.error = errno;
+            return;
+        }
+        struct stat st;
+        ::fstat(rootFd, &st);
+        tree.nodes[""] = {st.st_mode, 0, st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec, ""};
+        WalkDirectory(rootFd, "", tree);
+        ::close(rootFd);
+    }
+
+    static void WalkDirectory(int dirFd, const std::string& prefix, Tree& tree) {
+        int streamFd = ::dup(dirFd);
+        DIR* stream = streamFd < 0 ? nullptr : ::fdopendir(streamFd);
+        if (!stream) {
+            if (streamFd >= 0) ::close(streamFd);
+            tree.error = errno, tree.errorPath = "/" + prefix;
+            return;
+        }
+        while (const struct dirent* entry = ::readdir(stream)) {
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            struct stat st;
+            if (::fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;  // удалена во время обхода
+            if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode)) continue;
+            const std::string path = prefix.empty() ? std::string(name) : prefix + "/" + name;
+            Node& node = tree.nodes[path];
+            node = {st.st_mode, static_cast<uint64_t>(st.st_size), st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec, ""};
+            if (S_ISLNK(st.st_mode)) {
+                char target[PATH_MAX];
+                ssize_t size = ::readlinkat(dirFd, name, target, sizeof(target));
+                if (size > 0) node.link.assign(target, size);
+            } else if (S_ISDIR(st.st_mode)) {
+                int childFd = ::openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (childFd < 0) {
+                    tree.error = errno, tree.errorPath = "/" + path;
+                    break;
+                }
+                WalkDirectory(childFd, path, tree);
+                ::close(childFd);
+                if (tree.error) break;
+            }
+        }
+        ::closedir(stream);
+    }
+
+    /*
+     * Выставить файлу права и mtime исходного, чтобы при следующей синхронизации он считался совпадающим.
+     */
+    static bool Finish(int fd, const Node& node) {
+        struct timespec times[2] = {{0, UTIME_OMIT}, ToTimespec(node.mtime)};
+        return ::fchmod(fd, node.mode & 07777) == 0 && ::futimens(fd, times) == 0;
+    }
+
+    /*
+     * Скопировать `length` байт из `in` (с позиции `inOffset`) в `out` (с позиции `outOffset`).
+     */
+    static bool CopyRange(int in, off_t inOffset, int out, off_t outOffset, uint64_t length, IoThrottle& throttle) {
+        while (length > 0) {
+            ssize_t count = ::copy_file_range(in, &inOffset, out, &outOffset, throttle.Chunk(length), 0);
+            if (count > 0) {
+                throttle.Charge(count);
+                length -= count;
+                continue;
+            }
+            if (count == 0) return true;  // файл укоротился во время копирования
+            if (errno == EINTR) continue;
+            if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) return false;
+            // copy_file_range не поддерживается для этой пары файлов: копируем через буфер
+            std::vector<char> buffer(std::min<uint64_t>(length, 1 << 20));
+            while (length > 0) {
+                ssize_t got = ::pread(in, buffer.data(), std::min<uint64_t>(length, buffer.size()), inOffset);
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) return got == 0;
+                throttle.Charge(2 * got, 2);
+                for (ssize_t done = 0; done < got;) {
+                    ssize_t put = ::pwrite(out, buffer.data() + done, got - done, outOffset + done);
+                    if (put < 0 && errno == EINTR) continue;
+                    if (put < 0) return false;
+                    done += put;
+                }
+                inOffset += got;
+                outOffset += got;
+                length -= got;
+            }
+        }
+        return true;
+    }
+
+    /*
+     * Открыть временный файл рядом с `path`; после записи он переименовывается в `path`.
+     */
+    static int CreateTemp(const std::string& path, std::string& temp) {
+        temp = path + ".sync-XXXXXX";
+        return ::mkostemp(temp.data(), O_CLOEXEC);
+    }
+
+    static bool CopyFile(const Job& job, IoThrottle& throttle, Result& result) {
+        int in = ::open(job.from.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (in < 0) return false;
+        std::string temp;
+        int out = CreateTemp(job.to, temp);
+        bool ok = out >= 0 && CopyRange(in, 0, out, 0, job.node->size, throttle) && Finish(out, *job.node);
+        int code = errno;
+        ::close(in);
+        if (out >= 0) ::close(out);
+        if (ok && ::rename(temp.c_str(), job.to.c_str()) != 0) ok = false, code = errno;
+        if (!ok) {
+            if (out >= 0) ::unlink(temp.c_str());
+            errno = code;
+            return false;
+        }
+        ++result.copied;
+        result.written += job.node->size;
+        return true;
+    }
+
+    struct DeltaOp {
+        bool copy;        // блок старой версии или данные новой
+        uint64_t from;    // смещение в старой (copy) или новой версии
+        uint64_t to;      // смещение в результате
+        uint64_t length;
+    };
+
+    /*
+     * Слабая контрольная сумма блока (как в rsync): ее можно сдвинуть на один байт за O(1).
+     */
+    struct RollingSum {
+        uint32_t a = 0, b = 0;
+        size_t length = 0;
+
+        void Init(const unsigned char* data, size_t size) {
+            a = b = 0;
+            length = size;
+            for (size_t i = 0; i < size; ++i) {
+                a += data[i];
+                b += static_cast<uint32_t>(size - i) * data[i];
+            }
+        }
+
+        void Roll(unsigned char out, unsigned char in) {
+            a += in - out;
+            b += a - static_cast<uint32_t>(length) * out;
+        }
+
+        uint32_t Value() const {
+            return (a & 0xffff) | (b << 16);
+        }
+    };
+
+    /*
+     * Обновить большой файл: найти в новой версии блоки старой и записать только остальное.
+     * Если большая часть файла осталась на прежних местах (типичное изменение в середине или дописывание в конец),
+     * файл обновляется на месте: блоки на прежних местах не записываются вовсе, а все остальное записывается из
+     * новой версии. Иначе (например, после вставки в начало) новая версия собирается во временном файле из
+     * сдвинутых блоков старой (через copy_file_range) и новых данных и заменяет старую через rename.
+     * При обновлении на месте mtime выставляется последним, так что прерванное обновление будет повторено
+     * при следующей синхронизации.
+     */
+    static bool UpdateDelta(const Job& job, IoThrottle& throttle, Result& result) {
+        int in = ::open(job.from.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        int old = ::open(job.to.c_str(), O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+        struct stat inStat, oldStat;
+        if (in < 0 || old < 0 || ::fstat(in, &inStat) != 0 || ::fstat(old, &oldStat) != 0) {
+            int code = errno;
+            if (in >= 0) ::close(in);
+            if (old >= 0) ::close(old);
+            errno = code;
+            return false;
+        }
+        const uint64_t newSize = inStat.st_size, oldSize = oldStat.st_size;
+        void* newMap = ::mmap(nullptr, newSize, PROT_READ, MAP_PRIVATE, in, 0);
+        void* oldMap = ::mmap(nullptr, oldSize, PROT_READ, MAP_PRIVATE, old, 0);
+        if (newMap == MAP_FAILED || oldMap == MAP_FAILED) {
+            int code = errno;
+            if (newMap != MAP_FAILED) ::munmap(newMap, newSize);
+            if (oldMap != MAP_FAILED) ::munmap(oldMap, oldSize);
+            ::close(in);
+            ::close(old);
+            errno = code;
+            return false;
+        }
+        const auto* newData = static_cast<const unsigned char*>(newMap);
+        const auto* oldData = static_cast<const unsigned char*>(oldMap);
+        ::madvise(newMap, newSize, MADV_SEQUENTIAL);
+        ::madvise(oldMap, oldSize, MADV_SEQUENTIAL);
+
+        // Размер блока ~ sqrt(размера файла), как в rsync: меньше блоков -- меньше таблица, больше -- точнее
+        size_t block = 4096;
+        while (block < (1 << 17) && block * block < oldSize) block *= 2;
+        const size_t blocks = oldSize / block;
+        std::vector<uint32_t> sums(blocks);
+        std::vector<int32_t> heads(1 << 16, -1), chain(blocks, -1);
+        for (size_t i = blocks; i-- > 0;) {
+            RollingSum sum;
+            sum.Init(oldData + i * block, block);
+            sums[i] = sum.Value();
+            int32_t& head = heads[sums[i] >> 16 ^ (sums[i] & 0xffff)];
+            chain[i] = head;
+            head = static_cast<int32_t>(i);
+        }
+        auto find = [&](uint32_t value, uint64_t pos) -> int64_t {
+            // Сначала блок на той же позиции: это позволит обновить файл на месте
+            if (pos % block == 0 && pos / block < blocks && sums[pos / block] == value &&
+                std::memcmp(newData + pos, oldData + pos, block) == 0) {
+                return pos / block;
+            }
+            for (int32_t i = heads[value >> 16 ^ (value & 0xffff)]; i >= 0; i = chain[i]) {
+                if (sums[i] == value && std::memcmp(newData + pos, oldData + i * block, block) == 0) return i;
+            }
+            return -1;
+        };
+
+        std::vector<DeltaOp> ops;
+        uint64_t pos = 0, literal = 0;
+        RollingSum sum;
+        if (newSize >= block) sum.Init(newData, block);
+        while (blocks > 0 && pos + block <= newSize) {
+            int64_t match = find(sum.Value(), pos);
+            if (match < 0) {
+                if (pos + block < newSize) sum.Roll(newData[pos], newData[pos + block]);
+                ++pos;
+                continue;
+            }
+            if (literal < pos) ops.push_back({false, literal, literal, pos - literal});
+            if (!ops.empty() && ops.back().copy && ops.back().from + ops.back().length == match * block) {
+                ops.back().length += block;
+            } else {
+                ops.push_back({true, static_cast<uint64_t>(match) * block, pos, block});
+            }
+            pos += block;
+            literal = pos;
+            if (pos + block <= newSize) sum.Init(newData + pos, block);
+        }
+        if (literal < newSize) ops.push_back({false, literal, literal, newSize - literal});
+
+        uint64_t moved = 0;
+        for (const DeltaOp& op : ops) {
+            if (!op.copy || op.from != op.to) moved += op.length;
+        }
+        const bool inPlace = moved <= newSize / 2;
+        bool ok = true;
+        uint64_t written = 0;
+        std::string temp;
+        int out = inPlace ? old : CreateTemp(job.to, temp);
+        ok = out >= 0;
+        for (const DeltaOp& op : ops) {
+            if (!ok || (inPlace && op.copy && op.from == op.to)) continue;
+            if (op.copy && !inPlace) {
+                ok = CopyRange(old, op.from, out, op.to, op.length, throttle);
+            } else {
+                // Сдвинутый блок совпадает с новой версией в том же месте, так что все пишется из нее
+                for (uint64_t done = 0; ok && done < op.length;) {
+                    ssize_t put = ::pwrite(out, newData + op.to + done, throttle.Chunk(op.length - done), op.to + done);
+                    if (put < 0 && errno == EINTR) continue;
+                    ok = put >= 0;
+                    if (ok) done += put, throttle.Charge(put);
+                }
+            }
+            written += op.length;
+        }
+        if (ok && inPlace) ok = ::ftruncate(out, newSize) == 0;
+        ok = ok && Finish(out, *job.node);
+        int code = errno;
+        if (!inPlace && out >= 0) {
+            ::close(out);
+            if (ok && ::rename(temp.c_str(), job.to.c_str()) != 0) ok = false, code = errno;
+            if (!ok) ::unlink(temp.c_str());
+        }
+        ::munmap(newMap, newSize);
+        ::munmap(oldMap, oldSize);
+        ::close(in);
+        ::close(old);
+        if (!ok) {
+            errno = code;
+            return false;
+        }
+        ++result.updated;
+        result.written += written;
+        return true;
+    }
+};
+
+/*
+ * Поиск одинаковых файлов под директорией и замена копий жесткими ссылками или reflink-копиями (FICLONE).
+ * Кандидаты отсеиваются стадиями, каждая из которых читает больше предыдущей, но получает меньше файлов:
+ * размер (только stat) -> хэш первого и последнего блоков -> хэш всего содержимого. Большинство файлов
+ * отсеивается на первых двух стадиях и целиком не читается. Чтение блоков и хэширование идут на нескольких потоках.
+ */
+class Deduplicator {
+public:
+    static constexpr size_t kThreads = 8;
+    static constexpr size_t kEdgeBlock = 4096;      // сколько байт читается с начала и с конца файла
+    static constexpr size_t kReadChunk = 1 << 20;
+
+    enum class Mode { Report, Link, Reflink };
+
+    struct Result {
+        size_t files = 0;        // просмотрено непустых обычных файлов
+        size_t fullyRead = 0;    // из них прочитано целиком
+        size_t duplicates = 0;   // найдено копий (не считая первого файла каждой группы)
+        size_t replaced = 0;     // копий заменено ссылками
+        uint64_t bytesRead = 0;  // байт прочитано для сравнения
+        uint64_t reclaimed = 0;  // байт освобождено заменой копий
+    };
+
+    /*
+     * Группа одинаковых файлов. Пути -- относительно корня, по возрастанию; первый файл остается, остальные -- его копии.
+     */
+    struct Group {
+        uint64_t size;
+        std::vector<std::string> paths;
+    };
+
+    /*
+     * Найти одинаковые файлы под `root` и, если `mode` не `Report`, заменить копии. Копии на другой файловой
+     * системе, чем первый файл группы, только выводятся. Перед заменой содержимое сверяется побайтно, поэтому
+     * совпадение хэшей не может привести к потере данных.
+     * Возвращает 0 или код первой ошибки; путь, на котором она произошла, записывается в `errorPath`.
+     */
+    static int Run(const std::string& root, Mode mode, Result& result, std::vector<Group>& groups,
+                   std::string& errorPath) {
+        Context context;
+        context.rootFd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (context.rootFd < 0) return errorPath = root, errno;
+        std::vector<File> files;
+        Walk(context, context.rootFd, "", files);
+        result.files = files.size();
+
+        // Стадия 1: одинаковыми могут быть только файлы одного размера
+        std::vector<File*> candidates;
+        for (File& file : files) {
+            candidates.push_back(&file);
+        }
+        Collide(candidates);
+
+        // Стадия 2: начало и конец. Файлы не больше двух блоков при этом читаются целиком
+        ParallelFor(candidates.size(), [&](size_t i) { HashEdges(context, *candidates[i]); });
+        Collide(candidates);
+
+        // Стадия 3: все содержимое оставшихся больших файлов
+        std::vector<File*> large;
+        for (File* file : candidates) {
+            if (file->size > 2 * kEdgeBlock) large.push_back(file);
+        }
+        ParallelFor(large.size(), [&](size_t i) { HashContents(context, *large[i]); });
+        Collide(candidates);
+
+        std::vector<std::pair<const File*, const File*>> copies;
+        for (size_t begin = 0, end; begin < candidates.size(); begin = end) {
+            end = begin + 1;
+            while (end < candidates.size() && SameKey(*candidates[begin], *candidates[end])) ++end;
+            Group& group = groups.emplace_back();
+            group.size = candidates[begin]->size;
+            for (size_t i = begin; i < end; ++i) {
+                group.paths.push_back(candidates[i]->path);
+                if (i > begin) copies.emplace_back(candidates[begin], candidates[i]);
+            }
+        }
+        std::sort(groups.begin(), groups.end(), [](const Group& a, const Group& b) { return a.paths[0] < b.paths[0]; });
+        result.duplicates = copies.size();
+
+        if (mode != Mode::Report) {
+            ParallelFor(copies.size(), [&](size_t i) { Replace(context, *copies[i].first, *copies[i].second, mode); });
+        }
+        ::close(context.rootFd);
+        result.fullyRead = context.fullyRead;
+        result.replaced = context.replaced;
+        result.bytesRead = context.bytesRead;
+        result.reclaimed = context.reclaimed;
+        if (context.error) errorPath = root + "/" + context.errorPath;
+        return context.error;
+    }
+
+private:
+    struct File {
+        std::string path;  // относительно корня
+        uint64_t size;
+        dev_t device;
+        nlink_t links;
+        uint64_t hash[2] = {0, 0};  // хэш краев, а после стадии 3 -- всего содержимого
+        bool failed = false;        // файл не удалось прочитать, он исключен из сравнения
+    };
+
+    struct Context {
+        int rootFd = -1;
+        std::set<std::pair<dev_t, ino_t>> inodes;  // файлы с несколькими ссылками, уже попавшие в список
+        std::atomic<size_t> fullyRead{0};
+        std::atomic<size_t> replaced{0};
+        std::atomic<uint64_t> bytesRead{0};
+        std::atomic<uint64_t> reclaimed{0};
+        std::mutex mutex;  // защищает ошибку
+        int error = 0;
+        std::string errorPath;
+
+        void Fail(int code, const std::string& path) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) error = code, errorPath = path;
+        }
+    };
+
+    /*
+     * 128-битный некриптографический хэш: четыре независимые 64-битные полосы по 8 байт (раунд как в xxHash64),
+     * которые в конце сворачиваются вместе с длиной.
+     */
+    class Hasher {
+    public:
+        void Update(const char* data, size_t size) {
+            total_ += size;
+            if (pending_ > 0) {
+                const size_t take = std::min(sizeof(buffer_) - pending_, size);
+                std::memcpy(buffer_ + pending_, data, take);
+                pending_ += take, data += take, size -= take;
+                if (pending_ < sizeof(buffer_)) return;
+                Round(buffer_);
+                pending_ = 0;
+            }
+            for (; size >= sizeof(buffer_); data += sizeof(buffer_), size -= sizeof(buffer_)) {
+                Round(data);
+            }
+            std::memcpy(buffer_, data, size);
+            pending_ = size;
+        }
+
+        void Digest(uint64_t hash[2]) {
+            if (pending_ > 0) {
+                std::memset(buffer_ + pending_, 0, sizeof(buffer_) - pending_);
+                Round(buffer_);
+            }
+            hash[0] = Mix(lanes_[0] ^ Rotl(lanes_[1], 17) ^ Rotl(lanes_[2], 31) ^ Rotl(lanes_[3], 47) ^ total_);
+            hash[1] = Mix(lanes_[3] + Rotl(lanes_[2], 13) + Rotl(lanes_[1], 29) + Rotl(lanes_[0], 43) + total_ * kPrime1);
+        }
+
+    private:
+        static constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+        static constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+
+        static uint64_t Rotl(uint64_t value, int bits) {
+            return value << bits | value >> (64 - bits);
+        }
+
+        static uint64_t Mix(uint64_t value) {
+            value ^= value >> 33;
+            value *= kPrime2;
+            value ^= value >> 29;
+            value *= kPrime1;
+            return value ^ value >> 32;
+        }
+
+        void Round(const char* block) {
+            for (int i = 0; i < 4; ++i) {
+                uint64_t word;
+                std::memcpy(&word, block + 8 * i, sizeof(word));
+                lanes_[i] = Rotl(lanes_[i] + word * kPrime2, 31) * kPrime1;
+            }
+        }
+
+        uint64_t lanes_[4] = {kPrime1 + kPrime2, kPrime2, 0, 0 - kPrime1};
+        char buffer_[32];
+        size_t pending_ = 0;
+        uint64_t total_ = 0;
+    };
+
+    static bool SameKey(const File& a, const File& b) {
+        return a.size == b.size && a.hash[0] == b.hash[0] && a.hash[1] == b.hash[1];
+    }
+
+    /*
+     * Оставить среди кандидатов только файлы, у которых есть пара с тем же размером и хэшем, упорядочив их по
+     * (размер, хэш, путь).
+     */
+    static void Collide(std::vector<File*>& candidates) {
+        candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [](const File* file) { return file->failed; }),
+                         candidates.end());
+        std::sort(candidates.begin(), candidates.end(), [](const File* a, const File* b) {
+            return std::tie(a->size, a->hash[0], a->hash[1], a->path) < std::tie(b->size, b->hash[0], b->hash[1], b->path);
+        });
+        size_t kept = 0;
+        for (size_t begin = 0, end; begin < candidates.size(); begin = end) {
+            end = begin + 1;
+            while (end < candidates.size() && SameKey(*candidates[begin], *candidates[end])) ++end;
+            if (end - begin < 2) continue;
+            for (size_t i = begin; i < end; ++i) {
+                candidates[kept++] = candidates[i];
+            }
+        }
+        candidates.resize(kept);
+    }
+
+    template <typename Function>
+    static void ParallelFor(size_t count, Function function) {
+        std::atomic<size_t> next{0};
+        auto worker = [&]() {
+            for (size_t i; (i = next++) < count;) {
+                function(i);
+            }
+        };
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < std::min(kThreads, count); ++i) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+    }
+
+    /*
+     * Собрать непустые обычные файлы. Файл с несколькими жесткими ссылками попадает в список один раз:
+     * его ссылки и так не занимают лишнего места.
+     */
+    static void Walk(Context& context, int dirFd, const std::string& prefix, std::vector<File>& files) {
+        int streamFd = ::dup(dirFd);
+        DIR* stream = streamFd < 0 ? nullptr : ::fdopendir(streamFd);
+        if (!stream) {
+            if (streamFd >= 0) ::close(streamFd);
+            context.Fail(errno, prefix);
+            return;
+        }
+        while (const struct dirent* entry = ::readdir(stream)) {
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_REG && entry->d_type != DT_DIR) continue;
+            struct stat st;
+            if (::fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;  // удален во время обхода
+            const std::string path = prefix.empty() ? std::string(name) : prefix + "/" + name;
+            if (S_ISDIR(st.st_mode)) {
+                int childFd = ::openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (childFd < 0) {
+                    context.Fail(errno, path);
+                    continue;
+                }
+                Walk(context, childFd, path, files);
+                ::close(childFd);
+            } else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+                if (st.st_nlink > 1 && !context.inodes.emplace(st.st_dev, st.st_ino).second) continue;
+                files.push_back({path, static_cast<uint64_t>(st.st_size), st.st_dev, st.st_nlink});
+            }
+        }
+        ::closedir(stream);
+    }
+
+    static bool ReadAt(int fd, char* data, size_t size, off_t offset) {
+        while (size > 0) {
+            ssize_t got = ::pread(fd, data, size, offset);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) {
+                if (got == 0) errno = EIO;  // файл укоротился во время сравнения
+                return false;
+            }
+            data += got, size -= got, offset += got;
+        }
+        return true;
+    }
+
+    static void HashEdges(Context& context, File& file) {
+        int fd = ::openat(context.rootFd, file.path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        char buffer[2 * kEdgeBlock];
+        const size_t tail = file.size > 2 * kEdgeBlock ? kEdgeBlock : 0;
+        const size_t head = tail ? kEdgeBlock : file.size;
+        if (fd < 0 || !ReadAt(fd, buffer, head, 0) || !ReadAt(fd, buffer + head, tail, file.size - tail)) {
+            context.Fail(errno, file.path);
+            file.failed = true;
+        } else {
+            Hasher hasher;
+            hasher.Update(buffer, head + tail);
+            hasher.Digest(file.hash);
+            context.bytesRead += head + tail;
+            if (tail == 0) ++context.fullyRead;
+        }
+        if (fd >= 0) ::close(fd);
+    }
+
+    static void HashContents(Context& context, File& file) {
+        int fd = ::openat(context.rootFd, file.path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            context.Fail(errno, file.path);
+            file.failed = true;
+            return;
+        }
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        std::unique_ptr<char[]> buffer(new char[kReadChunk]);
+        Hasher hasher;
+        for (uint64_t offset = 0; offset < file.size;) {
+            const size_t size = std::min<uint64_t>(kReadChunk, file.size - offset);
+            if (!ReadAt(fd, buffer.get(), size, offset)) {
+                context.Fail(errno, file.path);
+                file.failed = true;
+                break;
+            }
+            hasher.Update(buffer.get(), size);
+            offset += size;
+        }
+        ::close(fd);
+        if (file.failed) return;
+        hasher.Digest(file.hash);
+        context.bytesRead += file.size;
+        ++context.fullyRead;
+    }
+
+    /*
+     * Сравнить содержимое открытых файлов размера `size` побайтно; результат записывается в `same`.
+     * Возвращает false, если файлы не удалось прочитать.
+     */
+    static bool CompareContents(Context& context, int a, int b, uint64_t size, bool& same) {
+        std::unique_ptr<char[]> buffer(new char[2 * kReadChunk]);
+        same = true;
+        for (uint64_t offset = 0; offset < size && same;) {
+            const size_t chunk = std::min<uint64_t>(kReadChunk, size - offset);
+            if (!ReadAt(a, buffer.get(), chunk, offset) || !ReadAt(b, buffer.get() + kReadChunk, chunk, offset)) return false;
+            same = std::memcmp(buffer.get(), buffer.get() + kReadChunk, chunk) == 0;
+            context.bytesRead += 2 * chunk;
+            offset += chunk;
+        }
+        return true;
+    }
+
+    static void Replace(Context& context, const File& original, const File& copy, Mode mode) {
+        if (original.device != copy.device) return;
+        int from = ::openat(context.rootFd, original.path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        int to = ::openat(context.rootFd, copy.path.c_str(), (mode == Mode::Reflink ? O_RDWR : O_RDONLY) | O_NOFOLLOW | O_CLOEXEC);
+        struct stat st;
+        bool same = false;
+        bool ok = from >= 0 && to >= 0 && ::fstat(to, &st) == 0 && CompareContents(context, from, to, copy.size, same);
+        if (ok && same) {
+            if (mode == Mode::Link) {
+                // Ссылка создается под временным именем и атомарно занимает место копии
+                const std::string temp = copy.path + ".dedupe-" + std::to_string(::getpid());
+                ok = ::linkat(context.rootFd, original.path.c_str(), context.rootFd, temp.c_str(), 0) == 0;
+                if (ok && ::renameat(context.rootFd, temp.c_str(), context.rootFd, copy.path.c_str()) != 0) {
+                    const int code = errno;
+                    ::unlinkat(context.rootFd, temp.c_str(), 0);
+                    errno = code, ok = false;
+                }
+                if (ok && copy.links == 1) context.reclaimed += copy.size;
+            } else {
+                // Содержимое копии заменяется общими с оригиналом экстентами; inode, права и mtime копии остаются
+                struct timespec times[2] = {{0, UTIME_OMIT}, st.st_mtim};
+                ok = ::ioctl(to, FICLONE, from) == 0 && ::futimens(to, times) == 0;
+                if (ok) context.reclaimed += copy.size;
+            }
+            if (ok) ++context.replaced;
+        }
+        if (!ok) context.Fail(errno, copy.path);
+        if (from >= 0) ::close(from);
+        if (to >= 0) ::close(to);
+    }
+};
+
+/*
+ * Разбор текста с разделителями (CSV/TSV без кавычек) для `cut` и `colstat`.
+ * Разделители и переводы строк ищутся SSE2-сравнением сразу по 16 байт, а файл делится на куски по границам
+ * строк, которые разбираются параллельно.
+ */
+class DelimitedText {
+public:
+    static constexpr size_t kChunkSize = 8 << 20;
+    static constexpr size_t kMaxThreads = 8;
+
+    /*
+     * Множество номеров полей (с 1), заданное списком вида "1,3-5,7-". Хранится отсортированными непересекающимися
+     * диапазонами, так что память не зависит от величины номеров; номера больше `kMaxField` не принимаются.
+     */
+    class FieldSet {
+    public:
+        static constexpr size_t kMaxField = size_t(1) << 30;
+
+        struct Range {
+            size_t first, last;  // `last` == SIZE_MAX у диапазона без конца
+            size_t before;       // сколько полей выбрано в предыдущих диапазонах
+        };
+
+        /*
+         * Проход по полям строки по возрастанию номеров: дает позицию поля среди выбранных за O(1) в среднем.
+         */
+        class Cursor {
+        public:
+            explicit Cursor(const FieldSet& set) : ranges_(set.ranges_) {}
+
+            /*
+             * Позиция поля `field` среди выбранных (с 0) или SIZE_MAX, если оно не выбрано. Номера между
+             * вызовами `Reset` должны расти.
+             */
+            size_t Position(size_t field) {
+                while (next_ < ranges_.size() && ranges_[next_].last < field) ++next_;
+                if (next_ == ranges_.size() || ranges_[next_].first > field) return SIZE_MAX;
+                return ranges_[next_].before + (field - ranges_[next_].first);
+            }
+
+            void Reset() {
+                next_ = 0;
+            }
+
+        private:
+            const std::vector<Range>& ranges_;
+            size_t next_ = 0;
+        };
+
+        bool Parse(std::string_view list) {
+            while (!list.empty()) {
+                const size_t comma = std::min(list.find(','), list.size());
+                std::string_view range = list.substr(0, comma);
+                list.remove_prefix(std::min(comma + 1, list.size()));
+                const size_t dash = range.find('-');
+                size_t from = 1, to = SIZE_MAX;
+                if (dash == std::string_view::npos) {
+                    if (!ParseNumber(range, from)) return false;
+                    to = from;
+                } else if ((dash > 0 && !ParseNumber(range.substr(0, dash), from)) ||
+                           (dash + 1 < range.size() && !ParseNumber(range.substr(dash + 1), to)) || range.size() == 1) {
+                    return false;
+                }
+                if (from == 0 || from > to) return false;
+                ranges_.push_back({from, to, 0});
+            }
+            // Диапазоны упорядочиваются и сливаются, чтобы `Cursor` проходил их за один раз
+            std::sort(ranges_.begin(), ranges_.end(), [](const Range& a, const Range& b) { return a.first < b.first; });
+            size_t merged = 0;
+            for (const Range& range : ranges_) {
+                if (merged > 0 && (ranges_[merged - 1].last == SIZE_MAX || range.first <= ranges_[merged - 1].last + 1)) {
+                    ranges_[merged - 1].last = std::max(ranges_[merged - 1].last, range.last);
+                } else {
+                    ranges_[merged++] = range;
+                }
+            }
+            ranges_.resize(merged);
+            for (size_t i = 1; i < ranges_.size(); ++i) {
+                ranges_[i].before = ranges_[i - 1].before + (ranges_[i - 1].last - ranges_[i - 1].first + 1);
+            }
+            return !ranges_.empty();
+        }
+
+        bool Contains(size_t field) const {
+            auto it = std::upper_bound(ranges_.begin(), ranges_.end(), field,
+                                       [](size_t value, const Range& range) { return value < range.first; });
+            return it != ranges_.begin() && field <= std::prev(it)->last;
+        }
+
+        /*
+         * Последнее выбранное поле: дальше строку можно не разбирать.
+         */
+        size_t Last() const {
+            return ranges_.back().last;
+        }
+
+        /*
+         * Сколько полей выбрано (SIZE_MAX, если список не ограничен).
+         */
+        const std::vector<Range>& Ranges() const {
+            return ranges_;
+        }
+
+        size_t Count() const {
+            const Range& back = ranges_.back();
+            return back.last == SIZE_MAX ? SIZE_MAX : back.before + (back.last - back.first + 1);
+        }
+
+    private:
+        static bool ParseNumber(std::string_view text, size_t& value) {
+            const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+            return ec == std::errc() && end == text.data() + text.size() && value <= kMaxField;
+        }
+
+        std::vector<Range> ranges_;
+    };
+
+    /*
+     * Сводка по числовым значениям одного поля. Пока все значения целые, сумма считается точно в int64.
+     */
+    struct ColumnStats {
+        uint64_t count = 0;
+        bool exact = true;
+        int64_t exactSum = 0;
+        double sum = 0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+
+        /*
+         * Учесть поле, если оно -- число (пробелы, '\r' и кавычки вокруг пропускаются). Разбор не зависит от локали.
+         */
+        void Add(const char* begin, const char* end) {
+            while (begin < end && (*begin == ' ' || *begin == '"')) ++begin;
+            while (end > begin && (end[-1] == ' ' || end[-1] == '"' || end[-1] == '\r')) --end;
+            if (begin == end) return;
+            int64_t integer;
+            double value;
+            auto parsed = std::from_chars(begin, end, integer);
+            if (parsed.ec == std::errc() && parsed.ptr == end) {
+                value = static_cast<double>(integer);
+                if (exact && __builtin_add_overflow(exactSum, integer, &exactSum)) exact = false;
+            } else {
+                parsed = std::from_chars(begin, end, value);
+                if (parsed.ec != std::errc() || parsed.ptr != end) return;
+                exact = false;
+            }
+            ++count;
+            sum += value;
+            min = std::min(min, value);
+            max = std::max(max, value);
+        }
+
+        void Merge(const ColumnStats& other) {
+            count += other.count;
+            exact = exact && other.exact && !__builtin_add_overflow(exactSum, other.exactSum, &exactSum);
+            sum += other.sum;
+            min = std::min(min, other.min);
+            max = std::max(max, other.max);
+        }
+    };
+
+    /*
+     * Разобрать строки `data` на поля, вызывая `visitor.Field(index, begin, end)` для полей с номерами до `last`
+     * (номера с 1) и `visitor.Line(begin, end, fields)` в конце каждой строки. Поля после `last` не разбираются:
+     * разбор сразу переходит к следующей строке. Последняя строка может не заканчиваться '\n'.
+     */
+    template <typename Visitor>
+    static void Scan(const char* data, size_t size, char delimiter, size_t last, Visitor& visitor) {
+        const char* const end = data + size;
+        const char* line = data;
+        const char* field = data;
+        size_t index = 1;
+        const char* pos = data;
+        // Возвращает false, если после разделителя остаток строки пропущен и разбор продолжается с `pos`
+        auto separator = [&](const char* at) {
+            if (*at == '\n') {
+                visitor.Field(index, field, at);
+                visitor.Line(line, at, index);
+                line = field = at + 1;
+                index = 1;
+                return true;
+            }
+            visitor.Field(index, field, at);
+            field = at + 1;
+            if (++index <= last) return true;
+            const char* newline = static_cast<const char*>(std::memchr(at + 1, '\n', end - at - 1));
+            visitor.Line(line, newline ? newline : end, index);
+            pos = line = field = newline ? newline + 1 : end;
+            index = 1;
+            return false;
+        };
+#ifdef __SSE2__
+        const __m128i newlines = _mm_set1_epi8('\n');
+        const __m128i delimiters = _mm_set1_epi8(delimiter);
+        while (pos + 16 <= end) {
+            const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+            unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, newlines), _mm_cmpeq_epi8(block, delimiters)));
+            const char* base = pos;
+            pos += 16;
+            for (; mask; mask &= mask - 1) {
+                if (!separator(base + __builtin_ctz(mask))) break;
+            }
+        }
+#endif
+        while (pos < end) {
+            const char* at = pos++;
+            if (*at == '\n' || *at == delimiter) separator(at);
+        }
+        if (line < end) {
+            visitor.Field(index, field, end);
+            visitor.Line(line, end, index);
+        }
+    }
+
+    /*
+     * Разбить `data` на куски примерно по `kChunkSize`, каждый из которых начинается с начала строки.
+     */
+    static std::vector<std::pair<size_t, size_t>> Split(const char* data, size_t size) {
+        std::vector<std::pair<size_t, size_t>> chunks;
+        for (size_t begin = 0; begin < size;) {
+            size_t end = std::min(size, begin + kChunkSize);
+            if (end < size) {
+                const char* newline = static_cast<const char*>(std::memchr(data + end, '\n', size - end));
+                end = newline ? newline - data + 1 : size;
+            }
+            chunks.emplace_back(begin, end);
+            begin = end;
+        }
+        return chunks;
+    }
+
+    static size_t Threads(size_t chunks) {
+        return std::max<size_t>(1, std::min<size_t>({kMaxThreads, std::thread::hardware_concurrency(), chunks}));
+    }
+};
+
+/*
+ * Подсчет одинаковых строк файла (`count`) хэш-агрегацией вместо сортировки.
+ * Файл делится на куски по границам строк (см. `DelimitedText::Split`), каждый поток считает строки своих кусков
+ * в собственной хэш-таблице с открытой адресацией, а в конце таблицы сливаются. Ключи таблиц указывают прямо
+ * в отображенный файл и не копируются.
+ * Если задан предел памяти и таблица потока его превышает, она сбрасывается на диск по разделам (по старшим
+ * битам хэша) и очищается; в конце разделы считаются по одному, так что в памяти одновременно находится
+ * только один раздел.
+ */
+class LineCounter {
+public:
+    static constexpr size_t kPartitions = 64;
+    static constexpr size_t kSpillBuffer = 1 << 20;
+
+    /*
+     * Посчитать строки `data` и вывести "количество\tстрока" по убыванию количества (при равенстве -- по строке).
+     * Если `top` не ноль, выводятся только `top` самых частых строк. `memoryLimit` -- предел памяти хэш-таблиц
+     * в байтах (0 -- без предела). Возвращает 0 или код ошибки; `spills` -- сколько раз таблицы сбрасывались на диск.
+     */
+    static int Run(const char* data, size_t size, size_t top, size_t memoryLimit, OutputSink& out, size_t& spills) {
+        const auto chunks = DelimitedText::Split(data, size);
+        const size_t threads = DelimitedText::Threads(chunks.size());
+        const size_t budget = memoryLimit / threads;
+        std::vector<Table> tables(threads);
+        Spill spill;
+        std::atomic<size_t> next{0};
+        auto worker = [&](Table& table) {
+            for (size_t chunk; (chunk = next++) < chunks.size();) {
+                const char* pos = data + chunks[chunk].first;
+                const char* end = data + chunks[chunk].second;
+                while (pos < end) {
+                    const char* newline = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+                    const char* lineEnd = newline ? newline : end;
+                    table.Add(pos, lineEnd - pos, Hash(pos, lineEnd - pos), 1);
+                    pos = lineEnd + 1;
+                    if (memoryLimit && table.Bytes() > budget) spill.Write(table);
+                }
+            }
+        };
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < threads; ++i) {
+            pool.emplace_back(worker, std::ref(tables[i]));
+        }
+        worker(tables[0]);
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+
+        size_t total = 0;
+        for (const Table& table : tables) {
+            total += table.Bytes();
+        }
+        if (!spill.Used() && (!memoryLimit || total <= memoryLimit)) {
+            for (size_t i = 1; i < threads; ++i) {
+                tables[i].ForEach([&](const Entry& entry) { tables[0].Add(entry.key, entry.size, entry.hash, entry.count); });
+            }
+            return Emit(tables[0], top, out) ? 0 : EIO;
+        }
+
+        for (Table& table : tables) {
+            spill.Write(table);
+        }
+        spills = spill.Writes();
+        return spill.Error() ? spill.Error() : spill.Emit(top, out);
+    }
+
+private:
+    struct Entry {
+        const char* key = nullptr;  // nullptr -- свободная ячейка
+        uint32_t size = 0;
+        uint64_t hash = 0;
+        uint64_t count = 0;
+    };
+
+    /*
+     * Хэш-таблица с открытой адресацией и линейным пробированием; заполняется не больше чем на 3/4.
+     */
+    class Table {
+    public:
+        static constexpr size_t kInitialCapacity = 1024;
+
+        Table() : entries_(kInitialCapacity) {}
+
+        void Add(const char* key, size_t size, uint64_t hash, uint64_t count) {
+            if ((size_ + 1) * 4 > entries_.size() * 3) Grow();
+            const size_t mask = entries_.size() - 1;
+            for (size_t i = hash & mask;; i = (i + 1) & mask) {
+                Entry& entry = entries_[i];
+                if (!entry.key) {
+                    entry = {key, static_cast<uint32_t>(size), hash, count};
+                    ++size_;
+                    return;
+                }
+                if (entry.hash == hash && entry.size == size && std::memcmp(entry.key, key, size) == 0) {
+                    entry.count += count;
+                    return;
+                }
+            }
+        }
+
+        size_t Size() const {
+            return size_;
+        }
+
+        size_t Bytes() const {
+            return entries_.size() * sizeof(Entry);
+        }
+
+        template <typename Callback>
+        void ForEach(Callback&& callback) const {
+            for (const Entry& entry : entries_) {
+                if (entry.key) callback(entry);
+            }
+        }
+
+        void Clear() {
+            entries_.assign(kInitialCapacity, Entry{});
+            entries_.shrink_to_fit();
+            size_ = 0;
+        }
+
+    private:
+        void Grow() {
+            std::vector<Entry> old(entries_.size() * 2);
+            old.swap(entries_);
+            const size_t mask = entries_.size() - 1;
+            for (const Entry& entry : old) {
+                if (!entry.key) continue;
+                size_t i = entry.hash & mask;
+                while (entries_[i].key) i = (i + 1) & mask;
+                entries_[i] = entry;
+            }
+        }
+
+        std::vector<Entry> entries_;
+        size_t size_ = 0;
+    };
+
+    /*
+     * Разделы, сброшенные на диск. Записи раздела -- varint(количество), varint(длина), строка; строка может
+     * встречаться в разделе несколько раз (из разных сбросов), при чтении раздела количества складываются.
+     * Файлы создаются во временной директории и сразу удаляются, так что после завершения на диске ничего не остается.
+     */
+    class Spill {
+    public:
+        Spill() {
+            std::fill(std::begin(fds_), std::end(fds_), -1);
+        }
+
+        Spill(const Spill&) = delete;
+        Spill& operator=(const Spill&) = delete;
+
+        ~Spill() {
+            for (int fd : fds_) {
+                if (fd >= 0) ::close(fd);
+            }
+        }
+
+        bool Used() const {
+            return writes_ > 0;
+        }
+
+        size_t Writes() const {
+            return writes_;
+        }
+
+        int Error() const {
+            return error_;
+        }
+
+        /*
+         * Дописать записи таблицы в разделы и очистить ее (вызывается из нескольких потоков).
+         */
+        void Write(Table& table) {
+            if (table.Size() == 0) return;
+            if (!OpenFiles()) return;
+            std::vector<std::string> buffers(kPartitions);
+            table.ForEach([&](const Entry& entry) {
+                const size_t partition = entry.hash >> 58;
+                std::string& buffer = buffers[partition];
+                PutVarint(buffer, entry.count);
+                PutVarint(buffer, entry.size);
+                buffer.append(entry.key, entry.size);
+                if (buffer.size() >= kSpillBuffer) Append(partition, buffer);
+            });
+            for (size_t partition = 0; partition < kPartitions; ++partition) {
+                Append(partition, buffers[partition]);
+            }
+            table.Clear();
+            ++writes_;
+        }
+
+        /*
+         * Досчитать разделы по одному и вывести результат. Без `top` каждый раздел сортируется в отдельный файл,
+         * и эти файлы сливаются при выводе.
+         */
+        int Emit(size_t top, OutputSink& out) {
+            std::vector<std::pair<uint64_t, std::string>> best;  // куча лучших `top` строк, худшая в вершине
+            std::vector<int> runs;
+            for (size_t partition = 0; partition < kPartitions && !error_; ++partition) {
+                std::string contents;
+                if (!ReadAll(fds_[partition], contents)) return error_ = errno;
+                ::close(fds_[partition]);
+                fds_[partition] = -1;
+                Table table;
+                Reader reader(contents);
+                uint64_t count;
+                std::string_view key;
+                while (reader.Next(count, key)) {
+                    table.Add(key.data(), key.size(), Hash(key.data(), key.size()), count);
+                }
+                if (top) {
+                    table.ForEach([&](const Entry& entry) {
+                        if (best.size() == top && !Better(entry.count, {entry.key, entry.size}, best.front().first, best.front().second)) return;
+                        best.emplace_back(entry.count, std::string(entry.key, entry.size));
+                        std::push_heap(best.begin(), best.end(), BetterPair);
+                        if (best.size() > top) {
+                            std::pop_heap(best.begin(), best.end(), BetterPair);
+                            best.pop_back();
+                        }
+                    });
+                } else {
+                    std::string run;
+                    for (const Entry* entry : Sorted(table, 0)) {
+                        PutVarint(run, entry->count);
+                        PutVarint(run, entry->size);
+                        run.append(entry->key, entry->size);
+                    }
+                    int fd = CreateTemp();
+                    if (fd < 0 || !WriteAll(fd, run)) {
+                        if (fd >= 0) ::close(fd);
+                        error_ = errno;
+                    } else {
+                        runs.push_back(fd);
+                    }
+                }
+            }
+            int code = error_;
+            if (top) {
+                std::sort_heap(best.begin(), best.end(), BetterPair);
+                for (const auto& [count, key] : best) {
+                    Print(count, key, out);
+                }
+            } else if (!code) {
+                code = MergeRuns(runs, out);
+            }
+            for (int fd : runs) {
+                ::close(fd);
+            }
+            return code;
+        }
+
+    private:
+        /*
+         * Последовательное чтение записей раздела из файла (по `kSpillBuffer` байт) или из памяти.
+         */
+        class Reader {
+        public:
+            explicit Reader(int fd) : fd_(fd) {}
+            explicit Reader(std::string_view contents) : data_(contents.data()), size_(contents.size()) {}
+
+            bool Next(uint64_t& count, std::string_view& key) {
+                while (true) {
+                    size_t pos = pos_;
+                    uint64_t size;
+                    if (GetVarint(pos, count) && GetVarint(pos, size) && size <= size_ - pos) {
+                        key = std::string_view(data_ + pos, size);
+                        pos_ = pos + size;
+                        return true;
+                    }
+                    if (fd_ < 0 || !Refill()) return false;
+                }
+            }
+
+        private:
+            bool GetVarint(size_t& pos, uint64_t& value) const {
+                value = 0;
+                for (int shift = 0; pos < size_ && shift < 64; shift += 7) {
+                    const uint8_t byte = data_[pos++];
+                    value |= uint64_t(byte & 0x7f) << shift;
+                    if (!(byte & 0x80)) return true;
+                }
+                return false;
+            }
+
+            bool Refill() {
+                buffer_.erase(0, pos_);
+                pos_ = 0;
+                const size_t kept = buffer_.size();
+                buffer_.resize(kept + kSpillBuffer);
+                ssize_t got;
+                while ((got = ::pread(fd_, buffer_.data() + kept, kSpillBuffer, offset_)) < 0 && errno == EINTR) {
+                }
+                buffer_.resize(kept + std::max<ssize_t>(got, 0));
+                offset_ += std::max<ssize_t>(got, 0);
+                data_ = buffer_.data();
+                size_ = buffer_.size();
+                return got > 0;
+            }
+
+            int fd_ = -1;
+            off_t offset_ = 0;
+            std::string buffer_;
+            const char* data_ = nullptr;
+            size_t size_ = 0;
+            size_t pos_ = 0;
+        };
+
+        bool OpenFiles() {
+            std::call_once(opened_, [this]() {
+                for (int& fd : fds_) {
+                    if ((fd = CreateTemp()) < 0) {
+                        error_ = errno;
+                        return;
+                    }
+                }
+            });
+            return !error_;
+        }
+
+        static int CreateTemp() {
+            std::string path = (fs::temp_directory_path() / "shell_count-XXXXXX").string();
+            int fd = ::mkostemp(path.data(), O_CLOEXEC);
+            if (fd >= 0) ::unlink(path.c_str());
+            return fd;
+        }
+
+        void Append(size_t partition, std::string& buffer) {
+            if (buffer.empty()) return;
+            std::lock_guard<std::mutex> lock(mutexes_[partition]);
+            if (!WriteAll(fds_[partition], buffer) && !error_) error_ = errno;
+            buffer.clear();
+        }
+
+        static bool WriteAll(int fd, const std::string& data) {
+            for (size_t done = 0; done < data.size();) {
+                ssize_t written = ::write(fd, data.data() + done, data.size() - done);
+                if (written < 0 && errno == EINTR) continue;
+                if (written < 0) return false;
+                done += written;
+            }
+            return true;
+        }
+
+        static bool ReadAll(int fd, std::string& contents) {
+            struct stat st;
+            if (::fstat(fd, &st) != 0) return false;
+            contents.resize(st.st_size);
+            for (size_t done = 0; done < contents.size();) {
+                ssize_t got = ::pread(fd, contents.data() + done, contents.size() - done, done);
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) return false;
+                done += got;
+            }
+            return true;
+        }
+
+        static void PutVarint(std::string& buffer, uint64_t value) {
+            for (; value >= 0x80; value >>= 7) {
+                buffer += static_cast<char>(value | 0x80);
+            }
+            buffer += static_cast<char>(value);
+        }
+
+        /*
+         * Слить отсортированные файлы разделов в вывод через кучу курсоров.
+         */
+        static int MergeRuns(const std::vector<int>& runs, OutputSink& out) {
+            struct Cursor {
+                Reader reader;
+                uint64_t count;
+                std::string_view key;
+            };
+            std::vector<std::unique_ptr<Cursor>> cursors;
+            for (int fd : runs) {
+                auto cursor = std::make_unique<Cursor>(Cursor{Reader(fd), 0, {}});
+                if (cursor->reader.Next(cursor->count, cursor->key)) cursors.push_back(std::move(cursor));
+            }
+            auto worse = [](const std::unique_ptr<Cursor>& a, const std::unique_ptr<Cursor>& b) {
+                return Better(b->count, b->key, a->count, a->key);
+            };
+            std::make_heap(cursors.begin(), cursors.end(), worse);
+            while (!cursors.empty()) {
+                std::pop_heap(cursors.begin(), cursors.end(), worse);
+                Cursor& cursor = *cursors.back();
+                Print(cursor.count, cursor.key, out);
+                if (cursor.reader.Next(cursor.count, cursor.key)) {
+                    std::push_heap(cursors.begin(), cursors.end(), worse);
+                } else {
+                    cursors.pop_back();
+                }
+            }
+            return out.Flush() ? 0 : EIO;
+        }
+
+        static bool BetterPair(const std::pair<uint64_t, std::string>& a, const std::pair<uint64_t, std::string>& b) {
+            return Better(a.first, a.second, b.first, b.second);
+        }
+
+        int fds_[kPartitions];  // -1, пока файл раздела не создан
+        std::mutex mutexes_[kPartitions];
+        std::once_flag opened_;
+        std::atomic<size_t> writes_{0};
+        std::atomic<int> error_{0};
+    };
+
+    /*
+     * Порядок вывода: по убыванию количества, при равенстве -- по строке.
+     */
+    static bool Better(uint64_t count, std::string_view key, uint64_t otherCount, std::string_view otherKey) {
+        return count != otherCount ? count > otherCount : key < otherKey;
+    }
+
+    static uint64_t Hash(const char* data, size_t size) {
+        uint64_t hash = 0x9E3779B97F4A7C15ull ^ size;
+        for (; size >= 8; data += 8, size -= 8) {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            hash = (hash ^ word) * 0xBF58476D1CE4E5B9ull;
+            hash ^= hash >> 31;
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, data, size);
+        hash = (hash ^ tail) * 0x94D049BB133111EBull;
+        return hash ^ hash >> 29;
+    }
+
+    /*
+     * Записи таблицы в порядке вывода; если `top` не ноль -- только первые `top`, отобранные кучей.
+     */
+    static std::vector<const Entry*> Sorted(const Table& table, size_t top) {
+        auto better = [](const Entry* a, const Entry* b) {
+            return Better(a->count, {a->key, a->size}, b->count, {b->key, b->size});
+        };
+        std::vector<const Entry*> entries;
+        if (!top) {
+            entries.reserve(table.Size());
+            table.ForEach([&](const Entry& entry) { entries.push_back(&entry); });
+            std::sort(entries.begin(), entries.end(), better);
+            return entries;
+        }
+        // Куча из `top` лучших записей с худшей в вершине: каждая следующая запись сравнивается только с ней
+        table.ForEach([&](const Entry& entry) {
+            if (entries.size() == top && !better(&entry, entries.front())) return;
+            entries.push_back(&entry);
+            std::push_heap(entries.begin(), entries.end(), better);
+            if (entries.size() > top) {
+                std::pop_heap(entries.begin(), entries.end(), better);
+                entries.pop_back();
+            }
+        });
+        std::sort_heap(entries.begin(), entries.end(), better);
+        return entries;
+    }
+
+    static void Print(uint64_t count, std::string_view key, OutputSink& out) {
+        char number[24];
+        out.Append(number, std::to_chars(number, number + sizeof(number), count).ptr - number);
+        out.Append('\t');
+        out.Append(key);
+        out.Append('\n');
+    }
+
+    static bool Emit(const Table& table, size_t top, OutputSink& out) {
+        for (const Entry* entry : Sorted(table, top)) {
+            Print(entry->count, {entry->key, entry->size}, out);
+        }
+        return out.Flush();
+    }
+};
+
+/*
+ * Встроенный блочный формат сжатия (`compress`, `decompress` и `cat` сжатых файлов).
+ * Поток делится на независимые блоки по `kBlockSize`, каждый из которых сжимается LZ77 отдельно (последовательности
+ * "литералы + ссылка назад" в духе LZ4, ссылки не выходят за пределы блока). Поэтому блоки сжимаются
+ * и распаковываются параллельно, а в памяти одновременно находится только одна волна блоков на все потоки.
+ *
+ * Формат: "SHZ1", uint32 размер блока; затем блоки: uint32 размер данных (старший бит -- блок хранится без сжатия),
+ * uint32 исходный размер, uint32 контрольная сумма исходных данных, данные; в конце -- заголовок блока из нулей.
+ * Все числа -- little-endian. Сжатые потоки можно склеивать: после конца потока может начинаться следующий.
+ */
+class BlockCodec {
+public:
+    static constexpr char kMagic[4] = {'S', 'H', 'Z', '1'};
+    static constexpr size_t kBlockSize = 1 << 20;
+    static constexpr size_t kMaxThreads = 8;
+
+    /*
+     * Начинается ли файл с заголовка сжатого потока (позиция чтения не меняется).
+     */
+    static bool IsCompressed(int fd) {
+        char magic[sizeof(kMagic)];
+        return ::pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && std::memcmp(magic, kMagic, sizeof(magic)) == 0;
+    }
+
+    /*
+     * Сжать все, что читается из `in`, в `out`. Возвращает 0 или код ошибки (EIO -- не удалась запись в `out`).
+     */
+    static int Compress(int in, OutputSink& out) {
+        const size_t threads = Threads();
+        std::vector<Block> blocks(threads);
+        char header[8];
+        std::memcpy(header, kMagic, sizeof(kMagic));
+        PutUint32(header + 4, kBlockSize);
+        out.Append(header, sizeof(header));
+        for (bool done = false; !done;) {
+            size_t count = 0;
+            for (; count < threads && !done; ++count) {
+                Block& block = blocks[count];
+                block.raw.resize(kBlockSize);
+                ssize_t got = ReadSome(in, block.raw.data(), kBlockSize);
+                if (got < 0) return errno;
+                block.raw.resize(got);
+                done = static_cast<size_t>(got) < kBlockSize;
+                if (got == 0) break;
+            }
+            ForEachBlock(count, [&](size_t i) {
+                Block& block = blocks[i];
+                block.packed.resize(Bound(block.raw.size()));
+                size_t size = CompressBlock(block.raw.data(), block.raw.size(), block.packed.data());
+                block.stored = size >= block.raw.size();
+                block.packed.resize(block.stored ? 0 : size);
+                block.checksum = Checksum(block.raw.data(), block.raw.size());
+            });
+            for (size_t i = 0; i < count; ++i) {
+                const Block& block = blocks[i];
+                if (block.raw.empty()) break;
+                const std::string& data = block.stored ? block.raw : block.packed;
+                WriteHeader(out, data.size() | (block.stored ? kStored : 0), block.raw.size(), block.checksum);
+                out.AppendRef(data.data(), data.size());
+            }
+            if (!out.Flush()) return EIO;
+        }
+        WriteHeader(out, 0, 0, 0);
+        return out.Flush() ? 0 : EIO;
+    }
+
+    /*
+     * Распаковать поток из `in` в `out`. Возвращает 0 или код ошибки: EBADMSG -- поток поврежден или оборван,
+     * EIO -- не удалась запись в `out`.
+     */
+    static int Decompress(int in, OutputSink& out) {
+        const size_t threads = Threads();
+        std::vector<Block> blocks(threads);
+        bool ended = true;  // позиция -- между потоками (в начале или после заголовка конца)
+        size_t blockSize = 0;
+        for (bool eof = false; !eof;) {
+            size_t count = 0;
+            while (count < threads) {
+                char header[12];
+                if (ended) {
+                    ssize_t got = ReadSome(in, header, 8);
+                    if (got < 0) return errno;
+                    if (got == 0 && blockSize != 0) {
+                        eof = true;
+                        break;
+                    }
+                    if (got != 8 || std::memcmp(header, kMagic, sizeof(kMagic)) != 0) return EBADMSG;
+                    blockSize = GetUint32(header + 4);
+                    // Больших блоков `Compress` не пишет, а под каждый блок волны выделяется память
+                    if (blockSize == 0 || blockSize > kBlockSize) return EBADMSG;
+                    ended = false;
+                }
+                ssize_t got = ReadSome(in, header, sizeof(header));
+                if (got < 0) return errno;
+                if (got != sizeof(header)) return EBADMSG;
+                const uint32_t packedSize = GetUint32(header);
+                Block& block = blocks[count];
+                block.stored = packedSize & kStored;
+                const size_t dataSize = packedSize & ~kStored;
+                const size_t rawSize = GetUint32(header + 4);
+                block.checksum = GetUint32(header + 8);
+                if (packedSize == 0 && rawSize == 0) {
+                    ended = true;
+                    continue;
+                }
+                if (rawSize == 0 || rawSize > blockSize || dataSize > Bound(blockSize) ||
+                    (block.stored && dataSize != rawSize)) {
+                    return EBADMSG;
+                }
+                block.packed.resize(dataSize);
+                got = ReadSome(in, block.packed.data(), dataSize);
+                if (got < 0) return errno;
+                if (static_cast<size_t>(got) != dataSize) return EBADMSG;
+                block.raw.resize(rawSize);
+                ++count;
+            }
+            std::atomic<bool> corrupted{false};
+            ForEachBlock(count, [&](size_t i) {
+                Block& block = blocks[i];
+                if (block.stored) {
+                    block.raw.swap(block.packed);
+                } else if (!DecompressBlock(block.packed.data(), block.packed.size(), block.raw.data(), block.raw.size())) {
+                    corrupted = true;
+                    return;
+                }
+                if (Checksum(block.raw.data(), block.raw.size()) != block.checksum) corrupted = true;
+            });
+            if (corrupted) return EBADMSG;
+            for (size_t i = 0; i < count; ++i) {
+                out.AppendRef(blocks[i].raw.data(), blocks[i].raw.size());
+            }
+            if (!out.Flush()) return EIO;
+        }
+        return 0;
+    }
+
+    /*
+     * Сжать блок `src` в `dst` (размер не меньше `Bound(size)`) и вернуть размер результата.
+     * Совпадения ищутся жадно по хэш-таблице последних позиций 4-байтовых последовательностей; чем дольше нет
+     * совпадений, тем больше шаг поиска, так что несжимаемые данные проходятся быстро.
+     */
+    static size_t CompressBlock(const char* src, size_t size, char* dst) {
+        std::unique_ptr<uint32_t[]> table(new uint32_t[kHashSize]());
+        const uint8_t* const base = reinterpret_cast<const uint8_t*>(src);
+        const uint8_t* const end = base + size;
+        const uint8_t* ip = base;
+        const uint8_t* anchor = base;
+        uint8_t* op = reinterpret_cast<uint8_t*>(dst);
+        while (ip + kMinMatch <= end) {
+            const uint32_t sequence = Load32(ip);
+            uint32_t& slot = table[HashSequence(sequence)];
+            const uint8_t* candidate = base + slot;
+            slot = static_cast<uint32_t>(ip - base);
+            if (candidate >= ip || static_cast<size_t>(ip - candidate) > kMaxOffset || Load32(candidate) != sequence) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && candidate > base && ip[-1] == candidate[-1]) {
+                --ip, --candidate;
+            }
+            size_t length = kMinMatch;
+            while (ip + length + 8 <= end && Load64(ip + length) == Load64(candidate + length)) length += 8;
+            while (ip + length < end && ip[length] == candidate[length]) ++length;
+            op = WriteSequence(op, anchor, ip - anchor, ip - candidate, length);
+            ip += length;
+            anchor = ip;
+            if (ip + 2 <= end) table[HashSequence(Load32(ip - 2))] = static_cast<uint32_t>(ip - 2 - base);
+        }
+        // Последняя последовательность -- только литералы (возможно, пустая): по ней распаковка видит конец блока
+        op = WriteSequence(op, anchor, end - anchor, 0, 0);
+        return op - reinterpret_cast<uint8_t*>(dst);
+    }
+
+    /*
+     * Распаковать блок ровно в `rawSize` байт. Все длины и ссылки проверяются, так что поврежденные данные
+     * не выходят за пределы буферов, а приводят к false.
+     */
+    static bool DecompressBlock(const char* src, size_t size, char* dst, size_t rawSize) {
+        const uint8_t* ip = reinterpret_cast<const uint8_t*>(src);
+        const uint8_t* const end = ip + size;
+        uint8_t* const begin = reinterpret_cast<uint8_t*>(dst);
+        uint8_t* op = begin;
+        uint8_t* const limit = begin + rawSize;
+        auto readLength = [&](size_t& length) {
+            if (length != 15) return true;
+            uint8_t byte;
+            do {
+                if (ip == end) return false;
+                byte = *ip++;
+                length += byte;
+            } while (byte == 255);
+            return true;
+        };
+        while (ip < end) {
+            const uint8_t token = *ip++;
+            size_t literals = token >> 4;
+            if (!readLength(literals) || literals > static_cast<size_t>(end - ip) || literals > static_cast<size_t>(limit - op)) {
+                return false;
+            }
+            std::memcpy(op, ip, literals);
+            ip += literals, op += literals;
+            if (ip == end) break;
+            if (end - ip < 2) return false;
+            const size_t offset = ip[0] | ip[1] << 8;
+            ip += 2;
+            size_t length = token & 15;
+            if (!readLength(length)) return false;
+            length += kMinMatch;
+            if (offset == 0 || offset > static_cast<size_t>(op - begin) || length > static_cast<size_t>(limit - op)) return false;
+            const uint8_t* match = op - offset;
+            if (offset >= length) {
+                std::memcpy(op, match, length);
+                op += length;
+            } else {
+                // Ссылка перекрывается с тем, что она порождает (повтор короткого фрагмента)
+                for (size_t i = 0; i < length; ++i) {
+                    *op++ = *match++;
+                }
+            }
+        }
+        return op == limit;
+    }
+
+    static size_t Bound(size_t size) {
+        return size + size / 255 + 16;
+    }
+
+private:
+    static constexpr uint32_t kStored = 0x80000000u;
+    static constexpr size_t kMinMatch = 4;
+    static constexpr size_t kMaxOffset = 65535;
+    static constexpr int kHashBits = 14;
+    static constexpr size_t kHashSize = size_t(1) << kHashBits;
+
+    struct Block {
+        std::string raw;
+        std::string packed;
+        uint32_t checksum = 0;
+        bool stored = false;
+    };
+
+    static size_t Threads() {
+        return std::max<size_t>(1, std::min<size_t>(kMaxThreads, std::thread::hardware_concurrency()));
+    }
+
+    template <typename Function>
+    static void ForEachBlock(size_t count, Function function) {
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < count; ++i) {
+            pool.emplace_back(function, i);
+        }
+        if (count > 0) function(0);
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+    }
+
+    /*
+     * Прочитать `size` байт (меньше -- только в конце файла).
+     */
+    static ssize_t ReadSome(int fd, char* data, size_t size) {
+        size_t done = 0;
+        while (done < size) {
+            ssize_t got = ::read(fd, data + done, size - done);
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0) return -1;
+            if (got == 0) break;
+            done += got;
+        }
+        return done;
+    }
+
+    static uint32_t Load32(const uint8_t* data) {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    static uint64_t Load64(const uint8_t* data) {
+        uint64_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    static uint32_t HashSequence(uint32_t sequence) {
+        return (sequence * 2654435761u) >> (32 - kHashBits);
+    }
+
+    static void PutUint32(char* data, uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            data[i] = static_cast<char>(value >> (8 * i));
+        }
+    }
+
+    static uint32_t GetUint32(const char* data) {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            value |= uint32_t(static_cast<uint8_t>(data[i])) << (8 * i);
+        }
+        return value;
+    }
+
+    static void WriteHeader(OutputSink& out, uint32_t packedSize, uint32_t rawSize, uint32_t checksum) {
+        char header[12];
+        PutUint32(header, packedSize);
+        PutUint32(header + 4, rawSize);
+        PutUint32(header + 8, checksum);
+        out.Append(header, sizeof(header));
+    }
+
+    static uint8_t* WriteLength(uint8_t* op, size_t length) {
+        for (; length >= 255; length -= 255) {
+            *op++ = 255;
+        }
+        *op++ = static_cast<uint8_t>(length);
+        return op;
+    }
+
+    /*
+     * Записать последовательность: токен (длина литералов и длина ссылки по 4 бита, 15 -- продолжение в следующих
+     * байтах), литералы, смещение ссылки (2 байта) и продолжение длины ссылки. Без ссылки, если `length` == 0.
+     */
+    static uint8_t* WriteSequence(uint8_t* op, const uint8_t* literals, size_t count, size_t offset, size_t length) {
+        const size_t matchCode = length ? length - kMinMatch : 0;
+        *op++ = static_cast<uint8_t>(std::min<size_t>(count, 15) << 4 | std::min<size_t>(matchCode, 15));
+        if (count >= 15) op = WriteLength(op, count - 15);
+        std::memcpy(op, literals, count);
+        op += count;
+        if (length == 0) return op;
+        *op++ = static_cast<uint8_t>(offset);
+        *op++ = static_cast<uint8_t>(offset >> 8);
+        if (matchCode >= 15) op = WriteLength(op, matchCode - 15);
+        return op;
+    }
+
+    static uint32_t Checksum(const char* data, size_t size) {
+        uint64_t hash = 0x9E3779B97F4A7C15ull ^ size;
+        for (; size >= 8; data += 8, size -= 8) {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            hash = (hash ^ word) * 0xBF58476D1CE4E5B9ull;
+            hash ^= hash >> 31;
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, data, size);
+        hash = (hash ^ tail) * 0x94D049BB133111EBull;
+        return static_cast<uint32_t>(hash ^ hash >> 32);
+    }
+};
+
+/*
+ * Столбец строк: значения лежат подряд в одном буфере, а для каждой строки хранится только ее конец.
+ */
+class StringColumn {
+public:
+    explicit StringColumn(std::pmr::memory_resource* resource) : data_(resource), ends_(resource) {}
+
+    void Push(std::string_view value) {
+        data_.append(value.data(), value.size());
+        ends_.push_back(data_.size());
+    }
+
+    std::string_view operator[](size_t row) const {
+        const size_t begin = row ? ends_[row - 1] : 0;
+        return std::string_view(data_.data() + begin, ends_[row] - begin);
+    }
+
+    void Clear() {
+        data_.clear();
+        ends_.clear();
+    }
+
+private:
+    std::pmr::string data_;
+    std::pmr::vector<size_t> ends_;
+};
+
+/*
+ * Пачка типизированных записей, которыми обмениваются команды конвейера (`find . | grep .cpp | head`).
+ * Записи хранятся по столбцам, заполнены только столбцы из `columns`. Текстом записи становятся только
+ * в конце конвейера (см. `TextRenderer`), промежуточные команды работают прямо со столбцами.
+ */
+struct RecordBatch {
+    static constexpr size_t kMaxRows = 1024;
+
+    enum Column : unsigned { kName = 1, kSize = 2, kMtime = 4, kLine = 8, kOffset = 16 };
+
+    // Как записи выводятся текстом: имя (`find`, `ls`), "размер\tимя" (`du`) или строка (`grep`, `head`)
+    enum Format { Names, Usage, Lines };
+
+    explicit RecordBatch(std::pmr::memory_resource* resource)
+        : names(resource), lines(resource), sizes(resource), mtimes(resource), offsets(resource) {}
+
+    bool Full() const {
+        return rows >= kMaxRows;
+    }
+
+    void Clear() {
+        names.Clear();
+        lines.Clear();
+        sizes.clear();
+        mtimes.clear();
+        offsets.clear();
+        rows = 0;
+    }
+
+    /*
+     * Дописать строку `row` пачки `other`, у которой те же столбцы.
+     */
+    void CopyRow(const RecordBatch& other, size_t row) {
+        if (columns & kName) names.Push(other.names[row]);
+        if (columns & kLine) lines.Push(other.lines[row]);
+        if (columns & kSize) sizes.push_back(other.sizes[row]);
+        if (columns & kMtime) mtimes.push_back(other.mtimes[row]);
+        if (columns & kOffset) offsets.push_back(other.offsets[row]);
+        ++rows;
+    }
+
+    /*
+     * Текст, по которому фильтруются записи, -- тот же, что выводит `TextRenderer`. Если его приходится
+     * собирать из нескольких столбцов, он записывается в `scratch`.
+     */
+    std::string_view Text(size_t row, std::string& scratch) const {
+        if (format == Usage) {
+            char number[24];
+            char* end = std::to_chars(number, number + sizeof(number), sizes[row]).ptr;
+            scratch.assign(number, end - number);
+            scratch += '\t';
+            scratch.append(names[row]);
+            return scratch;
+        }
+        if (format == Lines && (columns & kName)) {
+            scratch.assign(names[row]);
+            scratch += ':';
+            scratch.append(lines[row]);
+            return scratch;
+        }
+        return columns & kLine ? lines[row] : names[row];
+    }
+
+    Format format = Names;
+    unsigned columns = 0;
+    size_t rows = 0;
+    StringColumn names;                 // имя или путь
+    StringColumn lines;                 // строка текста без '\n'
+    std::pmr::vector<uint64_t> sizes;   // размер в байтах (у `du` -- занятое место в КиБ)
+    std::pmr::vector<int64_t> mtimes;   // время изменения в наносекундах
+    std::pmr::vector<uint64_t> offsets; // смещение строки от начала ввода
+};
+
+/*
+ * Получатель пачек записей: следующая команда конвейера или вывод.
+ * `Push` возвращает false, если записи дальше не нужны (например, `head` уже набрал свое) -- тогда
+ * источник молча останавливается. `Finish` вызывается один раз после последней пачки.
+ * `Needs` -- столбцы, которые получатель (или кто-то после него) читает; источник может не заполнять
+ * остальные необязательные столбцы и не тратить на них системные вызовы.
+ */
+class RecordSink {
+public:
+    virtual ~RecordSink() = default;
+
+    virtual bool Push(const RecordBatch& batch) = 0;
+
+    virtual unsigned Needs() const = 0;
+
+    virtual void Finish() {}
+};
+
+/*
+ * Последняя ступень конвейера: выводит записи текстом в приемник.
+ */
+class TextRenderer : public RecordSink {
+public:
+    explicit TextRenderer(OutputSink& out) : out_(out) {}
+
+    bool Push(const RecordBatch& batch) override {
+        char number[24];
+        for (size_t row = 0; row < batch.rows; ++row) {
+            if (batch.format == RecordBatch::Usage) {
+                char* end = std::to_chars(number, number + sizeof(number), batch.sizes[row]).ptr;
+                out_.Append(number, end - number);
+                out_.Append('\t');
+                out_.Append(batch.names[row]);
+            } else if (batch.format == RecordBatch::Lines) {
+                if (batch.columns & RecordBatch::kName) {
+                    out_.Append(batch.names[row]);
+                    out_.Append(':');
+                }
+                out_.Append(batch.lines[row]);
+            } else {
+                out_.Append(batch.names[row]);
+            }
+            out_.Append('\n');
+        }
+        return true;
+    }
+
+    // Размер выводится только у `du`, который считает его в любом случае
+    unsigned Needs() const override {
+        return RecordBatch::kName | RecordBatch::kLine;
+    }
+
+private:
+    OutputSink& out_;
+};
+
+/*
+ * `grep <pattern>` в конвейере: пропускает записи, текст которых содержит образец.
+ */
+class GrepFilter : public RecordSink {
+public:
+    GrepFilter(std::string_view pattern, RecordSink& next, std::pmr::memory_resource* resource)
+        : pattern_(pattern), next_(next), matched_(resource) {}
+
+    bool Push(const RecordBatch& batch) override {
+        matched_.Clear();
+        matched_.format = batch.format;
+        matched_.columns = batch.columns;
+        for (size_t row = 0; row < batch.rows; ++row) {
+            const std::string_view text = batch.Text(row, scratch_);
+            if (NameIndex::Find(text.data(), text.size(), pattern_) != std::string::npos) matched_.CopyRow(batch, row);
+        }
+        return matched_.rows == 0 || next_.Push(matched_);
+    }
+
+    unsigned Needs() const override {
+        return next_.Needs() | RecordBatch::kName | RecordBatch::kLine;
+    }
+
+    void Finish() override {
+        next_.Finish();
+    }
+
+private:
+    std::string_view pattern_;
+    RecordSink& next_;
+    RecordBatch matched_;
+    std::string scratch_;
+};
+
+/*
+ * `head [-n N]` в конвейере: пропускает первые `count` записей, после чего останавливает источник.
+ */
+class HeadFilter : public RecordSink {
+public:
+    HeadFilter(uint64_t count, RecordSink& next, std::pmr::memory_resource* resource)
+        : left_(count), next_(next), prefix_(resource) {}
+
+    bool Push(const RecordBatch& batch) override {
+        if (batch.rows <= left_) {
+            left_ -= batch.rows;
+            return next_.Push(batch) && left_ > 0;
+        }
+        prefix_.Clear();
+        prefix_.format = batch.format;
+        prefix_.columns = batch.columns;
+        for (size_t row = 0; row < left_; ++row) {
+            prefix_.CopyRow(batch, row);
+        }
+        left_ = 0;
+        if (prefix_.rows > 0) next_.Push(prefix_);
+        return false;
+    }
+
+    unsigned Needs() const override {
+        return next_.Needs();
+    }
+
+    void Finish() override {
+        next_.Finish();
+    }
+
+private:
+    uint64_t left_;
+    RecordSink& next_;
+    RecordBatch prefix_;
+};
+
+/*
+ * Приемник текста, который режет его на строки и передает дальше записями `Lines` (строка и ее смещение,
+ * плюс имя файла, если оно задано). Так в конвейер попадает вывод команд, которые пишут только текст.
+ */
+class LineSink : public OutputSink {
+public:
+    LineSink(RecordSink& next, std::pmr::memory_resource* resource, std::string_view name = {})
+        : next_(next), name_(name), partial_(resource), batch_(resource) {
+        batch_.format = RecordBatch::Lines;
+        batch_.columns = RecordBatch::kLine | RecordBatch::kOffset | (name.empty() ? 0u : unsigned(RecordBatch::kName));
+    }
+
+    ~LineSink() override {
+        Flush();
+    }
+
+    /*
+     * Передать последнюю строку (даже без '\n') и все накопленные записи. Возвращает false, если
+     * получатель отказался от записей.
+     */
+    bool Finish() {
+        Flush();
+        if (!partial_.empty() && !stopped_) {
+            AddLine(partial_);
+            partial_.clear();
+        }
+        if (batch_.rows > 0 && !stopped_) stopped_ = !next_.Push(batch_);
+        batch_.Clear();
+        return !stopped_;
+    }
+
+    /*
+     * Получатель отказался от записей; запись в приемник после этого не удается.
+     */
+    bool Stopped() const {
+        return stopped_;
+    }
+
+protected:
+    bool WriteSegments(const struct iovec* segments, size_t count) override {
+        for (size_t i = 0; i < count && !stopped_; ++i) {
+            Feed(static_cast<const char*>(segments[i].iov_base), segments[i].iov_len);
+        }
+        return !stopped_;
+    }
+
+private:
+    void Feed(const char* data, size_t size) {
+        const char* end = data + size;
+        while (data < end && !stopped_) {
+            const char* newline = static_cast<const char*>(std::memchr(data, '\n', end - data));
+            if (!newline) {
+                partial_.append(data, end - data);
+                break;
+            }
+            if (partial_.empty()) {
+                AddLine(std::string_view(data, newline - data));
+            } else {
+                partial_.append(data, newline - data);
+                AddLine(partial_);
+                partial_.clear();
+            }
+            data = newline + 1;
+        }
+    }
+
+    void AddLine(std::string_view line) {
+        batch_.lines.Push(line);
+        batch_.offsets.push_back(offset_);
+        if (!name_.empty()) batch_.names.Push(name_);
+        ++batch_.rows;
+        offset_ += line.size() + 1;
+        if (batch_.Full()) {
+            stopped_ = !next_.Push(batch_);
+            batch_.Clear();
+        }
+    }
+
+    RecordSink& next_;
+    std::string_view name_;
+    std::pmr::string partial_;
+    RecordBatch batch_;
+    uint64_t offset_ = 0;
+    bool stopped_ = false;
+};
+
+/*
+ * Граница между командами конвейера в текстовом режиме: записи выводятся текстом, а следующая команда
+ * разбирает этот текст обратно на строки -- так же, как между процессами обычного шелла.
+ */
+class TextBoundary : public RecordSink {
+public:
+    TextBoundary(RecordSink& next, std::pmr::memory_resource* resource)
+        : next_(next), lines_(next, resource), renderer_(lines_) {}
+
+    bool Push(const RecordBatch& batch) override {
+        renderer_.Push(batch);
+        return lines_.Flush();
+    }
+
+    unsigned Needs() const override {
+        return renderer_.Needs();
+    }
+
+    void Finish() override {
+        lines_.Finish();
+        next_.Finish();
+    }
+
+private:
+    RecordSink& next_;
+    LineSink lines_;
+    TextRenderer renderer_;
+};
+
+/*
+ * Арена для временной памяти одной команды.
+ * Аргументы команды, пути и буферы выделяются из нее, а после выполнения команды арена целиком сбрасывается.
+ * Пока команде хватает начального буфера, ее выполнение не обращается к глобальной куче.
+ */
+class CommandArena {
+public:
+    static constexpr size_t kInitialSize = 256 * 1024;
+
+    CommandArena() : buffer_(new std::byte[kInitialSize]), resource_(buffer_.get(), kInitialSize) {}
+
+    CommandArena(const CommandArena&) = delete;
+    CommandArena& operator=(const CommandArena&) = delete;
+
+    std::pmr::memory_resource* Resource() {
+        return &resource_;
+    }
+
+    void Reset() {
+        resource_.release();
+    }
+
+private:
+    std::unique_ptr<std::byte[]> buffer_;
+    std::pmr::monotonic_buffer_resource resource_;
+};
+
+/* класс Shell, представляющий собой среду для выполнения некоторых команд
+ * над файловой системой. По аналогии с настоящим шеллом он поддерживает несколько команд:
+ * - ls [directory] -- вывести содержимое указанной директории. Если директория не указана, то используется текущая директория (current working directory, cwd)
+ * - cat <file> -- вывести содержимое файла
+ * - mkdir <directory> -- создать директорию
+ * - rmdir <directory> -- удалить пустую директорию
+ * - rm <file> -- удалить файл
+ * - cd <directory> -- сделать <directory> текущей директорией
+ * - echo [text] -- вывести текст
+ *
+ * Если в конце строки указать "> <file>", то результат выполнения команды будет записан в файл <file>, при этом старое содержимое файла будет удалено.
+ * Если в конце строки указать ">> <file>", то результат выполнения команды будет записан в конец файла <file>.
+ *
+ * Все операции должны производиться с настоящей файловой системой.
+ * В случае возникновения ошибок во время выполнения команды шелл должен вернуть код ответа 1, в случае успеха вернуть 0.
+ * Также на оценку влияет потенциальная расширяемость набора команд.
+ */
+class Shell {
+public:
+    Shell(const std::filesystem::path& cwd_) {cwd = fs::current_path();}
+
+    ~Shell() {
+        if (watchStopFd_ >= 0) ::close(watchStopFd_);
+    }
+
+    /*
+     * Выполнить команду.
+     * Команда подается в виде строки. Вывод команды попадает в поток `out`.
+     * Если в команде вывод был перенаправлен в файл с помощью `>` или `>>`, то в `out` ничего не выводится.
+     * Если команда была выполнена, то метод должен вернуть 0, иначе 1.
+     * Перед выполнением команды рекомендуем вывести в поток `out` строку вида "$ <строка команды>\n", чтобы
+     * во время отладки было понятно, какие ответы соответствуют каким введенным командам.
+     */
+    int ExecuteCommand(const std::string& command, std::ostream& out) {
+        return ExecuteCommand(command, out, lastError_);
+    }
+
+    /*
+     * То же самое, но описание ошибки (если команда вернула 1) записывается в `error`.
+     * Команды не бросают исключений: все ошибки файловой системы превращаются в код ответа 1 и `error`.
+     */
+    int ExecuteCommand(const std::string& command, std::ostream& out, CommandError& error) {
+        return ExecuteIn(arena_, command, out, error);
+    }
+
+    /*
+     * Описание ошибки последней команды, выполненной через `ExecuteCommand` без явного `error`.
+     */
+    const CommandError& LastError() const {
+        return lastError_;
+    }
+
+    /*
+     * Сбросить на диск все данные, дописанные через `>>`, но еще не записанные.
+     * В режиме надежной записи также дождаться fsync всех отложенных записей.
+     * Возвращает false, если какую-то запись не удалось сделать.
+     */
+    bool Flush() {
+        std::lock_guard<std::mutex> lock(ioMutex_);
+        bool ok = durable_ ? CommitDurable() : appendCache_.FlushAll();
+        std::string path;
+        return appendCache_.TakeError(path) == 0 && ok;
+    }
+
+    /*
+     * Включить или выключить режим надежной записи.
+     * В этом режиме `>` заменяет файл атомарно через временный файл, а данные, записанные через `>` и `>>`,
+     * синхронизируются с диском группами: не позже чем через несколько миллисекунд после записи,
+     * перед чтением замененных файлов и при вызове `Flush`.
+     */
+    void SetDurable(bool durable) {
+        std::lock_guard<std::mutex> lock(ioMutex_);
+        if (durable_ && !durable) {
+            CommitDurable();
+        }
+        durable_ = durable;
+        appendCache_.SetSyncGroup(durable ? &syncGroup_ : nullptr);
+    }
+
+    /*
+     * Выполнить текст скрипта с переменными и циклами (см. `ScriptProgram`) и вернуть код ответа последней
+     * выполненной команды, или 1, если в скрипте есть синтаксическая ошибка.
+     * Скомпилированный байткод кэшируется на диске по хэшу текста скрипта, так что при повторном запуске
+     * того же скрипта его текст не разбирается. Кэш используется, только если его директория принадлежит
+     * текущему пользователю и закрыта для остальных (см. `PrivateDirectory`).
+     * Переменные хранятся в сессии и доступны последующим скриптам.
+     */
+    int ExecuteScript(const std::string& script, std::ostream& out) {
+        const uint64_t hash = ScriptProgram::Hash(script);
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.sbc", static_cast<unsigned long long>(hash));
+        const fs::path cached = scriptCacheDir_ / name;
+
+        const bool cacheable = PrivateDirectory(scriptCacheDir_);
+        ScriptProgram program;
+        if (cacheable && program.Load(cached, script)) {
+            ++stats_.scriptCacheHits;
+        } else {
+            ++stats_.scriptCacheMisses;
+            program = ScriptProgram();
+            if (!program.Compile(script)) return 1;
+            if (cacheable) program.Save(cached, script);
+        }
+        return RunProgram(program, out);
+    }
+
+    /*
+     * Директория кэшей текущего пользователя: `$XDG_CACHE_HOME/shell`, иначе `$HOME/.cache/shell`, а если не задано
+     * и `HOME` -- `shell-<uid>` во временной директории.
+     */
+    static fs::path UserCacheDir() {
+        const char* xdg = std::getenv("XDG_CACHE_HOME");
+        if (xdg && xdg[0] == '/') return fs::path(xdg) / "shell";
+        const char* home = std::getenv("HOME");
+        if (home && home[0] == '/') return fs::path(home) / ".cache" / "shell";
+        std::error_code ec;
+        return fs::temp_directory_path(ec) / ("shell-" + std::to_string(::geteuid()));
+    }
+
+    /*
+     * Создать директорию `dir` с правами 0700, если ее нет, и проверить, что это директория текущего пользователя,
+     * закрытая для остальных, а ее родителя (его тоже создаем с правами 0700) не могут менять чужие пользователи:
+     * иначе кто-то другой мог бы подложить в нее свои файлы или подменить ее саму.
+     */
+    static bool PrivateDirectory(const fs::path& dir) {
+        const fs::path parent = dir.parent_path();
+        std::error_code ec;
+        fs::create_directories(parent.parent_path(), ec);
+        struct stat st;
+        if ((::mkdir(parent.c_str(), 0700) != 0 && errno != EEXIST) || ::stat(parent.c_str(), &st) != 0 ||
+            (st.st_uid != ::geteuid() && st.st_uid != 0) || ((st.st_mode & 022) != 0 && !(st.st_mode & S_ISVTX))) {
+            return false;
+        }
+        if ((::mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) || ::lstat(dir.c_str(), &st) != 0) return false;
+        return S_ISDIR(st.st_mode) && st.st_uid == ::geteuid() && (st.st_mode & 077) == 0;
+    }
+
+    /*
+     * Задать директорию, в которой хранится кэш скомпилированных скриптов.
+     */
+    void SetScriptCacheDir(const fs::path& dir) {
+        scriptCacheDir_ = dir;
+    }
+
+    /*
+     * Задать файл, в котором хранится индекс имен для `index` и `locate`
+     * (по умолчанию -- `name_index` в директории кэшей пользователя, см. `UserCacheDir`).
+     */
+    void SetIndexFile(const fs::path& file) {
+        indexFile_ = file;
+    }
+
+    /*
+     * Включить структурный режим конвейеров: команды в `a | b` обмениваются пачками типизированных записей
+     * (имя, размер, mtime, строка, смещение) без вывода и разбора текста между ними. По умолчанию выключен,
+     * и между командами записи проходят через текст.
+     */
+    void SetStructuredPipelines(bool enabled) {
+        structuredPipelines_ = enabled;
+    }
+
+    /*
+     * Включить прозрачную распаковку в `cat`: файлы, сжатые `compress` (см. `BlockCodec`), выводятся распакованными.
+     */
+    void SetDecompressOnCat(bool enabled) {
+        decompressOnCat_ = enabled;
+    }
+
+    /*
+     * Ограничить ввод-вывод `cat`, `grep`, `head`, перенаправлений вывода, `rm`, `rmdir` и `sync`: не больше
+     * `bytesPerSecond` байт и `opsPerSecond` операций в секунду на всю сессию (0 -- без ограничения, по умолчанию).
+     * Можно вызывать из другого потока во время выполнения команды; время, которое команды прождали бюджета,
+     * копится в `ShellStats::throttleTime`.
+     */
+    void SetIoLimit(uint64_t bytesPerSecond, uint64_t opsPerSecond = 0) {
+        throttle_.SetLimits(bytesPerSecond, opsPerSecond);
+    }
+
+    /*
+     * Остановить выполняющуюся команду `watch` (можно вызывать из другого потока).
+     */
+    void StopWatch() {
+        std::lock_guard<std::mutex> lock(watchMutex_);
+        if (watchStopFd_ >= 0) {
+            uint64_t one = 1;
+            (void)!::write(watchStopFd_, &one, sizeof(one));
+        }
+    }
+
+    /*
+     * Выполнить скрипт -- последовательность команд -- и вернуть коды ответа всех команд.
+     * Если `workers` больше единицы, то команды, которые затрагивают непересекающиеся пути, выполняются
+     * параллельно на `workers` потоках. Для этого по путям, которые каждая команда читает и изменяет,
+     * строится граф зависимостей: команда ждет все предыдущие команды, которые изменяют тот же путь,
+     * его предка или потомка (или читают его, если сама команда его изменяет).
+     * Команды, эффект которых нельзя определить заранее (`cd`, неизвестные команды), и команды, создающие недостающих
+     * предков пути (`mkdir -p`, `sync`, `archive extract`: какие из предков они создадут, заранее неизвестно),
+     * выполняются как барьер:
+     * все команды до них завершаются, а пути команд после них разрешаются уже относительно новой cwd.
+     * Вывод в `out` и итоговое состояние файловой системы такие же, как при последовательном выполнении
+     * (пути сравниваются лексически, поэтому скрипт не должен обращаться к одному файлу через разные символические ссылки).
+     * В режиме надежной записи скрипт всегда выполняется последовательно: сброс группы fsync закрывает временные
+     * файлы, в которые в это время могли бы писать перенаправления других команд.
+     * При последовательном выполнении пути, которые затронут следующие `SetPrefetchDepth` команд, заранее
+     * предвыбираются в фоне (см. `Prefetcher`).
+     * Если передан `errors`, в него записывается описание ошибки каждой команды (пустое для успешных).
+     */
+    std::vector<int> RunScript(const std::vector<std::string>& commands, std::ostream& out, size_t workers = 1,
+                               std::vector<CommandError>* errors = nullptr) {
+        std::vector<int> results(commands.size(), 1);
+        std::vector<CommandError> ownErrors;
+        std::vector<CommandError>& commandErrors = errors ? *errors : ownErrors;
+        commandErrors.assign(commands.size(), CommandError());
+        if (prefetchDepth_ > 0) prefetcher_.Begin();
+        size_t begin = 0;
+        while (begin < commands.size()) {
+            std::vector<std::vector<PathAccess>> accesses;
+            size_t end = begin;
+            while (end < commands.size()) {
+                std::vector<PathAccess> commandAccesses;
+                if (!AnalyzeCommand(commands[end], commandAccesses)) break;
+                accesses.push_back(std::move(commandAccesses));
+                ++end;
+            }
+            if (workers > 1 && end - begin > 1 && !durable_) {
+                RunParallel(commands, begin, accesses, out, workers, results, commandErrors);
+            } else {
+                size_t prefetched = begin;
+                for (size_t i = begin; i < end; ++i) {
+                    for (; prefetched < end && prefetched <= i + prefetchDepth_; ++prefetched) {
+                        for (const PathAccess& access : accesses[prefetched - begin]) {
+                            prefetcher_.Prefetch(access.path, access.contents);
+                        }
+                    }
+                    results[i] = ExecuteCommand(commands[i], out, commandErrors[i]);
+                }
+            }
+            if (end < commands.size()) {
+                results[end] = ExecuteCommand(commands[end], out, commandErrors[end]);
+                ++end;
+            }
+            begin = end;
+        }
+        if (prefetchDepth_ > 0) prefetcher_.End();
+        if (!commands.empty()) lastError_ = commandErrors.back();
+        return results;
+    }
+
+    /*
+     * Сколько следующих команд скрипта просматривать для предвыборки файлов (0 -- не предвыбирать).
+     */
+    void SetPrefetchDepth(size_t depth) {
+        prefetchDepth_ = depth;
+    }
+
+    const ShellStats& Stats() const {
+        return stats_;
+    }
+
+private:
+    /*
+     * Команда, разобранная на аргументы, и файл, в который перенаправлен ее вывод.
+     */
+    using Args = std::pmr::vector<std::pmr::string>;
+
+    struct ParsedCommand {
+        explicit ParsedCommand(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+            : args(resource), outputFile(resource) {}
+
+        Args args;
+        std::pmr::string outputFile;
+        bool append = false;
+    };
+
+    /*
+     * Путь, который команда читает или изменяет.
+     */
+    struct PathAccess {
+        std::string path;
+        bool write;
+        bool contents = false;  // команда читает содержимое файла
+    };
+
+    /*
+     * Файл, в который перенаправлен вывод команды.
+     * При `>` файл открывается только при первом сбросе буфера, поэтому небольшой вывод команды записывается
+     * в файл целиком уже после ее выполнения, а большой -- потоком. В режиме надежной записи вместо файла
+     * открывается временный файл из группы fsync. При `>>` данные уходят в кэш дозаписи.
+     */
+    class RedirectSink : public OutputSink {
+    public:
+        RedirectSink(Shell& shell, const std::pmr::string& path, bool append)
+            : shell_(shell), path_(path), append_(append) {}
+
+        ~RedirectSink() override {
+            if (fd_ >= 0) Close();
+        }
+
+        /*
+         * Дописать остаток вывода и закрыть файл. Если успешно выполненная команда (`succeeded`) ничего не вывела,
+         * то при `>` файл все равно создается или очищается, а если команда завершилась ошибкой, ничего не выведя
+         * (например, `cat missing > f`), файл остается нетронутым. Возвращает false, если хотя бы одна запись не удалась.
+         */
+        bool Close(bool succeeded = true) {
+            bool ok = Flush();
+            if (append_) return ok;
+            if (fd_ < 0 && ok && !succeeded) return true;
+            if (fd_ < 0 && ok) ok = Open();
+            if (fd_ < 0) return false;
+            if (shell_.durable_) {
+                std::lock_guard<std::mutex> lock(shell_.ioMutex_);
+                if (!ok) shell_.syncGroup_.Discard(std::string(path_));
+            } else {
+                ::close(fd_);
+            }
+            fd_ = -1;
+            return ok;
+        }
+
+        /*
+         * errno первой неудачной операции с файлом.
+         */
+        int Error() const {
+            return error_;
+        }
+
+    protected:
+        bool WriteSegments(const struct iovec* segments, size_t count) override {
+            if (shell_.throttle_.Active()) {
+                uint64_t bytes = 0;
+                for (size_t i = 0; i < count; ++i) bytes += segments[i].iov_len;
+                shell_.throttle_.Charge(bytes);
+            }
+            bool ok = true;
+            if (append_) {
+                std::lock_guard<std::mutex> lock(shell_.ioMutex_);
+                for (size_t i = 0; i < count; ++i) {
+                    ok = ok && shell_.appendCache_.Append(path_, static_cast<const char*>(segments[i].iov_base),
+                                                          segments[i].iov_len);
+                }
+            } else {
+                ok = (fd_ >= 0 || Open()) && FdSink::WriteAll(fd_, segments, count);
+            }
+            if (!ok && !error_) error_ = errno;
+            return ok;
+        }
+
+    private:
+        bool Open() {
+            if (shell_.durable_) {
+                std::lock_guard<std::mutex> lock(shell_.ioMutex_);
+                fd_ = shell_.syncGroup_.CreateTemp(std::string(path_));
+            } else {
+                fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            }
+            if (fd_ < 0 && !error_) error_ = errno;
+            return fd_ >= 0;
+        }
+
+        Shell& shell_;
+        const std::pmr::string& path_;
+        bool append_;
+        int fd_ = -1;
+        int error_ = 0;
+    };
+
+    static constexpr size_t kCatChunkSize = 64 * 1024;
+    static constexpr size_t kMaxWords = 1 << 20;  // больше слов в одной команде после раскрытия скобок не бывает
+    static constexpr size_t kStatParallelThreshold = 4096;
+    static constexpr size_t kMaxStatThreads = 8;
+    static constexpr size_t kCompareChunk = 4 << 20;  // кусок `cmp` для файлов на разных устройствах
+    static constexpr size_t kMaxStatColumns = 1 << 16;  // сколько полей `colstat` сводит за раз
+    static constexpr std::string_view kCompressedSuffix = ".shz";
+
+    static constexpr auto kWatchCoalesceWindow = std::chrono::milliseconds(50);
+    static constexpr auto kWatchMaxCoalesceDelay = std::chrono::milliseconds(500);  // дольше пачку `watch` не держим
+
+    fs::path cwd;
+    ShellStats stats_;
+    CommandError lastError_;
+    std::mutex programsMutex_;
+    std::string programsPath_;  // значение PATH, для которого заполнен `programs_`
+    std::unordered_map<std::string, std::string> programs_;  // имя команды -> путь к исполняемому файлу
+    std::mutex ownerNamesMutex_;
+    std::unordered_map<uint32_t, std::string> userNames_;
+    std::unordered_map<uint32_t, std::string> groupNames_;
+    std::mutex watchMutex_;
+    int watchStopFd_ = -1;  // eventfd, через который StopWatch будит выполняющийся `watch`
+    CommandArena arena_;
+    std::mutex ioMutex_;  // защищает кэш дозаписи и группу fsync при параллельном выполнении скрипта
+    bool durable_ = false;
+    bool structuredPipelines_ = false;
+    bool decompressOnCat_ = false;
+    std::unordered_map<std::string, std::string> variables_;
+    fs::path scriptCacheDir_ = UserCacheDir() / "scripts";
+    fs::path indexFile_ = UserCacheDir() / "name_index";
+    size_t prefetchDepth_ = 16;
+    Prefetcher prefetcher_{stats_};
+    SyncGroup syncGroup_{stats_};
+    AppendCache appendCache_{stats_};
+    IoThrottle throttle_{stats_};
+
+    /*
+     * Интерпретатор байткода скрипта.
+     */
+    int RunProgram(const ScriptProgram& program, std::ostream& out) {
+        struct Loop {
+            std::vector<std::string> values;
+            size_t next = 0;
+        };
+        std::vector<Loop> loops;
+        std::vector<std::string> words;
+        const std::vector<uint32_t>& code = program.code;
+        int result = 0;
+        size_t pc = 0;
+        while (pc < code.size()) {
+            switch (code[pc]) {
+                case ScriptProgram::Exec: {
+                    {
+                        ParsedCommand parsed(arena_.Resource());
+                        Args expanded(arena_.Resource());
+                        for (uint32_t k = 0; k < code[pc + 1]; ++k) {
+                            program.ExpandWord(code[pc + 2 + k], variables_, true, expanded);
+                        }
+                        const char* problem = nullptr;
+                        for (const std::pmr::string& word : expanded) {
+                            if (!problem) problem = AddWord(word, parsed.args);
+                        }
+                        out << "$ ";
+                        for (size_t k = 0; k < parsed.args.size(); ++k) {
+                            out << (k ? " " : "") << parsed.args[k];
+                        }
+                        out << '\n';
+                        lastError_ = CommandError();
+                        if (!problem && !SplitRedirect(parsed)) problem = "syntax error";
+                        result = problem ? Fail(lastError_, 0, "", problem) : ExecuteParsed(parsed, out, lastError_);
+                    }
+                    arena_.Reset();
+                    pc += 2 + code[pc + 1];
+                    break;
+                }
+                case ScriptProgram::Set:
+                    words.clear();
+                    program.ExpandWord(code[pc + 2], variables_, false, words);
+                    variables_[program.strings[code[pc + 1]]] = std::move(words[0]);
+                    pc += 3;
+                    break;
+                case ScriptProgram::ForBegin:
+                    loops.emplace_back();
+                    for (uint32_t k = 0; k < code[pc + 1]; ++k) {
+                        program.ExpandWord(code[pc + 2 + k], variables_, true, loops.back().values);
+                    }
+                    pc += 2 + code[pc + 1];
+                    break;
+                case ScriptProgram::ForNext: {
+                    if (loops.empty()) return 1;
+                    Loop& loop = loops.back();
+                    if (loop.next < loop.values.size()) {
+                        variables_[program.strings[code[pc + 1]]] = loop.values[loop.next++];
+                        pc += 3;
+                    } else {
+                        loops.pop_back();
+                        pc = code[pc + 2];
+                    }
+                    break;
+                }
+                case ScriptProgram::Jump:
+                    pc = code[pc + 1];
+                    break;
+                default:
+                    return 1;
+            }
+        }
+        return result;
+    }
+
+    /*
+     * Выполнить команду, используя для ее временной памяти арену `arena`.
+     */
+    int ExecuteIn(CommandArena& arena, std::string_view command, std::ostream& out, CommandError& error) {
+        out << "$ " << command << '\n';
+        error = CommandError();
+        int result;
+        {
+            ParsedCommand parsed(arena.Resource());
+            const char* problem = ParseCommand(command, parsed);
+            result = problem ? Fail(error, 0, "", problem) : ExecuteParsed(parsed, out, error);
+        }
+        arena.Reset();
+        return result;
+    }
+
+    /*
+     * Выполнить уже разобранную команду.
+     */
+    int ExecuteParsed(const ParsedCommand& parsed, std::ostream& out, CommandError& error) {
+        // Ошибки отложенной дозаписи, случившиеся при сбросах во время этой команды, возвращаются как ее ошибка
+        CommandError flushError;
+        {
+            std::lock_guard<std::mutex> lock(ioMutex_);
+            appendCache_.FlushExpired();
+        }
+
+        const Args& args = parsed.args;
+        const std::pmr::string& cmd = args[0];
+        std::pmr::string redirectPath(args.get_allocator());
+        if (!parsed.outputFile.empty()) JoinNormalized(cwd.native(), parsed.outputFile, redirectPath);
+        const bool append = parsed.append;
+        const bool pipeline = std::find(args.begin(), args.end(), "|") != args.end();
+
+        // Дозапись через `>>` идет через кэш, все остальные команды должны видеть на диске уже
+        // дописанные данные (сбрасывать кэш не нужно только перед `echo >>`: она ничего не читает, а внешняя
+        // программа может читать что угодно), а после удаления файлов закэшированные дескрипторы устаревают.
+        // В режиме надежной записи отложенные замены файлов нужно применить до того, как их кто-то прочитает:
+        // все -- перед любой командой, кроме `echo`, которая ничего не читает, и только заменяемый ей файл -- перед `echo`.
+        {
+            std::lock_guard<std::mutex> lock(ioMutex_);
+            const bool readsFiles = pipeline || cmd != "echo";
+            if (durable_ && (readsFiles ? syncGroup_.HasPendingReplaces()
+                                        : syncGroup_.HasPendingReplace(std::string(redirectPath)))) {
+                CommitDurable();
+            }
+            if (cmd == "rmdir") {
+                appendCache_.CloseAll();
+            } else if (cmd == "rm") {
+                std::pmr::string target(args.get_allocator());
+                for (size_t i = 1; i < args.size(); ++i) {
+                    JoinNormalized(cwd.native(), args[i], target);
+                    appendCache_.Close(target);
+                }
+            } else if (!append || readsFiles) {
+                appendCache_.FlushAll();
+                if (durable_ && !redirectPath.empty()) {
+                    appendCache_.Close(redirectPath);
+                }
+            }
+            flushError.code = appendCache_.TakeError(flushError.path);
+            if (flushError.code) flushError.message = "cannot write to file";
+        }
+
+        OstreamSink console(out);
+        RedirectSink redirect(*this, redirectPath, append);
+        OutputSink& sink = redirectPath.empty() ? static_cast<OutputSink&>(console) : redirect;
+
+        const int result = pipeline ? RunPipeline(args, sink, error) : Dispatch(args, sink, error);
+        if (redirectPath.empty()) {
+            console.Flush();
+        } else if (!redirect.Close(result == 0)) {
+            flushError.code = redirect.Error();
+            flushError.path = std::string(redirectPath);
+            flushError.message = "cannot write to file";
+        }
+        {
+            std::lock_guard<std::mutex> lock(ioMutex_);
+            if (durable_ && syncGroup_.Expired()) {
+                CommitDurable();
+            }
+            std::string path;
+            const int code = appendCache_.TakeError(path);
+            if (code && flushError.message.empty()) {
+                flushError = CommandError{code, std::move(path), "cannot write to file"};
+            }
+        }
+        if (!flushError.message.empty()) {
+            return Fail(error, flushError.code, flushError.path, flushError.message.c_str());
+        }
+
+        return result;
+    }
+
+    /*
+     * Выполнить одну команду (без перенаправления), выводя результат в `sink`.
+     */
+    int Dispatch(const Args& args, OutputSink& sink, CommandError& error) {
+        const std::pmr::string& cmd = args[0];
+        int result = 1;
+        if (cmd == "ls") {
+            result = ls(args, sink, error);
+        } else if (cmd == "cat") {
+            result = cat(args, sink, error);
+        } else if (cmd == "mkdir") {
+            result = mkdir(args, error);
+        } else if (cmd == "touch") {
+            result = touch(args, error);
+        } else if (cmd == "rmdir") {
+            result = rmdir(args, error);
+        } else if (cmd == "rm") {
+            result = rm(args, error);
+        } else if (cmd == "cd") {
+            result = cd(args, error);
+        } else if (cmd == "echo") {
+            result = echo(args, sink);
+        } else if (cmd == "archive") {
+            result = archive(args, error);
+        } else if (cmd == "sync") {
+            result = sync(args, error);
+        } else if (cmd == "dedupe") {
+            result = dedupe(args, sink, error);
+        } else if (cmd == "cut") {
+            result = cut(args, sink, error);
+        } else if (cmd == "colstat") {
+            result = colstat(args, sink, error);
+        } else if (cmd == "count") {
+            result = count(args, sink, error);
+        } else if (cmd == "cmp") {
+            result = cmp(args, sink, error);
+        } else if (cmd == "compress" || cmd == "decompress") {
+            result = compress(args, error);
+        } else if (cmd == "index") {
+            result = index(args, error);
+        } else if (cmd == "locate") {
+            result = locate(args, sink, error);
+        } else if (cmd == "watch") {
+            result = watch(args, sink, error);
+        } else if (cmd == "find" || cmd == "du" || cmd == "grep" || cmd == "head") {
+            TextRenderer renderer(sink);
+            result = Produce(args, renderer, error);
+        } else {
+            result = external(args, sink, error);
+        }
+        return result;
+    }
+
+    /*
+     * Выполнить конвейер `a | b | ...`. Команды после первой -- фильтры записей: `grep <pattern>` и `head [-n N]`.
+     * В структурном режиме (см. `SetStructuredPipelines`) команды передают друг другу пачки типизированных
+     * записей, и текстом записи становятся только в `out`. Иначе между командами записи проходят через текст,
+     * как между процессами обычного шелла.
+     */
+    int RunPipeline(const Args& args, OutputSink& out, CommandError& error) {
+        std::pmr::memory_resource* resource = args.get_allocator().resource();
+        std::pmr::vector<Args> stages(resource);
+        stages.emplace_back();
+        for (const std::pmr::string& arg : args) {
+            if (arg == "|") {
+                stages.emplace_back();
+            } else {
+                stages.back().push_back(arg);
+            }
+        }
+        for (const Args& stage : stages) {
+            if (stage.empty()) return Fail(error, 0, "", "syntax error near '|'");
+        }
+
+        // Ступени собираются с конца: каждая знает только следующую
+        TextRenderer renderer(out);
+        std::vector<std::unique_ptr<RecordSink>> filters;
+        RecordSink* next = &renderer;
+        for (size_t i = stages.size(); i-- > 1;) {
+            const Args& stage = stages[i];
+            if (stage[0] == "grep") {
+                if (stage.size() != 2) return Fail(error, 0, "", "grep: expected a single pattern in a pipeline");
+                filters.push_back(std::make_unique<GrepFilter>(stage[1], *next, resource));
+            } else if (stage[0] == "head") {
+                uint64_t count = 0;
+                size_t operand = 0;
+                if (!ParseHeadCount(stage, count, operand)) return Fail(error, 0, "", "head: invalid number of lines");
+                if (operand != stage.size()) return Fail(error, 0, std::string(stage[operand]), "head: cannot read file in a pipeline");
+                filters.push_back(std::make_unique<HeadFilter>(count, *next, resource));
+            } else {
+                return Fail(error, 0, std::string(stage[0]), "command cannot read from a pipeline");
+            }
+            next = filters.back().get();
+            if (!structuredPipelines_) {
+                filters.push_back(std::make_unique<TextBoundary>(*next, resource));
+                next = filters.back().get();
+            }
+        }
+
+        const int result = Produce(stages[0], *next, error);
+        next->Finish();
+        return result;
+    }
+
+    /*
+     * Выполнить команду, отдавая ее вывод записями в `next`. `find`, `du`, `ls`, `grep` и `head` выдают записи
+     * сами, вывод остальных команд режется на строки. Если получатель отказался от записей (`... | head`),
+     * команда останавливается без ошибки.
+     */
+    int Produce(const Args& args, RecordSink& next, CommandError& error) {
+        std::pmr::memory_resource* resource = args.get_allocator().resource();
+        const std::pmr::string& cmd = args[0];
+        if (cmd == "find") {
+            return find(args, next, error);
+        } else if (cmd == "du") {
+            return du(args, next, error);
+        } else if (cmd == "grep") {
+            if (args.size() < 2) return Fail(error, 0, "", "grep: missing pattern");
+            GrepFilter filter(args[1], next, resource);
+            return ReadLines(args, 2, filter, error);
+        } else if (cmd == "head") {
+            uint64_t count = 0;
+            size_t operand = 0;
+            if (!ParseHeadCount(args, count, operand)) return Fail(error, 0, "", "head: invalid number of lines");
+            if (args.size() > operand + 1) return Fail(error, 0, "", "head: too many operands");
+            HeadFilter filter(count, next, resource);
+            return ReadLines(args, operand, filter, error);
+        } else if (cmd == "ls") {
+            Listing listing(resource);
+            if (List(args, listing, error) != 0) return 1;
+            if (listing.longFormat || listing.columns) {
+                LineSink lines(next, resource);
+                PrintListing(listing, lines);
+                lines.Finish();
+            } else {
+                ListRecords(listing, next);
+            }
+            return 0;
+        }
+        LineSink lines(next, resource);
+        int result = Dispatch(args, lines, error);
+        if (result != 0 && lines.Stopped()) {
+            result = 0;
+            error = {};
+        }
+        lines.Finish();
+        return result;
+    }
+
+    std::string ResolvePath(std::string_view name) const {
+        std::string path;
+        JoinNormalized(cwd.native(), name, path);
+        return path;
+    }
+
+    /*
+     * Путь `name` относительно `base` (как `base / name`), записанный в `result`.
+     */
+    template <typename String>
+    static void JoinPath(std::string_view base, std::string_view name, String& result) {
+        result.clear();
+        if (name.empty() || name[0] != '/') {
+            result.append(base.data(), base.size());
+            if (!result.empty() && result.back() != '/') result += '/';
+        }
+        result.append(name.data(), name.size());
+    }
+
+    /*
+     * Лексически нормализованный путь `name` относительно `base` (как `(base / name).lexically_normal()`, но
+     * без завершающего '/'), записанный в `result`. Если памяти в `result` хватает, то ничего не выделяет.
+     */
+    template <typename String>
+    static void JoinNormalized(std::string_view base, std::string_view name, String& result) {
+        result.clear();
+        auto appendComponents = [&result](std::string_view path) {
+            if (!path.empty() && path[0] == '/') {
+                result.assign(1, '/');
+            }
+            size_t pos = 0;
+            while (pos < path.size()) {
+                size_t end = path.find('/', pos);
+                if (end == std::string_view::npos) end = path.size();
+                std::string_view part = path.substr(pos, end - pos);
+                pos = end + 1;
+                if (part.empty() || part == ".") continue;
+                if (part == "..") {
+                    if (result.size() == 1 && result[0] == '/') continue;
+                    size_t slash = result.rfind('/');
+                    std::string_view last(result.data(), result.size());
+                    if (slash != String::npos) last.remove_prefix(slash + 1);
+                    if (!result.empty() && last != "..") {
+                        result.resize(slash == String::npos ? 0 : (slash == 0 ? 1 : slash));
+                        continue;
+                    }
+                }
+                if (!result.empty() && result.back() != '/') result += '/';
+                result.append(part.data(), part.size());
+            }
+        };
+        if (name.empty() || name[0] != '/') appendComponents(base);
+        appendComponents(name);
+        if (result.empty()) result += '.';
+    }
+
+    static bool IsDotOrDotDot(const char* name) {
+        return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+    }
+
+    static std::string NormalizePath(const fs::path& path) {
+        std::string normal;
+        JoinNormalized("", path.native(), normal);
+        return normal;
+    }
+
+    /*
+     * Разобрать команду на аргументы. Возвращает nullptr или описание ошибки разбора.
+     */
+    static const char* ParseCommand(std::string_view command, ParsedCommand& parsed) {
+        auto isSpace = [](char c) {
+            return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+        };
+        size_t pos = 0;
+        while (pos < command.size()) {
+            while (pos < command.size() && isSpace(command[pos])) ++pos;
+            size_t begin = pos;
+            while (pos < command.size() && !isSpace(command[pos])) ++pos;
+            if (pos > begin) {
+                if (const char* problem = AddWord(command.substr(begin, pos - begin), parsed.args)) return problem;
+            }
+        }
+        return SplitRedirect(parsed) ? nullptr : "syntax error";
+    }
+
+    /*
+     * Раскрыть скобки в слове команды и добавить получившиеся слова к `args`. Возвращает nullptr или описание ошибки:
+     * слов стало больше `kMaxWords` или файл перенаправления раскрылся не в одно слово.
+     */
+    static const char* AddWord(std::string_view word, Args& args) {
+        const bool target = !args.empty() && (args.back() == ">" || args.back() == ">>");
+        const size_t before = args.size();
+        if (!ExpandBraces(word, args)) return "too many words after brace expansion";
+        if (target && args.size() - before != 1) return "ambiguous redirect";
+        return nullptr;
+    }
+
+    /*
+     * Раскрыть фигурные скобки в слове, как это делает bash, и добавить получившиеся слова в `result`:
+     * `f{a,b}` -> `fa fb`, `d{1..3}` -> `d1 d2 d3`, `{01..10..3}` -> `01 04 07 10`, `{a..c}` -> `a b c`.
+     * Скобки, которые нельзя раскрыть, остаются в слове как есть.
+     * Возвращает false, если в `result` стало бы больше `kMaxWords` слов (с учетом уже добавленных
+     * словами раньше, так что ограничено и произведение нескольких диапазонов).
+     */
+    static bool ExpandBraces(std::string_view word, Args& result) {
+        for (size_t open = word.find('{'); open != std::string_view::npos; open = word.find('{', open + 1)) {
+            size_t depth = 0, close = std::string_view::npos;
+            bool hasComma = false;
+            for (size_t i = open; i < word.size(); ++i) {
+                if (word[i] == '{') {
+                    ++depth;
+                } else if (word[i] == '}' && --depth == 0) {
+                    close = i;
+                    break;
+                } else if (word[i] == ',' && depth == 1) {
+                    hasComma = true;
+                }
+            }
+            if (close == std::string_view::npos) break;
+
+            const std::string_view prefix = word.substr(0, open);
+            const std::string_view body = word.substr(open + 1, close - open - 1);
+            const std::string_view suffix = word.substr(close + 1);
+            std::pmr::string expanded(result.get_allocator());
+            bool ok = true;
+            auto emit = [&](std::string_view middle) {
+                expanded.assign(prefix.data(), prefix.size());
+                expanded.append(middle.data(), middle.size());
+                expanded.append(suffix.data(), suffix.size());
+                return ok = ExpandBraces(expanded, result);
+            };
+            if (hasComma) {
+                depth = 0;
+                for (size_t i = 0, start = 0; i <= body.size() && ok; ++i) {
+                    if (i == body.size() || (body[i] == ',' && depth == 0)) {
+                        emit(body.substr(start, i - start));
+                        start = i + 1;
+                    } else if (body[i] == '{') {
+                        ++depth;
+                    } else if (body[i] == '}') {
+                        --depth;
+                    }
+                }
+                return ok;
+            }
+            if (ExpandRange(body, emit)) return ok;
+        }
+        if (result.size() >= kMaxWords) return false;
+        result.emplace_back(word);
+        return true;
+    }
+
+    /*
+     * Раскрыть диапазон `A..B` или `A..B..STEP` (числа или одиночные символы), вызывая `emit` для каждого значения,
+     * пока он возвращает true. Возвращает false, если `body` -- не диапазон.
+     */
+    template <typename Emit>
+    static bool ExpandRange(std::string_view body, Emit&& emit) {
+        size_t dots = body.find("..");
+        if (dots == std::string_view::npos) return false;
+        std::string_view first = body.substr(0, dots), last = body.substr(dots + 2), stepText;
+        if (size_t dots2 = last.find(".."); dots2 != std::string_view::npos) {
+            stepText = last.substr(dots2 + 2);
+            last = last.substr(0, dots2);
+        }
+        long long step = 1;
+        if (!stepText.empty() && !ParseInteger(stepText, step)) return false;
+        // Шаг и расстояние между концами считаются без знака: для концов около LLONG_MIN/LLONG_MAX они не влезают в long long
+        const unsigned long long stride = step == 0 ? 1 : (step < 0 ? 0 - static_cast<unsigned long long>(step)
+                                                                     : static_cast<unsigned long long>(step));
+
+        long long from, to;
+        bool letters = false;
+        size_t width = 0;
+        if (ParseInteger(first, from) && ParseInteger(last, to)) {
+            auto padded = [](std::string_view number) {
+                if (!number.empty() && number[0] == '-') number.remove_prefix(1);
+                return number.size() > 1 && number[0] == '0';
+            };
+            if (padded(first) || padded(last)) width = std::max(first.size(), last.size());
+        } else if (first.size() == 1 && last.size() == 1 && std::isalpha(static_cast<unsigned char>(first[0])) &&
+                   std::isalpha(static_cast<unsigned char>(last[0]))) {
+            from = first[0];
+            to = last[0];
+            letters = true;
+        } else {
+            return false;
+        }
+        char text[32];
+        if (width >= sizeof(text)) return false;
+        const bool up = from <= to;
+        const unsigned long long span = up ? static_cast<unsigned long long>(to) - static_cast<unsigned long long>(from)
+                                           : static_cast<unsigned long long>(from) - static_cast<unsigned long long>(to);
+        for (unsigned long long offset = 0;; offset += stride) {
+            const unsigned long long bits = up ? static_cast<unsigned long long>(from) + offset
+                                               : static_cast<unsigned long long>(from) - offset;
+            const long long value = static_cast<long long>(bits);
+            bool more;
+            if (letters) {
+                text[0] = static_cast<char>(value);
+                more = emit(std::string_view(text, 1));
+            } else {
+                int size = std::snprintf(text, sizeof(text), "%0*lld", static_cast<int>(width), value);
+                more = emit(std::string_view(text, static_cast<size_t>(size)));
+            }
+            if (!more || span - offset < stride) break;
+        }
+        return true;
+    }
+
+    static bool ParseInteger(std::string_view text, long long& value) {
+        if (text.empty()) return false;
+        auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        return ec == std::errc() && end == text.data() + text.size();
+    }
+
+    /*
+     * Отделить от аргументов команды перенаправление вывода `> <file>` или `>> <file>`.
+     */
+    static bool SplitRedirect(ParsedCommand& parsed) {
+        Args& args = parsed.args;
+        if (args.empty()) return false;
+
+        for (size_t i = 0; i < args.size(); ++i) {
+            if (args[i] == ">" || args[i] == ">>") {
+                // Перед перенаправлением должна остаться команда
+                if (i > 0 && i + 1 < args.size()) {
+                    parsed.outputFile = args[i + 1];
+                    parsed.append = (args[i] == ">>");
+                    args.resize(i);
+                    break;
+                } else {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    /*
+     * Определить, какие пути команда читает и изменяет.
+     * Возвращает false, если этого нельзя сказать заранее -- такая команда выполняется в скрипте как барьер.
+     */
+    bool AnalyzeCommand(const std::string& command, std::vector<PathAccess>& accesses) const {
+        ParsedCommand parsed;
+        if (ParseCommand(command, parsed)) return true;
+        const Args& args = parsed.args;
+        const std::pmr::string& cmd = args[0];
+        if (std::find(args.begin(), args.end(), "|") != args.end()) return false;
+
+        if (cmd == "ls") {
+            auto operand = std::find_if(args.begin() + 1, args.end(), [](const std::pmr::string& arg) {
+                return arg.size() < 2 || arg[0] != '-';
+            });
+            std::error_code ec;
+            accesses.push_back({operand != args.end() ? NormalizePath(fs::absolute(fs::path(*operand), ec)) : NormalizePath(cwd), false});
+        } else if (cmd == "cat") {
+            if (args.size() > 1) accesses.push_back({ResolvePath(args[1]), false, true});
+        } else if (cmd == "archive" && args.size() == 4 && args[1] == "create") {
+            accesses.push_back({ResolvePath(args[2]), true});
+            accesses.push_back({ResolvePath(args[3]), false});
+        } else if (cmd == "count") {
+            for (size_t i = 1; i < args.size(); ++i) {
+                if (args[i] == "-k" || args[i] == "-m") {
+                    ++i;
+                } else {
+                    accesses.push_back({ResolvePath(args[i]), false, true});
+                }
+            }
+        } else if ((cmd == "compress" || cmd == "decompress") && args.size() == 3) {
+            accesses.push_back({ResolvePath(args[1]), false, true});
+            accesses.push_back({ResolvePath(args[2]), true});
+        } else if (cmd == "cmp" && args.size() >= 3) {
+            accesses.push_back({ResolvePath(args[args.size() - 2]), false, true});
+            accesses.push_back({ResolvePath(args[args.size() - 1]), false, true});
+        } else if (cmd == "cut" || cmd == "colstat") {
+            char delimiter = '\t';
+            DelimitedText::FieldSet fields;
+            bool haveFields = false;
+            std::string_view file;
+            if (ParseFieldOptions(args, delimiter, fields, haveFields, file)) accesses.push_back({ResolvePath(file), false, true});
+        } else if (cmd == "dedupe") {
+            bool modifies = false;
+            for (size_t i = 1; i < args.size(); ++i) {
+                if (args[i] == "--link" || args[i] == "--reflink") {
+                    modifies = true;
+                } else if (args[i] != "--report") {
+                    accesses.push_back({ResolvePath(args[i]), false});
+                }
+            }
+            for (PathAccess& access : accesses) {
+                access.write = modifies;
+            }
+        } else if (cmd == "mkdir" || cmd == "rmdir" || cmd == "rm" || cmd == "touch") {
+            // `mkdir -p` создает и предков пути, которые потом могут понадобиться любым командам под ними
+            if (cmd == "mkdir" && std::find(args.begin() + 1, args.end(), "-p") != args.end()) return false;
+            for (size_t i = 1; i < args.size(); ++i) {
+                accesses.push_back({ResolvePath(args[i]), true});
+            }
+        } else if (cmd != "echo") {
+            return false;
+        }
+        if (!parsed.outputFile.empty()) {
+            accesses.push_back({ResolvePath(parsed.outputFile), true});
+        }
+        return true;
+    }
+
+    /*
+     * Выполнить команды `commands[begin, begin + accesses.size())`, ни одна из которых не является барьером,
+     * на пуле из `workers` потоков с учетом зависимостей по путям.
+     */
+    void RunParallel(const std::vector<std::string>& commands, size_t begin,
+                     const std::vector<std::vector<PathAccess>>& accesses, std::ostream& out, size_t workers,
+                     std::vector<int>& results, std::vector<CommandError>& errors) {
+        struct PathState {
+            size_t lastWriter = SIZE_MAX;
+            std::vector<size_t> readers;
+        };
+        const size_t count = accesses.size();
+        std::vector<std::vector<size_t>> dependents(count);
+        std::vector<size_t> pending(count, 0);
+        std::map<std::string, PathState> states;
+        std::vector<size_t> deps;
+
+        for (size_t i = 0; i < count; ++i) {
+            deps.clear();
+            auto addState = [&](const PathState& state, bool write) {
+                if (state.lastWriter != SIZE_MAX) deps.push_back(state.lastWriter);
+                if (write) deps.insert(deps.end(), state.readers.begin(), state.readers.end());
+            };
+            for (const PathAccess& access : accesses[i]) {
+                const std::string& path = access.path;
+                // Сам путь и все его предки
+                for (size_t pos = 0; pos != std::string::npos; pos = path.find('/', pos + 1)) {
+                    auto it = states.find(pos == 0 ? std::string("/") : path.substr(0, pos));
+                    if (it != states.end()) addState(it->second, access.write);
+                }
+                auto self = states.find(path);
+                if (self != states.end()) addState(self->second, access.write);
+                // Все потомки пути
+                const std::string prefix = path == "/" ? path : path + "/";
+                auto it = states.lower_bound(prefix);
+                while (it != states.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+                    addState(it->second, access.write);
+                    // После записи в путь состояние потомков больше не нужно: все их писатели и читатели
+                    // теперь упорядочены перед этой командой.
+                    it = access.write && it->first != path ? states.erase(it) : std::next(it);
+                }
+            }
+            std::sort(deps.begin(), deps.end());
+            deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+            for (size_t dep : deps) {
+                dependents[dep].push_back(i);
+            }
+            pending[i] = deps.size();
+            for (const PathAccess& access : accesses[i]) {
+                PathState& state = states[access.path];
+                if (access.write) {
+                    state.lastWriter = i;
+                    state.readers.clear();
+                } else {
+                    state.readers.push_back(i);
+                }
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<size_t> ready;
+        std::vector<std::string> outputs(count);
+        std::vector<bool> finished(count, false);
+        size_t done = 0, emitted = 0;
+        for (size_t i = count; i-- > 0;) {
+            if (pending[i] == 0) ready.push_back(i);
+        }
+
+        auto worker = [&]() {
+            CommandArena arena;
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                cv.wait(lock, [&]() { return !ready.empty() || done == count; });
+                if (ready.empty()) return;
+                size_t i = ready.back();
+                ready.pop_back();
+                lock.unlock();
+
+                std::ostringstream commandOut;
+                CommandError error;
+                int result = ExecuteIn(arena, commands[begin + i], commandOut, error);
+
+                lock.lock();
+                results[begin + i] = result;
+                errors[begin + i] = std::move(error);
+                outputs[i] = commandOut.str();
+                finished[i] = true;
+                ++done;
+                for (size_t next : dependents[i]) {
+                    if (--pending[next] == 0) ready.push_back(next);
+                }
+                // Вывод отдаем строго в порядке команд в скрипте
+                while (emitted < count && finished[emitted]) {
+                    out << outputs[emitted];
+                    std::string().swap(outputs[emitted]);
+                    ++emitted;
+                }
+                cv.notify_all();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < workers; ++t) {
+            threads.emplace_back(worker);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Вызывается под `ioMutex_`
+    bool CommitDurable() {
+        const bool flushed = appendCache_.FlushAll();
+        return syncGroup_.Commit() && flushed;
+    }
+
+    /*
+     * Запомнить описание ошибки команды и вернуть код ответа 1.
+     */
+    static int Fail(CommandError& error, int code, const std::string& path, const char* what) {
+        error.code = code;
+        error.path = path;
+        error.message = code ? std::string(what) + ": " + std::generic_category().message(code) : std::string(what);
+        return 1;
+    }
+
+    /*
+     * ls [-tSCla1] [directory] -- вывести содержимое директории, отсортированное по именам.
+     * -t -- сначала новые (по mtime), -S -- сначала большие, -C -- в колонки по ширине терминала, -1 -- по одному
+     * имени в строке (по умолчанию), -l -- подробный формат (тип и права, число ссылок, владелец, группа, размер,
+     * время изменения), -a -- показывать также "." и "..".
+     */
+    int ls(const Args& args, OutputSink& out, CommandError& error) {
+        Listing listing(args.get_allocator().resource());
+        if (List(args, listing, error) != 0) return 1;
+        PrintListing(listing, out);
+        return 0;
+    }
+
+    /*
+     * Прочитанная командой `ls` директория: ключи, отсортированные записи и их метаданные (если их запрашивали).
+     */
+    struct Listing {
+        explicit Listing(std::pmr::memory_resource* resource) : items(resource), infos(resource) {}
+
+        Listing(const Listing&) = delete;
+        Listing& operator=(const Listing&) = delete;
+
+        ~Listing() {
+            if (stream) ::closedir(stream);
+        }
+
+        bool byTime = false, bySize = false, columns = false, longFormat = false, all = false;
+        DIR* stream = nullptr;
+        std::pmr::vector<NameSorter::Item> items;
+        std::pmr::vector<struct statx> infos;
+    };
+
+    /*
+     * Разобрать ключи `ls`, прочитать директорию и отсортировать записи.
+     */
+    int List(const Args& args, Listing& listing, CommandError& error) {
+        bool& byTime = listing.byTime;
+        bool& bySize = listing.bySize;
+        bool& columns = listing.columns;
+        bool& longFormat = listing.longFormat;
+        bool& all = listing.all;
+        std::string_view operand;
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i].size() < 2 || args[i][0] != '-') {
+                if (!operand.empty()) return Fail(error, 0, "", "ls: too many operands");
+                operand = args[i];
+                continue;
+            }
+            for (char flag : std::string_view(args[i]).substr(1)) {
+                if (flag == 't') {
+                    byTime = true, bySize = false;
+                } else if (flag == 'S') {
+                    bySize = true, byTime = false;
+                } else if (flag == 'C' || flag == '1') {
+                    columns = flag == 'C';
+                } else if (flag == 'l') {
+                    longFormat = true;
+                } else if (flag == 'a') {
+                    all = true;
+                } else {
+                    return Fail(error, 0, "", "ls: invalid option");
+                }
+            }
+        }
+        std::pmr::memory_resource* resource = args.get_allocator().resource();
+        std::pmr::string dir(operand.empty() ? std::string_view(cwd.native()) : operand, resource);
+        DIR* stream = listing.stream = ::opendir(dir.c_str());
+        if (!stream) return Fail(error, errno, std::string(dir), "cannot open directory");
+
+        std::pmr::vector<NameSorter::Item>& items = listing.items;
+        errno = 0;
+        while (const struct dirent* entry = ::readdir(stream)) {
+            if (!all && IsDotOrDotDot(entry->d_name)) continue;
+            const size_t size = std::strlen(entry->d_name);
+            char* name = static_cast<char*>(resource->allocate(size + 1, 1));
+            std::memcpy(name, entry->d_name, size + 1);
+            items.push_back({name, static_cast<uint32_t>(size), 0, static_cast<uint32_t>(items.size())});
+        }
+        int code = errno;
+        if (code) {
+            return Fail(error, code, std::string(dir), "cannot read directory");
+        }
+
+        // Запрашиваем у statx только те поля, которые понадобятся
+        unsigned mask = 0;
+        if (longFormat) {
+            mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME |
+                   STATX_BLOCKS;
+        } else if (byTime) {
+            mask = STATX_MTIME;
+        } else if (bySize) {
+            mask = STATX_SIZE;
+        }
+        std::pmr::vector<struct statx>& infos = listing.infos;
+        if (mask) {
+            infos.resize(items.size());
+            StatEntries(::dirfd(stream), items, mask, infos);
+            for (NameSorter::Item& item : items) {
+                const struct statx& info = infos[item.index];
+                item.key = byTime ? info.stx_mtime.tv_sec * 1000000000LL + info.stx_mtime.tv_nsec
+                                  : static_cast<int64_t>(info.stx_size);
+            }
+        }
+
+        NameSorter::SortByName(items.data(), items.size(), resource);
+        if (byTime || bySize) NameSorter::SortByKeyDescending(items.data(), items.size(), resource);
+        return 0;
+    }
+
+    void PrintListing(const Listing& listing, OutputSink& out) {
+        if (listing.longFormat) {
+            PrintLong(::dirfd(listing.stream), listing.items, listing.infos, out);
+        } else if (listing.columns) {
+            PrintColumns(listing.items, TerminalWidth(), out);
+        } else {
+            for (const NameSorter::Item& item : listing.items) {
+                out.Append(item.name, item.size);
+                out.Append('\n');
+            }
+        }
+    }
+
+    /*
+     * Получить метаданные записей директории `dirFd` через statx относительно нее (без разбора полного пути) и
+     * без перехода по символическим ссылкам. Для больших директорий вызовы распределяются по нескольким потокам.
+     * Если statx для записи не удался, ее поля остаются нулевыми.
+     */
+    static void StatEntries(int dirFd, const std::pmr::vector<NameSorter::Item>& items, unsigned mask,
+                            std::pmr::vector<struct statx>& infos) {
+        auto statRange = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                const NameSorter::Item& item = items[i];
+                if (::statx(dirFd, item.name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, mask, &infos[item.index]) != 0) {
+                    infos[item.index] = {};
+                }
+            }
+        };
+        const size_t threads = items.size() >= kStatParallelThreshold
+                                   ? std::min<size_t>(kMaxStatThreads, std::thread::hardware_concurrency())
+                                   : 1;
+        if (threads <= 1) {
+            statRange(0, items.size());
+            return;
+        }
+        std::vector<std::thread> pool;
+        const size_t chunk = (items.size() + threads - 1) / threads;
+        for (size_t begin = chunk; begin < items.size(); begin += chunk) {
+            pool.emplace_back(statRange, begin, std::min(items.size(), begin + chunk));
+        }
+        statRange(0, chunk);
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+    }
+
+    /*
+     * Имя пользователя (или группы, если `group`) по id. Имена кэшируются на всю сессию, чтобы не обращаться к
+     * базе пользователей для каждой строки `ls -l`; неизвестные id выводятся числом.
+     */
+    std::string_view OwnerName(bool group, uint32_t id) {
+        std::lock_guard<std::mutex> lock(ownerNamesMutex_);
+        auto& names = group ? groupNames_ : userNames_;
+        auto it = names.find(id);
+        if (it != names.end()) return it->second;
+
+        std::string name;
+        std::vector<char> buffer(16 * 1024);
+        if (group) {
+            struct group entry, *found = nullptr;
+            if (::getgrgid_r(id, &entry, buffer.data(), buffer.size(), &found) == 0 && found) name = found->gr_name;
+        } else {
+            struct passwd entry, *found = nullptr;
+            if (::getpwuid_r(id, &entry, buffer.data(), buffer.size(), &found) == 0 && found) name = found->pw_name;
+        }
+        if (name.empty()) name = std::to_string(id);
+        return names.emplace(id, std::move(name)).first->second;
+    }
+
+    /*
+     * Вывести записи в подробном формате `ls -l`. Ширины колонок считаются заранее, а имена владельцев
+     * разрешаются по одному разу для каждого различного id.
+     */
+    void PrintLong(int dirFd, const std::pmr::vector<NameSorter::Item>& items,
+                   const std::pmr::vector<struct statx>& infos, OutputSink& out) {
+        std::pmr::memory_resource* resource = items.get_allocator().resource();
+        std::pmr::vector<std::pair<uint32_t, std::string_view>> users(resource), groups(resource);
+        auto owner = [this](bool group, uint32_t id, std::pmr::vector<std::pair<uint32_t, std::string_view>>& known) {
+            for (const auto& [knownId, name] : known) {
+                if (knownId == id) return name;
+            }
+            known.emplace_back(id, OwnerName(group, id));
+            return known.back().second;
+        };
+        auto digits = [](uint64_t value) {
+            size_t count = 1;
+            for (; value >= 10; value /= 10) ++count;
+            return count;
+        };
+        size_t linksWidth = 1, userWidth = 1, groupWidth = 1, sizeWidth = 1;
+        uint64_t blocks = 0;
+        for (const NameSorter::Item& item : items) {
+            const struct statx& info = infos[item.index];
+            linksWidth = std::max(linksWidth, digits(info.stx_nlink));
+            userWidth = std::max(userWidth, owner(false, info.stx_uid, users).size());
+            groupWidth = std::max(groupWidth, owner(true, info.stx_gid, groups).size());
+            sizeWidth = std::max(sizeWidth, digits(info.stx_size));
+            blocks += info.stx_blocks;
+        }
+
+        char number[24];
+        auto appendPadded = [&out](std::string_view text, size_t width, bool right) {
+            if (!right) out.Append(text);
+            for (size_t pad = text.size(); pad < width; ++pad) out.Append(' ');
+            if (right) out.Append(text);
+        };
+        auto format = [&number](uint64_t value) {
+            return std::string_view(number, std::to_chars(number, number + sizeof(number), value).ptr - number);
+        };
+        out.Append("total ");
+        out.Append(format(blocks / 2));
+        out.Append('\n');
+
+        const time_t now = ::time(nullptr);
+        char link[PATH_MAX];
+        for (const NameSorter::Item& item : items) {
+            const struct statx& info = infos[item.index];
+            out.Append(ModeString(info.stx_mode, number));
+            out.Append(' ');
+            appendPadded(format(info.stx_nlink), linksWidth, true);
+            out.Append(' ');
+            appendPadded(owner(false, info.stx_uid, users), userWidth, false);
+            out.Append(' ');
+            appendPadded(owner(true, info.stx_gid, groups), groupWidth, false);
+            out.Append(' ');
+            appendPadded(format(info.stx_size), sizeWidth, true);
+            out.Append(' ');
+
+            // Как в ls: для файлов старше полугода (или из будущего) вместо времени выводится год
+            const time_t mtime = info.stx_mtime.tv_sec;
+            struct tm local;
+            ::localtime_r(&mtime, &local);
+            const bool recent = mtime <= now && now - mtime < 180 * 24 * 60 * 60;
+            out.Append(std::string_view(number, std::strftime(number, sizeof(number),
+                                                              recent ? "%b %e %H:%M" : "%b %e  %Y", &local)));
+            out.Append(' ');
+            out.Append(item.name, item.size);
+            if (S_ISLNK(info.stx_mode)) {
+                const ssize_t size = ::readlinkat(dirFd, item.name, link, sizeof(link));
+                if (size >= 0) {
+                    out.Append(" -> ");
+                    out.Append(link, size);
+                }
+            }
+            out.Append('\n');
+        }
+    }
+
+    /*
+     * Тип и права файла в виде "drwxr-xr-x", записанные в `buffer`.
+     */
+    static std::string_view ModeString(uint32_t mode, char* buffer) {
+        char type = '-';
+        if (S_ISDIR(mode)) type = 'd';
+        else if (S_ISLNK(mode)) type = 'l';
+        else if (S_ISCHR(mode)) type = 'c';
+        else if (S_ISBLK(mode)) type = 'b';
+        else if (S_ISFIFO(mode)) type = 'p';
+        else if (S_ISSOCK(mode)) type = 's';
+        buffer[0] = type;
+        const char* letters = "rwxrwxrwx";
+        for (int i = 0; i < 9; ++i) {
+            buffer[1 + i] = mode & (0400 >> i) ? letters[i] : '-';
+        }
+        auto special = [&buffer](int pos, bool set, char withExec, char withoutExec) {
+            if (set) buffer[pos] = buffer[pos] == 'x' ? withExec : withoutExec;
+        };
+        special(3, mode & S_ISUID, 's', 'S');
+        special(6, mode & S_ISGID, 's', 'S');
+        special(9, mode & S_ISVTX, 't', 'T');
+        return std::string_view(buffer, 10);
+    }
+
+    /*
+     * Ширина терминала для `ls -C`: размер окна, если stdout -- терминал, иначе $COLUMNS, иначе 80.
+     */
+    static size_t TerminalWidth() {
+        struct winsize size;
+        if (::isatty(STDOUT_FILENO) && ::ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+            return size.ws_col;
+        }
+        long long columns;
+        const char* env = std::getenv("COLUMNS");
+        if (env && ParseInteger(env, columns) && columns > 0) return static_cast<size_t>(columns);
+        return 80;
+    }
+
+    /*
+     * Вывести имена в колонки (по столбцам, как `ls -C`), выбрав наибольшее число колонок, которое помещается в
+     * `width`. Ширины колонок для всех вариантов числа колонок считаются за один проход по именам.
+     */
+    static void PrintColumns(const std::pmr::vector<NameSorter::Item>& items, size_t width, OutputSink& out) {
+        constexpr size_t kGap = 2;
+        const size_t count = items.size();
+        if (count == 0) return;
+        // Каждая колонка занимает хотя бы один символ и отступ
+        const size_t maxColumns = std::max<size_t>(1, std::min(count, (width + kGap) / (1 + kGap)));
+        // Ширины колонок варианта с c колонками лежат в widths[c * (c - 1) / 2 ...]
+        std::pmr::vector<size_t> widths(maxColumns * (maxColumns + 1) / 2, 0, items.get_allocator().resource());
+        std::pmr::vector<size_t> lineWidths(maxColumns + 1, 0, items.get_allocator().resource());
+        std::pmr::vector<bool> fits(maxColumns + 1, true, items.get_allocator().resource());
+        for (size_t i = 0; i < count; ++i) {
+            for (size_t c = 1; c <= maxColumns; ++c) {
+                if (!fits[c]) continue;
+                const size_t rows = (count + c - 1) / c;
+                size_t& column = widths[c * (c - 1) / 2 + i / rows];
+                const size_t needed = items[i].size + (i / rows + 1 < c ? kGap : 0);
+                if (needed > column) {
+                    lineWidths[c] += needed - column;
+                    column = needed;
+                    fits[c] = lineWidths[c] <= width;
+                }
+            }
+        }
+        size_t columns = maxColumns;
+        while (columns > 1 && !fits[columns]) --columns;
+
+        const size_t rows = (count + columns - 1) / columns;
+        const size_t* columnWidths = &widths[columns * (columns - 1) / 2];
+        for (size_t row = 0; row < rows; ++row) {
+            for (size_t column = 0; column < columns; ++column) {
+                const size_t i = column * rows + row;
+                if (i >= count) break;
+                out.Append(items[i].name, items[i].size);
+                if (column + 1 < columns && i + rows < count) {
+                    for (size_t pad = items[i].size; pad < columnWidths[column]; ++pad) {
+                        out.Append(' ');
+                    }
+                }
+            }
+            out.Append('\n');
+        }
+    }
+
+    int cat(const Args& args, OutputSink& out, CommandError& error) {
+        if (args.size() < 2) return Fail(error, 0, "", "cat: missing file operand");
+        if (prefetcher_.Active()) prefetcher_.NoteRead(ResolvePath(args[1]));
+        std::pmr::string path(args.get_allocator());
+        JoinPath(cwd.native(), args[1], path);
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return Fail(error, errno, std::string(path), "cannot open file");
+        if (decompressOnCat_ && BlockCodec::IsCompressed(fd)) {
+            const int code = BlockCodec::Decompress(fd, out);
+            ::close(fd);
+            if (code == EIO) return Fail(error, 0, std::string(path), "cannot write output");
+            return code ? Fail(error, code, std::string(path), "cannot decompress file") : 0;
+        }
+        // Куски файла отдаются приемнику без копирования и сразу сбрасываются, пока буфер не переиспользован
+        char* chunk = static_cast<char*>(args.get_allocator().resource()->allocate(kCatChunkSize));
+        int result = 0;
+        while (true) {
+            ssize_t size = ::read(fd, chunk, kCatChunkSize);
+            if (size < 0 && errno == EINTR) continue;
+            if (size < 0) {
+                result = Fail(error, errno, std::string(path), "cannot read file");
+                break;
+            }
+            if (size == 0) break;
+            throttle_.Charge(size);
+            out.AppendRef(chunk, static_cast<size_t>(size));
+            if (!out.Flush()) {
+                result = Fail(error, 0, std::string(path), "cannot write output");
+                break;
+            }
+        }
+        ::close(fd);
+        args.get_allocator().resource()->deallocate(chunk, kCatChunkSize);
+        return result;
+    }
+
+    /*
+     * Разобрать ключ `-n N` (или `-nN`) команды `head`. `operand` -- индекс первого операнда после ключей.
+     */
+    static bool ParseHeadCount(const Args& args, uint64_t& count, size_t& operand) {
+        count = 10;
+        operand = 1;
+        if (operand < args.size() && args[operand].compare(0, 2, "-n") == 0) {
+            std::string_view number = std::string_view(args[operand]).substr(2);
+            if (number.empty()) {
+                if (++operand == args.size()) return false;
+                number = args[operand];
+            }
+            ++operand;
+            const auto [end, ec] = std::from_chars(number.data(), number.data() + number.size(), count);
+            if (ec != std::errc() || end != number.data() + number.size()) return false;
+        }
+        return true;
+    }
+
+    /*
+     * Выдать записи прочитанной `ls` директории: имя, а также размер и mtime, если их запрашивали для сортировки.
+     */
+    static void ListRecords(const Listing& listing, RecordSink& next) {
+        RecordBatch batch(listing.items.get_allocator().resource());
+        batch.format = RecordBatch::Names;
+        batch.columns = RecordBatch::kName | (listing.infos.empty() ? 0 : RecordBatch::kSize | RecordBatch::kMtime);
+        for (const NameSorter::Item& item : listing.items) {
+            batch.names.Push(std::string_view(item.name, item.size));
+            if (!listing.infos.empty()) {
+                const struct statx& info = listing.infos[item.index];
+                batch.sizes.push_back(info.stx_size);
+                batch.mtimes.push_back(info.stx_mtime.tv_sec * 1000000000LL + info.stx_mtime.tv_nsec);
+            }
+            if (++batch.rows == RecordBatch::kMaxRows) {
+                if (!next.Push(batch)) return;
+                batch.Clear();
+            }
+        }
+        if (batch.rows > 0) next.Push(batch);
+    }
+
+    /*
+     * Прочитать строки файлов `args[first...]` и отдать их записями в `next`. Если файлов несколько,
+     * у записей заполнено имя файла (как `grep` выводит "файл:строка").
+     */
+    int ReadLines(const Args& args, size_t first, RecordSink& next, CommandError& error) {
+        if (first >= args.size()) return Fail(error, 0, std::string(args[0]), "missing file operand");
+        std::pmr::memory_resource* resource = args.get_allocator().resource();
+        std::pmr::string path(resource);
+        char* chunk = static_cast<char*>(resource->allocate(kCatChunkSize));
+        int result = 0;
+        for (size_t i = first; i < args.size() && result == 0; ++i) {
+            JoinPath(cwd.native(), args[i], path);
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                result = Fail(error, errno, std::string(path), "cannot open file");
+                break;
+            }
+            LineSink lines(next, resource, args.size() - first > 1 ? std::string_view(args[i]) : std::string_view());
+            while (true) {
+                ssize_t size = ::read(fd, chunk, kCatChunkSize);
+                if (size < 0 && errno == EINTR) continue;
+                if (size < 0) {
+                    result = Fail(error, errno, std::string(path), "cannot read file");
+                    break;
+                }
+                if (size == 0) break;
+                throttle_.Charge(size);
+                lines.AppendRef(chunk, static_cast<size_t>(size));
+                if (!lines.Flush()) break;
+            }
+            ::close(fd);
+            if (!lines.Finish()) break;
+        }
+        resource->deallocate(chunk, kCatChunkSize);
+        return result;
+    }
+
+    /*
+     * Обход дерева для `find` и `du`: записи копятся в пачку и уходят получателю по мере ее заполнения.
+     */
+    struct TreeWalk {
+        TreeWalk(RecordSink& next, std::pmr::memory_resource* resource) : next(next), batch(resource), path(resource) {}
+
+        void Add(uint64_t size, int64_t mtime) {
+            batch.names.Push(path);
+            if (batch.columns & RecordBatch::kSize) batch.sizes.push_back(size);
+            if (batch.columns & RecordBatch::kMtime) batch.mtimes.push_back(mtime);
+            if (++batch.rows == RecordBatch::kMaxRows) Send();
+        }
+
+        void Send() {
+            if (batch.rows > 0 && !stopped) stopped = !next.Push(batch);
+            batch.Clear();
+        }
+
+        void Error(int error, std::string_view name = {}) {
+            if (code) return;
+            code = error;
+            errorPath = std::string(path);
+            if (!name.empty()) errorPath.append("/").append(name);
+        }
+
+        RecordSink& next;
+        RecordBatch batch;
+        std::pmr::string path;                    // путь текущей директории, как его выводить
+        std::set<std::pair<dev_t, ino_t>> linked; // уже учтенные файлы с несколькими жесткими ссылками
+        int code = 0;                             // первая ошибка обхода
+        std::string errorPath;
+        bool stopped = false;
+    };
+
+    /*
+     * Открыть корень обхода `find`/`du` (операнд или cwd) и выдать запись о нем.
+     */
+    int OpenWalkRoot(const Args& args, TreeWalk& walk, struct stat& info, CommandError& error) {
+        if (args.size() > 2) return Fail(error, 0, "", "too many operands");
+        walk.path = args.size() > 1 ? std::string_view(args[1]) : std::string_view(".");
+        std::pmr::string root(args.get_allocator());
+        JoinPath(cwd.native(), walk.path, root);
+        int fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || ::fstat(fd, &info) != 0) {
+            const int code = errno;
+            if (fd >= 0) ::close(fd);
+            Fail(error, code, std::string(root), "cannot open directory");
+            return -1;
+        }
+        return fd;
+    }
+
+    /*
+     * find [directory] -- вывести пути всех записей под директорией, начиная с нее самой (в порядке обхода, как `find`).
+     * Размер и mtime записей заполняются, только если их читает кто-то дальше по конвейеру: иначе тип записи
+     * берется из d_type, и stat не нужен.
+     */
+    int find(const Args& args, RecordSink& next, CommandError& error) {
+        TreeWalk walk(next, args.get_allocator().resource());
+        walk.batch.format = RecordBatch::Names;
+        walk.batch.columns = RecordBatch::kName | (next.Needs() & (RecordBatch::kSize | RecordBatch::kMtime));
+        struct stat info;
+        const int fd = OpenWalkRoot(args, walk, info, error);
+        if (fd < 0) return 1;
+        walk.Add(info.st_size, info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec);
+        FindWalk(fd, walk);
+        walk.Send();
+        return walk.code ? Fail(error, walk.code, walk.errorPath, "find") : 0;
+    }
+
+    static void FindWalk(int dirFd, TreeWalk& walk) {
+        DIR* stream = ::fdopendir(dirFd);
+        if (!stream) {
+            walk.Error(errno);
+            ::close(dirFd);
+            return;
+        }
+        const size_t length = walk.path.size();
+        while (!walk.stopped) {
+            errno = 0;
+            const struct dirent* entry = ::readdir(stream);
+            if (!entry) {
+                if (errno) walk.Error(errno);
+                break;
+            }
+            if (IsDotOrDotDot(entry->d_name)) continue;
+            struct stat info = {};
+            info.st_mode = DTTOIF(entry->d_type);
+            if ((walk.batch.columns & (RecordBatch::kSize | RecordBatch::kMtime)) || entry->d_type == DT_UNKNOWN) {
+                if (::fstatat(dirFd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+                    walk.Error(errno, entry->d_name);
+                    continue;
+                }
+            }
+            if (walk.path.back() != '/') walk.path += '/';
+            walk.path += entry->d_name;
+            walk.Add(info.st_size, info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec);
+            if (S_ISDIR(info.st_mode)) {
+                int fd = ::openat(dirFd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (fd >= 0) {
+                    FindWalk(fd, walk);
+                } else {
+                    walk.Error(errno);
+                }
+            }
+            walk.path.resize(length);
+        }
+        ::closedir(stream);
+    }
+
+    /*
+     * du [directory] -- вывести место, занятое каждой директорией вместе с содержимым, в КиБ ("размер\tпуть"),
+     * начиная с самых глубоких, как `du`. Файл с несколькими жесткими ссылками учитывается один раз.
+     */
+    int du(const Args& args, RecordSink& next, CommandError& error) {
+        TreeWalk walk(next, args.get_allocator().resource());
+        walk.batch.format = RecordBatch::Usage;
+        walk.batch.columns = RecordBatch::kName | RecordBatch::kSize;
+        struct stat info;
+        const int fd = OpenWalkRoot(args, walk, info, error);
+        if (fd < 0) return 1;
+        DuWalk(fd, info, walk);
+        walk.Send();
+        return walk.code ? Fail(error, walk.code, walk.errorPath, "du") : 0;
+    }
+
+    /*
+     * Занятое директорией `dirFd` место в 512-байтных блоках; запись о директории выдается после ее содержимого.
+     */
+    static uint64_t DuWalk(int dirFd, const struct stat& self, TreeWalk& walk) {
+        uint64_t blocks = self.st_blocks;
+        DIR* stream = ::fdopendir(dirFd);
+        if (!stream) {
+            walk.Error(errno);
+            ::close(dirFd);
+            return blocks;
+        }
+        const size_t length = walk.path.size();
+        while (!walk.stopped) {
+            errno = 0;
+            const struct dirent* entry = ::readdir(stream);
+            if (!entry) {
+                if (errno) walk.Error(errno);
+                break;
+            }
+            if (IsDotOrDotDot(entry->d_name)) continue;
+            struct stat info;
+            if (::fstatat(dirFd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+                walk.Error(errno, entry->d_name);
+                continue;
+            }
+            if (!S_ISDIR(info.st_mode)) {
+                if (info.st_nlink > 1 && !walk.linked.emplace(info.st_dev, info.st_ino).second) continue;
+                blocks += info.st_blocks;
+                continue;
+            }
+            if (walk.path.back() != '/') walk.path += '/';
+            walk.path += entry->d_name;
+            int fd = ::openat(dirFd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0) {
+                blocks += DuWalk(fd, info, walk);
+            } else {
+                walk.Error(errno);
+            }
+            walk.path.resize(length);
+        }
+        ::closedir(stream);
+        if (!walk.stopped) walk.Add((blocks + 1) / 2, 0);
+        return blocks;
+    }
+
+    /*
+     * Отображенный в память файл для команд, которые читают его целиком.
+     */
+    class MappedFile {
+    public:
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() {
+            if (size_ > 0) ::munmap(const_cast<char*>(data_), size_);
+        }
+
+        /*
+         * Отобразить файл `path`. При ошибке возвращает false и оставляет errno.
+         */
+        bool Open(const char* path) {
+            int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return false;
+            struct stat st;
+            if (::fstat(fd, &st) != 0) {
+                const int code = errno;
+                ::close(fd);
+                errno = code;
+                return false;
+            }
+            if (st.st_size > 0) {
+                void* mapping = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping == MAP_FAILED) {
+                    const int code = errno;
+                    ::close(fd);
+                    errno = code;
+                    return false;
+                }
+                ::madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+                data_ = static_cast<const char*>(mapping);
+                size_ = st.st_size;
+            }
+            ::close(fd);
+            return true;
+        }
+
+        const char* Data() const {
+            return data_;
+        }
+
+        size_t Size() const {
+            return size_;
+        }
+
+    private:
+        const char* data_ = nullptr;
+        size_t size_ = 0;
+    };
+
+    /*
+     * Разобрать ключи `-d <c>` и `-f <list>` (значение можно писать слитно: `-d,`) и единственный операнд-файл.
+     */
+    static bool ParseFieldOptions(const Args& args, char& delimiter, DelimitedText::FieldSet& fields, bool& haveFields,
+                                  std::string_view& file) {
+        haveFields = false;
+        for (size_t i = 1; i < args.size(); ++i) {
+            std::string_view arg = args[i];
+            if (arg.size() >= 2 && arg[0] == '-' && (arg[1] == 'd' || arg[1] == 'f')) {
+                std::string_view value = arg.substr(2);
+                if (value.empty()) {
+                    if (++i == args.size()) return false;
+                    value = args[i];
+                }
+                if (arg[1] == 'd') {
+                    if (value.size() != 1 || value[0] == '\n') return false;
+                    delimiter = value[0];
+                } else {
+                    if (!fields.Parse(value)) return false;
+                    haveFields = true;
+                }
+            } else if (file.empty()) {
+                file = arg;
+            } else {
+                return false;
+            }
+        }
+        return !file.empty();
+    }
+
+    /*
+     * cut [-d <c>] -f <list> <file> -- вывести выбранные поля каждой строки через тот же разделитель
+     * (по умолчанию -- табуляция). Строки без разделителя выводятся целиком, как в `cut`.
+     * Файл отображается в память и разбирается кусками по границам строк на нескольких потоках;
+     * вывод кусков отдается по порядку.
+     */
+    int cut(const Args& args, OutputSink& out, CommandError& error) {
+        char delimiter = '\t';
+        DelimitedText::FieldSet fields;
+        bool haveFields = false;
+        std::string_view file;
+        if (!ParseFieldOptions(args, delimiter, fields, haveFields, file) || !haveFields) {
+            return Fail(error, 0, "", "cut: usage: cut [-d <c>] -f <list> <file>");
+        }
+        std::pmr::string path(args.get_allocator());
+        JoinPath(cwd.native(), file, path);
+        MappedFile input;
+        if (!input.Open(path.c_str())) return Fail(error, errno, std::string(path), "cannot open file");
+
+        const bool takesFirst = fields.Contains(1);
+        struct Visitor {
+            DelimitedText::FieldSet::Cursor cursor;
+            bool takesFirst;
+            char delimiter;
+            std::string& out;
+            bool first = true;
+
+            void Field(size_t index, const char* begin, const char* end) {
+                if (cursor.Position(index) == SIZE_MAX) return;
+                if (!first) out += delimiter;
+                out.append(begin, end - begin);
+                first = false;
+            }
+
+            void Line(const char* begin, const char* end, size_t count) {
+                if (count == 1 && !takesFirst) out.append(begin, end - begin);
+                out += '\n';
+                first = true;
+                cursor.Reset();
+            }
+        };
+        const auto chunks = DelimitedText::Split(input.Data(), input.Size());
+        const size_t threads = DelimitedText::Threads(chunks.size());
+        std::vector<std::string> outputs(threads);
+        auto run = [&](size_t chunk, std::string& output) {
+            output.clear();
+            Visitor visitor{DelimitedText::FieldSet::Cursor(fields), takesFirst, delimiter, output};
+            DelimitedText::Scan(input.Data() + chunks[chunk].first, chunks[chunk].second - chunks[chunk].first,
+                                delimiter, fields.Last(), visitor);
+        };
+        // Куски разбираются волнами по `threads`, и вывод волны отдается, пока буферы не понадобились следующей
+        for (size_t wave = 0; wave < chunks.size(); wave += threads) {
+            const size_t count = std::min(threads, chunks.size() - wave);
+            std::vector<std::thread> pool;
+            for (size_t i = 1; i < count; ++i) {
+                pool.emplace_back(run, wave + i, std::ref(outputs[i]));
+            }
+            run(wave, outputs[0]);
+            for (std::thread& thread : pool) {
+                thread.join();
+            }
+            for (size_t i = 0; i < count; ++i) {
+                out.AppendRef(outputs[i].data(), outputs[i].size());
+            }
+            if (!out.Flush()) return Fail(error, 0, std::string(path), "cannot write output");
+        }
+        return 0;
+    }
+
+    /*
+     * colstat [-d <c>] -f <list> <file> -- для каждого выбранного поля вывести строку
+     * "поле\tколичество\tсумма\tминимум\tмаксимум" по значениям, которые являются числами (остальные пропускаются).
+     * Список полей должен быть конечным. Куски файла разбираются параллельно, итоги потоков складываются.
+     */
+    int colstat(const Args& args, OutputSink& out, CommandError& error) {
+        char delimiter = '\t';
+        DelimitedText::FieldSet fields;
+        bool haveFields = false;
+        std::string_view file;
+        if (!ParseFieldOptions(args, delimiter, fields, haveFields, file) || !haveFields || fields.Last() == SIZE_MAX) {
+            return Fail(error, 0, "", "colstat: usage: colstat [-d <c>] -f <list> <file>");
+        }
+        if (fields.Count() > kMaxStatColumns) return Fail(error, 0, "", "colstat: too many fields");
+        std::pmr::string path(args.get_allocator());
+        JoinPath(cwd.native(), file, path);
+        MappedFile input;
+        if (!input.Open(path.c_str())) return Fail(error, errno, std::string(path), "cannot open file");
+
+        const size_t last = fields.Last();
+        struct Visitor {
+            DelimitedText::FieldSet::Cursor cursor;
+            std::vector<DelimitedText::ColumnStats> stats;  // по позиции поля среди выбранных
+
+            void Field(size_t index, const char* begin, const char* end) {
+                const size_t position = cursor.Position(index);
+                if (position != SIZE_MAX) stats[position].Add(begin, end);
+            }
+
+            void Line(const char*, const char*, size_t) {
+                cursor.Reset();
+            }
+        };
+        const auto chunks = DelimitedText::Split(input.Data(), input.Size());
+        const size_t threads = DelimitedText::Threads(chunks.size());
+        std::vector<Visitor> visitors(threads, Visitor{DelimitedText::FieldSet::Cursor(fields),
+                                                       std::vector<DelimitedText::ColumnStats>(fields.Count())});
+        std::atomic<size_t> next{0};
+        auto worker = [&](Visitor& visitor) {
+            for (size_t chunk; (chunk = next++) < chunks.size();) {
+                DelimitedText::Scan(input.Data() + chunks[chunk].first, chunks[chunk].second - chunks[chunk].first,
+                                    delimiter, last, visitor);
+            }
+        };
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < threads; ++i) {
+            pool.emplace_back(worker, std::ref(visitors[i]));
+        }
+        worker(visitors[0]);
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+
+        char number[32];
+        auto print = [&](auto value, char separator) {
+            out.Append(number, std::to_chars(number, number + sizeof(number), value).ptr - number);
+            out.Append(separator);
+        };
+        for (const DelimitedText::FieldSet::Range& range : fields.Ranges()) {
+            for (size_t field = range.first; field <= range.last; ++field) {
+                DelimitedText::ColumnStats total;
+                for (const Visitor& visitor : visitors) {
+                    total.Merge(visitor.stats[range.before + (field - range.first)]);
+                }
+                print(field, '\t');
+                print(total.count, '\t');
+                if (total.count == 0) {
+                    out.Append("0\t-\t-\n");
+                    continue;
+                }
+                if (total.exact) {
+                    print(total.exactSum, '\t');
+                } else {
+                    print(total.sum, '\t');
+                }
+                print(total.min, '\t');
+                print(total.max, '\n');
+            }
+        }
+        return 0;
+    }
+
+    /*
+     * Смещение первого различающегося байта `a` и `b` (или `size`, если они совпадают). Блоки по 64 байта
+     * сравниваются SSE2 целиком, и только в блоке с различием ищется его точная позиция.
+     */
+    static size_t FirstDifference(const char* a, const char* b, size_t size) {
+        size_t pos = 0;
+#ifdef __SSE2__
+        auto load = [](const char* data) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)); };
+        for (; pos + 64 <= size; pos += 64) {
+            const __m128i equal = _mm_and_si128(
+                _mm_and_si128(_mm_cmpeq_epi8(load(a + pos), load(b + pos)), _mm_cmpeq_epi8(load(a + pos + 16), load(b + pos + 16))),
+                _mm_and_si128(_mm_cmpeq_epi8(load(a + pos + 32), load(b + pos + 32)), _mm_cmpeq_epi8(load(a + pos + 48), load(b + pos + 48))));
+            if (_mm_movemask_epi8(equal) != 0xffff) break;
+        }
+        for (; pos + 16 <= size; pos += 16) {
+            const unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(load(a + pos), load(b + pos))) ^ 0xffff;
+            if (mask) return pos + __builtin_ctz(mask);
+        }
+#endif
+        while (pos < size && a[pos] == b[pos]) ++pos;
+        return pos;
+    }
+
+    /*
+     * Число переводов строки в `data`.
+     */
+    static uint64_t CountNewlines(const char* data, size_t size) {
+        uint64_t count = 0;
+        size_t pos = 0;
+#ifdef __SSE2__
+        const __m128i newlines = _mm_set1_epi8('\n');
+        for (; pos + 16 <= size; pos += 16) {
+            const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+            count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newlines)));
+        }
+#endif
+        return count + std::count(data + pos, data + size, '\n');
+    }
+
+    static bool ReadFull(int fd, char* data, size_t size, off_t offset) {
+        while (size > 0) {
+            ssize_t got = ::pread(fd, data, size, offset);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) {
+                if (got == 0) errno = EIO;  // файл укоротился во время сравнения
+                return false;
+            }
+            data += got, size -= got, offset += got;
+        }
+        return true;
+    }
+
+    /*
+     * Чтение первых `size` байт файла кусками по `kCompareChunk` в собственном потоке с двойной буферизацией:
+     * пока владелец сравнивает один кусок, поток уже читает следующий во второй буфер. Поток живет все время
+     * чтения, а не создается на каждый кусок.
+     */
+    class ChunkReader {
+    public:
+        ChunkReader(int fd, size_t size) : fd_(fd), size_(size), thread_([this]() { Run(); }) {}
+
+        ChunkReader(const ChunkReader&) = delete;
+        ChunkReader& operator=(const ChunkReader&) = delete;
+
+        ~ChunkReader() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopped_ = true;
+            }
+            changed_.notify_all();
+            thread_.join();
+        }
+
+        /*
+         * Следующий кусок; пустой, если файл кончился или чтение не удалось (тогда `Error()` не ноль).
+         * Предыдущий кусок после вызова недействителен: его буфер отдается под чтение.
+         */
+        std::string_view Next() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            released_ = handed_;
+            changed_.notify_all();
+            changed_.wait(lock, [this]() { return filled_ > handed_ || finished_; });
+            if (filled_ == handed_) return {};
+            const size_t chunk = handed_++;
+            return std::string_view(buffers_[chunk % 2].get(), lengths_[chunk % 2]);
+        }
+
+        int Error() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return error_;
+        }
+
+    private:
+        void Run() {
+            for (size_t chunk = 0, offset = 0; offset < size_; ++chunk, offset += kCompareChunk) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    changed_.wait(lock, [&]() { return chunk < released_ + 2 || stopped_; });
+                    if (stopped_) break;
+                }
+                const size_t length = std::min(kCompareChunk, size_ - offset);
+                std::unique_ptr<char[]>& buffer = buffers_[chunk % 2];
+                if (!buffer) buffer = std::make_unique<char[]>(kCompareChunk);
+                const bool ok = ReadFull(fd_, buffer.get(), length, offset);
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!ok) {
+                    error_ = errno;
+                    break;
+                }
+                lengths_[chunk % 2] = length;
+                filled_ = chunk + 1;
+                changed_.notify_all();
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            finished_ = true;
+            changed_.notify_all();
+        }
+
+        const int fd_;
+        const size_t size_;
+        std::unique_ptr<char[]> buffers_[2];
+        size_t lengths_[2] = {0, 0};
+        mutable std::mutex mutex_;
+        std::condition_variable changed_;
+        size_t filled_ = 0;    // сколько кусков прочитано
+        size_t handed_ = 0;    // сколько кусков отдано владельцу
+        size_t released_ = 0;  // сколько кусков владелец уже разобрал (их буферы свободны)
+        bool finished_ = false, stopped_ = false;
+        int error_ = 0;
+        std::thread thread_;
+    };
+
+    /*
+     * cmp [-s] <a> <b> -- сравнить файлы побайтно и вывести первое различие ("a b differ: byte N, line L")
+     * или сообщение о том, что один файл -- начало другого. Код ответа 0, если файлы совпадают.
+     * Сначала сравниваются метаданные: один и тот же inode совпадает сам с собой, а с -s (без вывода) файлы
+     * разного размера сразу считаются разными. Файлы на одном устройстве отображаются в память, а с разных
+     * устройств читаются кусками параллельно, по потоку на файл (см. `ChunkReader`), чтобы оба диска работали
+     * одновременно.
+     */
+    int cmp(const Args& args, OutputSink& out, CommandError& error) {
+        const bool silent = args.size() == 4 && args[1] == "-s";
+        if (args.size() != 3 && !silent) return Fail(error, 0, "", "cmp: usage: cmp [-s] <a> <b>");
+        const std::string_view names[2] = {args[args.size() - 2], args[args.size() - 1]};
+        std::pmr::string paths[2] = {std::pmr::string(args.get_allocator()), std::pmr::string(args.get_allocator())};
+        struct stat st[2];
+        for (int i = 0; i < 2; ++i) {
+            JoinPath(cwd.native(), names[i], paths[i]);
+            if (::stat(paths[i].c_str(), &st[i]) != 0) return Fail(error, errno, std::string(paths[i]), "cannot open file");
+        }
+        if (st[0].st_dev == st[1].st_dev && st[0].st_ino == st[1].st_ino) return 0;
+        if (silent && st[0].st_size != st[1].st_size) return Fail(error, 0, "", "cmp: files differ");
+
+        const size_t common = std::min(st[0].st_size, st[1].st_size);
+        size_t difference = common;
+        uint64_t lines = 0;
+        char last = 0;  // последний байт общей части, если она совпала
+        if (st[0].st_dev == st[1].st_dev) {
+            MappedFile files[2];
+            for (int i = 0; i < 2; ++i) {
+                if (!files[i].Open(paths[i].c_str())) return Fail(error, errno, std::string(paths[i]), "cannot open file");
+            }
+            // Файл мог измениться между stat и mmap
+            const size_t size = std::min({common, files[0].Size(), files[1].Size()});
+            difference = FirstDifference(files[0].Data(), files[1].Data(), size);
+            if (difference == size && size < common) return Fail(error, EIO, std::string(paths[0]), "cannot read file");
+            if (!silent) lines = CountNewlines(files[0].Data(), difference);
+            if (difference > 0) last = files[0].Data()[difference - 1];
+        } else {
+            int fds[2];
+            for (int i = 0; i < 2; ++i) {
+                fds[i] = ::open(paths[i].c_str(), O_RDONLY | O_CLOEXEC);
+                if (fds[i] < 0) {
+                    const int code = errno;
+                    if (i > 0) ::close(fds[0]);
+                    return Fail(error, code, std::string(paths[i]), "cannot open file");
+                }
+                ::posix_fadvise(fds[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+            }
+            int failed = -1, code = 0;
+            {
+                ChunkReader first(fds[0], common), second(fds[1], common);
+                for (size_t offset = 0; offset < common;) {
+                    const std::string_view chunks[2] = {first.Next(), second.Next()};
+                    if (chunks[0].empty() || chunks[1].empty()) {
+                        failed = chunks[0].empty() ? 0 : 1;
+                        code = (failed == 0 ? first : second).Error();
+                        break;
+                    }
+                    const size_t size = chunks[0].size();
+                    const size_t found = FirstDifference(chunks[0].data(), chunks[1].data(), size);
+                    if (!silent) lines += CountNewlines(chunks[0].data(), found);
+                    if (found < size) {
+                        difference = offset + found;
+                        break;
+                    }
+                    last = chunks[0][size - 1];
+                    offset += size;
+                }
+            }
+            ::close(fds[0]);
+            ::close(fds[1]);
+            if (failed >= 0) return Fail(error, code, std::string(paths[failed]), "cannot read file");
+        }
+
+        if (difference == common && st[0].st_size == st[1].st_size) return 0;
+        if (silent) return Fail(error, 0, "", "cmp: files differ");
+        char number[24];
+        auto print = [&](uint64_t value) {
+            out.Append(number, std::to_chars(number, number + sizeof(number), value).ptr - number);
+        };
+        if (difference < common) {
+            out.Append(names[0]);
+            out.Append(' ');
+            out.Append(names[1]);
+            out.Append(" differ: byte ");
+            print(difference + 1);
+            out.Append(", line ");
+            print(lines + 1);
+        } else {
+            // Один файл -- начало другого; последняя строка короткого файла может быть неполной
+            out.Append("cmp: EOF on ");
+            out.Append(names[st[0].st_size < st[1].st_size ? 0 : 1]);
+            if (common == 0) {
+                out.Append(" which is empty");
+            } else {
+                out.Append(" after byte ");
+                print(common);
+                out.Append(last == '\n' ? ", line " : ", in line ");
+                print(last == '\n' ? lines : lines + 1);
+            }
+        }
+        out.Append('\n');
+        return Fail(error, 0, "", "cmp: files differ");
+    }
+
+    /*
+     * Открытая директория, в которой лежат операнды команды. Пока операнды лежат в одной директории
+     * (как у `mkdir d{1..100000}`), она открывается один раз, а сами операции делаются через *at-вызовы.
+     */
+    class ParentDir {
+    public:
+        ParentDir(const std::string& cwd, std::pmr::memory_resource* resource)
+            : cwd_(cwd), dir_(resource), path_(resource) {}
+
+        ParentDir(const ParentDir&) = delete;
+        ParentDir& operator=(const ParentDir&) = delete;
+
+        ~ParentDir() {
+            if (fd_ >= 0) ::close(fd_);
+        }
+
+        /*
+         * Вернуть дескриптор директории, в которой лежит `operand` (путь относительно cwd), и имя `operand` в ней.
+         * Имя -- хвост `operand`, поэтому оно заканчивается нулевым символом, если им заканчивается `operand`.
+         * При ошибке возвращает -1 и оставляет errno.
+         */
+        int Open(std::string_view operand, std::string_view& name) {
+            size_t slash = operand.find_last_of('/', operand.size() > 1 ? operand.size() - 2 : 0);
+            std::string_view dir;
+            if (slash != std::string_view::npos && operand.size() > 1) {
+                dir = operand.substr(0, slash == 0 ? 1 : slash);
+                name = operand.substr(slash + 1);
+            } else {
+                name = operand;
+            }
+            if (fd_ >= 0 && dir == dir_) return fd_;
+            if (fd_ >= 0) ::close(fd_);
+            dir_.assign(dir.data(), dir.size());
+            JoinPath(cwd_, dir, path_);
+            fd_ = ::open(path_.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+            return fd_;
+        }
+
+    private:
+        const std::string& cwd_;
+        std::pmr::string dir_;
+        std::pmr::string path_;
+        int fd_ = -1;
+    };
+
+    int mkdir(const Args& args, CommandError& error) {
+        const bool parents = std::find(args.begin() + 1, args.end(), "-p") != args.end();
+        ParentDir parent(cwd.native(), args.get_allocator().resource());
+        std::pmr::string path(args.get_allocator());
+        size_t operands = 0;
+        int result = 0;
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "-p") continue;
+            ++operands;
+            if (parents) {
+                if (!MakeParents(args[i], path)) result = Fail(error, errno, std::string(path), "cannot create directory");
+                continue;
+            }
+            std::string_view name;
+            int dirFd = parent.Open(args[i], name);
+            if (dirFd < 0 || ::mkdirat(dirFd, name.data(), 0777) != 0) {
+                JoinPath(cwd.native(), args[i], path);
+                result = Fail(error, errno, std::string(path), "cannot create directory");
+            }
+        }
+        if (operands == 0) return Fail(error, 0, "", "mkdir: missing operand");
+        return result;
+    }
+
+    /*
+     * `mkdir -p`: создать директорию вместе со всеми недостающими родителями.
+     * Обычно родитель уже существует, и хватает одного вызова mkdir. Иначе путь проходится один раз по компонентам
+     * через mkdirat/openat относительно дескриптора предыдущей директории. В `path` остается полный путь.
+     */
+    bool MakeParents(std::string_view operand, std::pmr::string& path) {
+        JoinPath(cwd.native(), operand, path);
+        struct stat st;
+        if (::mkdir(path.c_str(), 0777) == 0) return true;
+        if (errno == EEXIST) {
+            if (::stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) return true;
+            errno = EEXIST;
+            return false;
+        }
+        if (errno != ENOENT) return false;
+
+        int dirFd = ::open(operand[0] == '/' ? "/" : cwd.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        std::pmr::string component(path.get_allocator());
+        size_t pos = 0;
+        while (dirFd >= 0 && pos < operand.size()) {
+            size_t end = operand.find('/', pos);
+            if (end == std::string_view::npos) end = operand.size();
+            component.assign(operand.data() + pos, end - pos);
+            pos = end + 1;
+            if (component.empty()) continue;
+            int next = -1;
+            if (::mkdirat(dirFd, component.c_str(), 0777) == 0 || errno == EEXIST) {
+                next = ::openat(dirFd, component.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+            }
+            int code = errno;
+            ::close(dirFd);
+            dirFd = next;
+            errno = code;
+        }
+        if (dirFd < 0) return false;
+        ::close(dirFd);
+        return true;
+    }
+
+    /*
+     * touch <file>... -- создать пустые файлы или обновить время модификации существующих.
+     */
+    int touch(const Args& args, CommandError& error) {
+        if (args.size() < 2) return Fail(error, 0, "", "touch: missing file operand");
+        ParentDir parent(cwd.native(), args.get_allocator().resource());
+        int result = 0;
+        for (size_t i = 1; i < args.size(); ++i) {
+            std::string_view name;
+            int dirFd = parent.Open(args[i], name);
+            if (dirFd >= 0) {
+                int fd = ::openat(dirFd, name.data(), O_WRONLY | O_CREAT | O_EXCL | O_NOCTTY | O_CLOEXEC, 0666);
+                if (fd >= 0) {
+                    ::close(fd);
+                    continue;
+                }
+                if (errno == EEXIST && ::utimensat(dirFd, name.data(), nullptr, 0) == 0) continue;
+            }
+            result = Fail(error, errno, ResolvePath(args[i]), "cannot touch");
+        }
+        return result;
+    }
+
+    int rmdir(const Args& args, CommandError& error) {
+        if (args.size() < 2) return Fail(error, 0, "", "rmdir: missing operand");
+        int result = 0;
+        for (size_t i = 1; i < args.size(); ++i) {
+            const fs::path path = cwd / args[i];
+            std::error_code ec;
+            std::uintmax_t removed = throttle_.Active() ? RemoveThrottled(path, ec) : std::filesystem::remove_all(path, ec);
+            if (ec) {
+                result = Fail(error, ec.value(), path.string(), "cannot remove");
+            } else if (removed == 0) {
+                result = Fail(error, ENOENT, path.string(), "cannot remove");
+            }
+        }
+        return result;
+    }
+
+    /*
+     * То же, что std::filesystem::remove_all, но каждое удаление списывается с бюджета ввода-вывода.
+     */
+    std::uintmax_t RemoveThrottled(const fs::path& path, std::error_code& ec) {
+        const fs::file_status status = fs::symlink_status(path, ec);
+        if (ec) {
+            if (ec == std::errc::no_such_file_or_directory) ec.clear();
+            return 0;
+        }
+        std::uintmax_t removed = 0;
+        if (fs::is_directory(status)) {
+            for (fs::directory_iterator it(path, ec), end; !ec && it != end; it.increment(ec)) {
+                removed += RemoveThrottled(it->path(), ec);
+            }
+            if (ec) return removed;
+        }
+        throttle_.Charge(0);
+        return fs::remove(path, ec) ? removed + 1 : removed;
+    }
+
+    int rm(const Args& args, CommandError& error) {
+        if (args.size() < 2) return Fail(error, 0, "", "rm: missing operand");
+        ParentDir parent(cwd.native(), args.get_allocator().resource());
+        int result = 0;
+        for (size_t i = 1; i < args.size(); ++i) {
+            // Как и std::filesystem::remove, удаляет файл или пустую директорию
+            std::string_view name;
+            int dirFd = parent.Open(args[i], name);
+            throttle_.Charge(0);
+            if (dirFd >= 0 && (::unlinkat(dirFd, name.data(), 0) == 0 ||
+                               (errno == EISDIR && ::unlinkat(dirFd, name.data(), AT_REMOVEDIR) == 0))) {
+                continue;
+            }
+            result = Fail(error, errno, ResolvePath(args[i]), "cannot remove");
+        }
+        return result;
+    }
+
+    int cd(const Args& args, CommandError& error) {
+        if (args.size() < 2) return Fail(error, 0, "", "cd: missing operand");
+        fs::path currentPath = cwd/args[1];
+        struct stat st;
+        if (::stat(currentPath.c_str(), &st) != 0) return Fail(error, errno, currentPath.string(), "cannot change directory");
+        if (!S_ISDIR(st.st_mode)) return Fail(error, ENOTDIR, currentPath.string(), "cannot change directory");
+        cwd = currentPath;
+        return 0;
+    }
+
+    /*
+     * watch [-t <ms>] ls [directory] -- вывести содержимое директории, а затем выводить только изменения:
+     * "+ <name>" для появившихся и "- <name>" для исчезнувших записей.
+     * Изменения приходят от inotify; события, пришедшие в пределах `kWatchCoalesceWindow`, объединяются, так что
+     * файл, который успел появиться и исчезнуть, не выводится вовсе; при непрерывном потоке событий пачка все равно
+     * выводится не реже раза в `kWatchMaxCoalesceDelay`. При переполнении очереди inotify директория
+     * перечитывается целиком и сравнивается с известным содержимым.
+     * Команда работает до вызова `StopWatch`, удаления директории или истечения `-t` миллисекунд.
+     */
+    int watch(const Args& args, OutputSink& out, CommandError& error) {
+        size_t pos = 1;
+        long long timeoutMs = -1;
+        if (pos + 1 < args.size() && args[pos] == "-t") {
+            if (!ParseInteger(args[pos + 1], timeoutMs) || timeoutMs < 0) return Fail(error, 0, "", "watch: bad timeout");
+            pos += 2;
+        }
+        if (pos >= args.size() || args[pos] != "ls" || args.size() > pos + 2) {
+            return Fail(error, 0, "", "watch: usage: watch [-t <ms>] ls [directory]");
+        }
+        const std::string dir = pos + 1 < args.size() ? std::string(args[pos + 1]) : cwd.string();
+
+        {
+            std::lock_guard<std::mutex> lock(watchMutex_);
+            if (watchStopFd_ < 0) watchStopFd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (watchStopFd_ < 0) return Fail(error, errno, "", "watch: cannot create eventfd");
+            uint64_t drained;
+            (void)!::read(watchStopFd_, &drained, sizeof(drained));
+        }
+        int inotifyFd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd < 0) return Fail(error, errno, dir, "watch: cannot init inotify");
+        // Наблюдение ставится до первого чтения директории, чтобы не потерять изменения между ними
+        if (::inotify_add_watch(inotifyFd, dir.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                                        IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR) < 0) {
+            int code = errno;
+            ::close(inotifyFd);
+            return Fail(error, code, dir, "watch: cannot watch directory");
+        }
+
+        std::unordered_set<std::string> known;
+        if (!ScanDirectory(dir, known)) {
+            int code = errno;
+            ::close(inotifyFd);
+            return Fail(error, code, dir, "cannot read directory");
+        }
+        std::vector<std::string_view> listing(known.begin(), known.end());
+        std::sort(listing.begin(), listing.end());
+        for (std::string_view name : listing) {
+            out.Append(name);
+            out.Append('\n');
+        }
+        out.Flush();
+        out.Sync();
+
+        using Clock = std::chrono::steady_clock;
+        const auto untilMs = [](Clock::duration left) {
+            return std::max<long long>(0, std::chrono::ceil<std::chrono::milliseconds>(left).count());
+        };
+        const auto deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+        auto batchStart = Clock::now();
+        std::unordered_map<std::string, bool> pending;  // имя -> существует ли запись после последнего события
+        std::vector<std::string> changed;
+        alignas(struct inotify_event) char buffer[64 * 1024];
+        bool overflow = false, gone = false, stopped = false;
+        while (!gone && !stopped) {
+            const auto now = Clock::now();
+            const bool batching = !pending.empty() || overflow;
+            if (!batching && timeoutMs >= 0 && now >= deadline) break;
+            long long waitMs = -1;
+            if (batching) {
+                // Ждем затишья, но пачку не держим дольше `kWatchMaxCoalesceDelay` и не дольше срока `-t`
+                waitMs = std::min<long long>(kWatchCoalesceWindow.count(), untilMs(batchStart + kWatchMaxCoalesceDelay - now));
+                if (timeoutMs >= 0) waitMs = std::min(waitMs, untilMs(deadline - now));
+            } else if (timeoutMs >= 0) {
+                waitMs = untilMs(deadline - now);
+            }
+            struct pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {watchStopFd_, POLLIN, 0}};
+            int ready = ::poll(fds, 2, static_cast<int>(std::min<long long>(waitMs, INT_MAX)));
+            if (ready < 0 && errno != EINTR) break;
+            stopped = fds[1].revents & POLLIN;
+
+            if (ready > 0 && (fds[0].revents & POLLIN)) {
+                if (!batching) batchStart = Clock::now();
+                ssize_t size;
+                while ((size = ::read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+                    for (char* ptr = buffer; ptr < buffer + size;) {
+                        auto* event = reinterpret_cast<struct inotify_event*>(ptr);
+                        ptr += sizeof(struct inotify_event) + event->len;
+                        if (event->mask & IN_Q_OVERFLOW) {
+                            overflow = true;
+                        } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                            gone = true;
+                        } else if (event->len > 0) {
+                            pending[event->name] = (event->mask & (IN_CREATE | IN_MOVED_TO)) != 0;
+                        }
+                    }
+                }
+                // Пачка событий еще не закончилась: подождем, пока наступит затишье, если она держится недолго
+                const auto after = Clock::now();
+                const bool held = after - batchStart >= kWatchMaxCoalesceDelay;
+                const bool late = timeoutMs >= 0 && after >= deadline;
+                if (!gone && !stopped && !held && !late) continue;
+            }
+
+            changed.clear();
+            if (overflow) {
+                std::unordered_set<std::string> current;
+                if (ScanDirectory(dir, current)) {
+                    for (const std::string& name : known) {
+                        if (!current.count(name)) out.Append("- "), out.Append(name), out.Append('\n');
+                    }
+                    for (const std::string& name : current) {
+                        if (!known.count(name)) out.Append("+ "), out.Append(name), out.Append('\n');
+                    }
+                    known.swap(current);
+                }
+                overflow = false;
+            } else {
+                for (auto& [name, present] : pending) {
+                    if (present && known.insert(name).second) {
+                        out.Append("+ "), out.Append(name), out.Append('\n');
+                    } else if (!present && known.erase(name)) {
+                        out.Append("- "), out.Append(name), out.Append('\n');
+                    }
+                }
+            }
+            pending.clear();
+            out.Flush();
+            out.Sync();
+        }
+        ::close(inotifyFd);
+        return 0;
+    }
+
+    /*
+     * Запустить внешнюю программу (любую команду, которая не является встроенной) в текущей директории Shell.
+     * Программа ищется по PATH (см. `FindProgram`) и запускается через posix_spawn, который в glibc не копирует
+     * адресное пространство процесса. Ее stdout по мере поступления передается через pipe в вывод команды (или в
+     * файл при перенаправлении), stdin -- /dev/null, stderr общий с процессом.
+     * Ненулевой код завершения программы превращается в код ответа 1.
      */
-    int ExecuteCommand(const std::string& command, std::ostream& out) {
-        out << "$ " << command << '\n';
+    int external(const Args& args, OutputSink& out, CommandError& error) {
+        std::string program;
+        if (!FindProgram(args[0], program)) return Fail(error, 0, std::string(args[0]), "unknown command");
 
-        std::istringstream iss(command);
-        std::vector<std::string> args;
-        std::string arg;
-        while (iss >> arg) {
-            args.push_back(arg);
+        std::pmr::vector<char*> argv(args.get_allocator());
+        for (const std::pmr::string& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
         }
-        
-        if (args.empty()) return 1;
+        argv.push_back(nullptr);
+        int pipeFds[2];
+        if (::pipe2(pipeFds, O_CLOEXEC) != 0) return Fail(error, errno, program, "cannot create pipe");
 
-        std::string cmd = args[0];
-        std::string output_file;
-        bool append = false, written = false;
+        posix_spawn_file_actions_t actions;
+        ::posix_spawn_file_actions_init(&actions);
+        ::posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        ::posix_spawn_file_actions_adddup2(&actions, pipeFds[1], STDOUT_FILENO);
+        ::posix_spawn_file_actions_addchdir_np(&actions, cwd.c_str());
+        // Программа не должна унаследовать игнорирование SIGPIPE или маску сигналов процесса
+        posix_spawnattr_t attributes;
+        ::posix_spawnattr_init(&attributes);
+        sigset_t signals;
+        sigemptyset(&signals);
+        ::posix_spawnattr_setsigmask(&attributes, &signals);
+        sigaddset(&signals, SIGPIPE);
+        ::posix_spawnattr_setsigdefault(&attributes, &signals);
+        ::posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+        pid_t pid;
+        const int spawned = ::posix_spawn(&pid, program.c_str(), &actions, &attributes, argv.data(), environ);
+        ::posix_spawn_file_actions_destroy(&actions);
+        ::posix_spawnattr_destroy(&attributes);
+        ::close(pipeFds[1]);
+        if (spawned != 0) {
+            ::close(pipeFds[0]);
+            ForgetProgram(args[0]);
+            return Fail(error, spawned, program, "cannot run command");
+        }
 
-        for (size_t i = 0; i < args.size(); ++i) {
-            if (args[i] == ">" || args[i] == ">>") {
-                if (i + 1 < args.size()) {
-                    output_file = args[i + 1];
-                    append = (args[i] == ">>");
-                    args.resize(i);
-                    break;
-                } else {
-                    return 1;
-                }
+        int result = 0;
+        char* chunk = static_cast<char*>(args.get_allocator().resource()->allocate(kCatChunkSize));
+        while (true) {
+            ssize_t size = ::read(pipeFds[0], chunk, kCatChunkSize);
+            if (size < 0 && errno == EINTR) continue;
+            if (size <= 0) break;
+            out.AppendRef(chunk, static_cast<size_t>(size));
+            if (!out.Flush()) {
+                // Закрытие pipe завершит программу по SIGPIPE, если она продолжит писать
+                result = Fail(error, 0, program, "cannot write output");
+                break;
             }
         }
+        ::close(pipeFds[0]);
+        args.get_allocator().resource()->deallocate(chunk, kCatChunkSize);
 
-        std::ostringstream temp_out;
-
-        int result = 1;
-        
-        if (cmd == "ls") {
-            result = ls(args, output_file.empty() ? out : temp_out);
-        } else if (cmd == "cat") {
-            result = cat(args, out, output_file, append);
-            written = true;
-        } else if (cmd == "mkdir") {
-            result = mkdir(args);
-        } else if (cmd == "rmdir") {
-            result = rmdir(args);
-        } else if (cmd == "rm") {
-            result = rm(args);
-        } else if (cmd == "cd") {
-            result = cd(args);
-        } else if (cmd == "echo") {
-            result = echo(args, output_file.empty() ? out : temp_out);
+        int status;
+        while (::waitpid(pid, &status, 0) < 0) {
+            if (errno != EINTR) return Fail(error, errno, program, "cannot wait for command");
         }
-        if (!output_file.empty() && !written) {
-            std::ofstream file(cwd / output_file, append ? std::ios::app : std::ios::trunc);
-            if (!file.is_open()) return 1;
-            file << temp_out.str();
+        if (result == 0 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            result = Fail(error, 0, program, WIFEXITED(status) ? "command exited with status" : "command killed by signal");
+            error.message += ' ' + std::to_string(WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
         }
-    
         return result;
     }
 
-private:
-    fs::path cwd;
+    /*
+     * Найти исполняемый файл команды `name`. Имена со '/' берутся как путь относительно текущей директории,
+     * остальные ищутся в директориях PATH. Найденные пути кэшируются, так что повторный запуск той же команды
+     * не обходит директории; кэш сбрасывается, когда меняется значение PATH. Пустые и относительные элементы PATH
+     * отсчитываются от текущей директории Shell, и найденное после них не кэшируется.
+     */
+    bool FindProgram(std::string_view name, std::string& program) {
+        if (name.find('/') != std::string_view::npos) {
+            program = ResolvePath(name);
+            return true;
+        }
+        const char* path = std::getenv("PATH");
+        const std::string_view directories = path ? path : "/usr/local/bin:/usr/bin:/bin";
+
+        std::lock_guard<std::mutex> lock(programsMutex_);
+        if (directories != programsPath_) {
+            programs_.clear();
+            programsPath_ = directories;
+        }
+        auto it = programs_.find(std::string(name));
+        if (it != programs_.end()) {
+            ++stats_.programCacheHits;
+            program = it->second;
+            return true;
+        }
+        ++stats_.programLookups;
+        bool dependsOnCwd = false;  // встретился элемент PATH, который зависит от текущей директории Shell
+        for (size_t pos = 0; pos <= directories.size();) {
+            size_t end = std::min(directories.find(':', pos), directories.size());
+            std::string_view directory = directories.substr(pos, end - pos);
+            pos = end + 1;
+            // Пустой элемент PATH означает текущую директорию, относительный -- путь от нее
+            if (directory.empty() || directory[0] != '/') {
+                dependsOnCwd = true;
+                JoinPath(ResolvePath(directory), name, program);
+            } else {
+                JoinPath(directory, name, program);
+            }
+            struct stat st;
+            if (::stat(program.c_str(), &st) == 0 && S_ISREG(st.st_mode) && ::access(program.c_str(), X_OK) == 0) {
+                // После смены директории тот же поиск может дать другой результат, поэтому такой не кэшируется
+                if (!dependsOnCwd) programs_.emplace(name, program);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+     * Забыть закэшированный путь команды (например, если файл по нему больше не запускается).
+     */
+    void ForgetProgram(std::string_view name) {
+        std::lock_guard<std::mutex> lock(programsMutex_);
+        programs_.erase(std::string(name));
+    }
 
-    int ls(const std::vector<std::string>& args, std::ostream& out ) {
-        std::filesystem::path dir = (args.size() > 1) ? fs::path(args[1]) : cwd;
-        if (!std::filesystem::exists(dir)) return 1;
-        
-        for (const auto& entry : std::filesystem::directory_iterator(dir)) {
-            out << entry.path().filename().string() << "\n";
+    /*
+     * archive create <file> <directory> -- упаковать содержимое директории в архив tar (ustar).
+     * archive extract <file> <directory> -- распаковать архив в директорию (она создается при необходимости).
+     */
+    int archive(const Args& args, CommandError& error) {
+        const bool create = args.size() == 4 && args[1] == "create";
+        if (!create && !(args.size() == 4 && args[1] == "extract")) {
+            return Fail(error, 0, "", "archive: usage: archive create|extract <file> <directory>");
         }
+        const std::string file = ResolvePath(args[2]);
+        const std::string dir = ResolvePath(args[3]);
+        std::string errorPath;
+        int code = create ? TarArchive::Create(file, dir, [this](bool group, uint32_t id) { return OwnerName(group, id); },
+                                               errorPath)
+                          : TarArchive::Extract(file, dir, errorPath);
+        if (code) return Fail(error, code, errorPath, create ? "archive: cannot create" : "archive: cannot extract");
         return 0;
     }
 
-    int cat(const std::vector<std::string>& args, std::ostream& out, const std::string& output_file, bool append) {
-        if (args.size() < 2) return 1;
-        std::ifstream from(cwd/args[1]);
-        if (!from.is_open()) return 1;
-        if (!output_file.empty()) {
-            std::ofstream to(cwd/output_file, append ? std::ios::app : std::ios::trunc);
-            to << from.rdbuf();
+    /*
+     * sync <src> <dst> [--delete] -- сделать содержимое <dst> таким же, как у <src>, копируя только изменившиеся
+     * файлы (см. `TreeSync`). С `--delete` записи <dst>, которых нет в <src>, удаляются.
+     */
+    int sync(const Args& args, CommandError& error) {
+        bool deleteExtraneous = false;
+        std::vector<std::string> operands;
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "--delete") {
+                deleteExtraneous = true;
+            } else {
+                operands.push_back(ResolvePath(args[i]));
+            }
         }
-        else {
-            out << from.rdbuf();
+        if (operands.size() != 2) return Fail(error, 0, "", "sync: usage: sync <src> <dst> [--delete]");
+        TreeSync::Result result;
+        std::string errorPath;
+        int code = TreeSync::Run(operands[0], operands[1], deleteExtraneous, throttle_, result, errorPath);
+        {
+            std::lock_guard<std::mutex> lock(ioMutex_);
+            stats_.syncCopied += result.copied;
+            stats_.syncUpdated += result.updated;
+            stats_.syncDeleted += result.deleted;
+            stats_.syncBytesWritten += result.written;
+        }
+        if (code) return Fail(error, code, errorPath, "sync: cannot synchronize");
+        return 0;
+    }
+
+    /*
+     * dedupe [--link|--reflink|--report] <dir> -- найти одинаковые файлы под <dir> (см. `Deduplicator`).
+     * --report (по умолчанию) -- вывести группы одинаковых файлов по пути в строке, с пустой строкой между группами;
+     * --link -- заменить копии жесткими ссылками на первый файл группы; --reflink -- сделать копии reflink-копиями
+     * первого файла (FICLONE), сохранив их inode, права и mtime.
+     */
+    int dedupe(const Args& args, OutputSink& out, CommandError& error) {
+        Deduplicator::Mode mode = Deduplicator::Mode::Report;
+        std::string_view operand;
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "--link") {
+                mode = Deduplicator::Mode::Link;
+            } else if (args[i] == "--reflink") {
+                mode = Deduplicator::Mode::Reflink;
+            } else if (args[i] == "--report") {
+                mode = Deduplicator::Mode::Report;
+            } else if (operand.empty()) {
+                operand = args[i];
+            } else {
+                operand = {};
+                break;
+            }
+        }
+        if (operand.empty()) return Fail(error, 0, "", "dedupe: usage: dedupe [--link|--reflink|--report] <dir>");
+        Deduplicator::Result result;
+        std::vector<Deduplicator::Group> groups;
+        std::string errorPath;
+        int code = Deduplicator::Run(ResolvePath(operand), mode, result, groups, errorPath);
+        {
+            std::lock_guard<std::mutex> lock(ioMutex_);
+            stats_.dedupeDuplicates += result.duplicates;
+            stats_.dedupeFullyRead += result.fullyRead;
+            stats_.dedupeBytesRead += result.bytesRead;
+            stats_.dedupeReclaimed += result.reclaimed;
+        }
+        if (mode == Deduplicator::Mode::Report) {
+            for (size_t i = 0; i < groups.size(); ++i) {
+                if (i > 0) out.Append('\n');
+                for (const std::string& path : groups[i].paths) {
+                    out.Append(operand);
+                    if (operand.back() != '/') out.Append('/');
+                    out.Append(path);
+                    out.Append('\n');
+                }
+            }
+        }
+        if (code) return Fail(error, code, errorPath, "dedupe: cannot process file");
+        return 0;
+    }
+
+    /*
+     * count [-k N] [-m MiB] <file> -- вывести различные строки файла с числом их повторений ("количество\tстрока"),
+     * начиная с самых частых (см. `LineCounter`). -k -- только N самых частых строк, -m -- предел памяти
+     * хэш-таблиц, при превышении которого они сбрасываются на диск.
+     */
+    int count(const Args& args, OutputSink& out, CommandError& error) {
+        size_t top = 0, memoryLimit = 0;
+        std::string_view file;
+        bool valid = true;
+        for (size_t i = 1; i < args.size() && valid; ++i) {
+            if (args[i] == "-k" || args[i] == "-m") {
+                size_t& value = args[i] == "-k" ? top : memoryLimit;
+                if (++i == args.size()) {
+                    valid = false;
+                    break;
+                }
+                const std::string_view number = args[i];
+                const auto [end, ec] = std::from_chars(number.data(), number.data() + number.size(), value);
+                valid = ec == std::errc() && end == number.data() + number.size() && value > 0;
+            } else if (file.empty()) {
+                file = args[i];
+            } else {
+                valid = false;
+            }
+        }
+        if (!valid || file.empty()) return Fail(error, 0, "", "count: usage: count [-k N] [-m MiB] <file>");
+        std::pmr::string path(args.get_allocator());
+        JoinPath(cwd.native(), file, path);
+        MappedFile input;
+        if (!input.Open(path.c_str())) return Fail(error, errno, std::string(path), "cannot open file");
+        size_t spills = 0;
+        const int code = LineCounter::Run(input.Data(), input.Size(), top, memoryLimit << 20, out, spills);
+        {
+            std::lock_guard<std::mutex> lock(ioMutex_);
+            stats_.countSpills += spills;
+        }
+        if (code) return Fail(error, code, std::string(path), "count: cannot count lines");
+        return 0;
+    }
+
+    /*
+     * compress <file> [<archive>] -- сжать файл во встроенном формате (см. `BlockCodec`); по умолчанию результат
+     * пишется в <file>.shz, исходный файл остается.
+     * decompress <archive> [<file>] -- распаковать; по умолчанию -- в имя архива без суффикса .shz.
+     * Результат пишется во временный файл рядом и переименовывается в конце, так что при ошибке цель не портится.
+     */
+    int compress(const Args& args, CommandError& error) {
+        const bool pack = args[0] == "compress";
+        if (args.size() != 2 && args.size() != 3) {
+            return Fail(error, 0, "", pack ? "compress: usage: compress <file> [<archive>]"
+                                           : "decompress: usage: decompress <archive> [<file>]");
+        }
+        const std::string source = ResolvePath(args[1]);
+        std::string target;
+        if (args.size() == 3) {
+            target = ResolvePath(args[2]);
+        } else if (pack) {
+            target = source + std::string(kCompressedSuffix);
+        } else if (source.size() > kCompressedSuffix.size() && source.compare(source.size() - kCompressedSuffix.size(),
+                                                                               kCompressedSuffix.size(), kCompressedSuffix) == 0) {
+            target = source.substr(0, source.size() - kCompressedSuffix.size());
+        } else {
+            return Fail(error, 0, source, "decompress: cannot guess output name");
+        }
+
+        int in = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) return Fail(error, errno, source, "cannot open file");
+        ::posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+        std::string temp = target + ".tmp-XXXXXX";
+        int out = ::mkostemp(temp.data(), O_CLOEXEC);
+        if (out < 0) {
+            const int code = errno;
+            ::close(in);
+            return Fail(error, code, target, "cannot create file");
+        }
+        int code;
+        {
+            FdSink sink(out);
+            code = pack ? BlockCodec::Compress(in, sink) : BlockCodec::Decompress(in, sink);
+        }
+        struct stat st;
+        if (!code && ::fstat(in, &st) == 0) ::fchmod(out, st.st_mode & 07777);
+        ::close(in);
+        if (::close(out) != 0 && !code) code = errno;
+        if (!code && ::rename(temp.c_str(), target.c_str()) != 0) code = errno;
+        if (code) {
+            ::unlink(temp.c_str());
+            return Fail(error, code, code == EBADMSG ? source : target, pack ? "compress: failed" : "decompress: failed");
         }
         return 0;
     }
 
-    int mkdir(const std::vector<std::string>& args) {
-        if (args.size() < 2) return 1;
-        return std::filesystem::create_directory(cwd/args[1]) ? 0 : 1;
+    /*
+     * Индекс в директории кэшей пользователя используется, только если она закрыта для остальных (при необходимости
+     * она создается); файл, заданный через `SetIndexFile` в другом месте, не проверяется.
+     */
+    bool IndexDirectoryPrivate() const {
+        return indexFile_.parent_path() != UserCacheDir() || PrivateDirectory(UserCacheDir());
     }
 
-    int rmdir(const std::vector<std::string>& args) {
-        if (args.size() < 2) return 1;
-        return std::filesystem::remove_all(cwd/args[1]) ? 0 : 1;
+    /*
+     * index build <root> -- построить индекс имен всех файлов и директорий под <root>.
+     * index update -- обновить индекс, перечитав только директории, изменившиеся с момента прошлого построения.
+     */
+    int index(const Args& args, CommandError& error) {
+        const bool update = args.size() == 2 && args[1] == "update";
+        if (!update && !(args.size() == 3 && args[1] == "build")) {
+            return Fail(error, 0, "", "index: usage: index build <root> | index update");
+        }
+        if (!IndexDirectoryPrivate()) return Fail(error, EACCES, indexFile_.parent_path().string(), "index: cache directory is not private");
+        NameIndex previous;
+        std::string root;
+        if (update) {
+            if (!previous.Open(indexFile_)) return Fail(error, errno, indexFile_.string(), "index: cannot open index");
+            root = previous.Root();
+        } else {
+            root = ResolvePath(args[2]);
+        }
+
+        std::vector<NameIndex::Entry> entries;
+        std::vector<int64_t> dirMtimes;
+        int64_t scanTime;
+        if (!NameIndex::Scan(root, update ? &previous : nullptr, stats_, entries, dirMtimes, scanTime)) {
+            return Fail(error, errno, root, "index: cannot read directory");
+        }
+        if (!NameIndex::Write(indexFile_, root, entries, dirMtimes, scanTime)) {
+            return Fail(error, errno, indexFile_.string(), "index: cannot write index");
+        }
+        return 0;
     }
 
-    int rm(const std::vector<std::string>& args) {
-        if (args.size() < 2) return 1;
-        return std::filesystem::remove(cwd/args[1]) ? 0 : 1;
+    /*
+     * locate <pattern> -- вывести все пути из индекса, содержащие подстроку <pattern>. Файловая система при этом
+     * не обходится, так что результат отражает состояние на момент последнего `index build`/`index update`.
+     */
+    int locate(const Args& args, OutputSink& out, CommandError& error) {
+        if (args.size() != 2) return Fail(error, 0, "", "locate: usage: locate <pattern>");
+        NameIndex index;
+        if (!IndexDirectoryPrivate()) return Fail(error, EACCES, indexFile_.parent_path().string(), "locate: cache directory is not private");
+        if (!index.Open(indexFile_)) return Fail(error, errno, indexFile_.string(), "locate: cannot open index");
+        const std::string_view root = index.Root();
+        const bool ok = index.Locate(args[1], [&out, root](std::string_view path) {
+            out.Append(root);
+            if (root != "/") out.Append('/');
+            out.Append(path);
+            out.Append('\n');
+        });
+        if (!ok) return Fail(error, EINVAL, indexFile_.string(), "locate: corrupted index");
+        return 0;
     }
 
-    int cd(const std::vector<std::string>& args) {
-        if (args.size() < 2) return 1;
-        fs::path currentPath = cwd/args[1];
-        if (std::filesystem::exists(currentPath) && std::filesystem::is_directory(currentPath)) {
-            cwd = currentPath;
-            return 0;
+    /*
+     * Прочитать имена всех записей директории.
+     */
+    static bool ScanDirectory(const std::string& dir, std::unordered_set<std::string>& names) {
+        DIR* stream = ::opendir(dir.c_str());
+        if (!stream) return false;
+        errno = 0;
+        while (const struct dirent* entry = ::readdir(stream)) {
+            if (!IsDotOrDotDot(entry->d_name)) names.insert(entry->d_name);
         }
-        
-        return 1;
+        int code = errno;
+        ::closedir(stream);
+        errno = code;
+        return code == 0;
     }
 
-    int echo(const std::vector<std::string>& args, std::ostream& out) {
+    int echo(const Args& args, OutputSink& out) {
         for (size_t i = 1; i < args.size(); ++i) {
-            out << args[i] << " ";
+            out.Append(args[i]);
+            out.Append(' ');
         }
-        out << "\n";
+        out.Append('\n');
         return 0;
     }
 };
 
+// Поток, который ничего не выводит и ничего не выделяет
+class NullStreambuf : public std::streambuf {
+protected:
+    int_type overflow(int_type c) override {
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char*, std::streamsize size) override {
+        return size;
+    }
+};
+
+#ifndef SHELL_BENCHMARK
+// Счетчик выделений памяти из глобальной кучи: с его помощью проверяем, что команды в установившемся режиме
+// обходятся памятью арены
+static std::atomic<size_t> heapAllocations{0};
+
+[[gnu::noinline]] void* operator new(std::size_t size) {
+    ++heapAllocations;
+    if (void* ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
 int main() {
 
     Shell shell(std::filesystem::temp_directory_path());
@@ -170,6 +7484,645 @@ int main() {
     assert(shell.ExecuteCommand("cat test2.txt", std::cout) == 0);
     assert(shell.ExecuteCommand("ls", std::cout) == 0);
     assert(shell.ExecuteCommand("ls ../test_solution_1234", std::cout));
+
+    std::ostringstream quiet;
+    std::ofstream("test_solution_1234/kept.txt") << "keep\n";
+    assert(shell.ExecuteCommand("cat missing.txt > kept.txt", quiet) == 1);
+    assert(fs::file_size("test_solution_1234/kept.txt") == 5);
+    assert(shell.ExecuteCommand("rm kept.txt", quiet) == 0);
+
+    struct RecordingSink : OutputSink {
+        std::string data;
+        size_t writes = 0;
+        size_t segments = 0;
+
+        bool WriteSegments(const struct iovec* pieces, size_t count) override {
+            ++writes;
+            segments += count;
+            for (size_t i = 0; i < count; ++i) data.append(static_cast<const char*>(pieces[i].iov_base), pieces[i].iov_len);
+            return true;
+        }
+    } recording;
+    std::string expected;
+    for (int i = 0; i < 100; ++i) {
+        recording.Append("abc");
+        expected += "abc";
+    }
+    const std::string big(1 << 20, 'b');
+    recording.Append("head");
+    recording.AppendRef(big.data(), big.size());
+    recording.Append("tail");
+    assert(recording.writes == 0);
+    assert(recording.Flush() && recording.writes == 1 && recording.segments == 3);
+    for (size_t i = 0; i < 2 * OutputSink::kMaxSegments; ++i) recording.AppendRef(big.data(), 1);
+    assert(recording.Flush() && recording.writes > 2);
+    assert(recording.data == expected + "head" + big + "tail" + std::string(2 * OutputSink::kMaxSegments, 'b'));
+    const size_t opensBefore = shell.Stats().appendOpens;
+    for (int i = 0; i < 100; ++i) {
+        assert(shell.ExecuteCommand("echo line >> log.txt", quiet) == 0);
+    }
+    assert(shell.Stats().appendOpens == opensBefore + 1);
+    assert(shell.ExecuteCommand("cat log.txt > log2.txt", std::cout) == 0);
+    assert(fs::file_size("test_solution_1234/log2.txt") == 100 * std::string("line \n").size());
+    assert(shell.ExecuteCommand("rm log.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("rm log2.txt", std::cout) == 0);
+
+    fs::create_symlink("target.txt", "test_solution_1234/alias.txt");
+    assert(shell.ExecuteCommand("echo a >> target.txt", quiet) == 0);
+    assert(shell.ExecuteCommand("echo b >> alias.txt", quiet) == 0);
+    assert(shell.ExecuteCommand("echo c >> target.txt", quiet) == 0);
+    std::ostringstream aliased;
+    assert(shell.ExecuteCommand("cat target.txt", aliased) == 0);
+    assert(aliased.str() == "$ cat target.txt\na \nb \nc \n");
+    assert(shell.ExecuteCommand("rm alias.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("rm target.txt", std::cout) == 0);
+
+    // Любая команда, кроме `echo`, может читать файлы, поэтому даже с `>>` видит уже дописанные данные
+    auto contents = [&shell](const std::string& name) {
+        const bool flushed = shell.Flush();
+        assert(flushed);
+        std::ifstream in("test_solution_1234/" + name);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    assert(shell.ExecuteCommand("echo hello >> fresh.txt", quiet) == 0);
+    assert(shell.ExecuteCommand("grep hello fresh.txt >> g.txt", quiet) == 0);
+    assert(contents("g.txt").find("hello") != std::string::npos);
+    assert(shell.ExecuteCommand("echo hello >> fresh.txt", quiet) == 0);
+    assert(shell.ExecuteCommand("cut -f1 fresh.txt >> h.txt", quiet) == 0);
+    assert(contents("h.txt") == "hello \nhello \n");
+    assert(shell.ExecuteCommand("echo hello >> fresh.txt", quiet) == 0);
+    assert(shell.ExecuteCommand("count fresh.txt >> i.txt", quiet) == 0);
+    assert(contents("i.txt") == "3\thello \n");
+    assert(shell.ExecuteCommand("echo hello >> fresh.txt", quiet) == 0);
+    assert(shell.ExecuteCommand("cat fresh.txt > j.txt", quiet) == 0);
+    if (::access("/bin/cat", X_OK) == 0) {
+        assert(shell.ExecuteCommand("echo hello >> fresh.txt", quiet) == 0);
+        assert(shell.ExecuteCommand("/bin/cat fresh.txt >> external.txt", quiet) == 0);
+        assert(contents("external.txt") == contents("fresh.txt"));
+        assert(shell.ExecuteCommand("rm external.txt", std::cout) == 0);
+    }
+    assert(shell.ExecuteCommand("echo hello >> fresh.txt", quiet) == 0);
+    assert(shell.ExecuteCommand("cmp j.txt fresh.txt >> k.txt", quiet) == 1);
+    assert(contents("k.txt").find("cmp: EOF on j.txt after byte 28, line 4\n") != std::string::npos);
+    assert(shell.ExecuteCommand("rm fresh.txt g.txt h.txt i.txt j.txt k.txt", std::cout) == 0);
+
+    // Путь, замененный другой командой, открывается заново, а не дописывается в старый файл
+    if (::access("/bin/mv", X_OK) == 0) {
+        assert(shell.ExecuteCommand("echo a >> moved.txt", quiet) == 0);
+        assert(shell.ExecuteCommand("/bin/mv moved.txt old.txt", quiet) == 0);
+        assert(shell.ExecuteCommand("echo b >> moved.txt", quiet) == 0);
+        assert(contents("moved.txt") == "b \n" && contents("old.txt") == "a \n");
+        assert(shell.ExecuteCommand("rm moved.txt old.txt", std::cout) == 0);
+    }
+    assert(shell.ExecuteCommand("mkdir -p src_dir dst_dir", quiet) == 0);
+    assert(shell.ExecuteCommand("echo x >> dst_dir/f", quiet) == 0);
+    assert(shell.ExecuteCommand("echo new > src_dir/f", quiet) == 0);
+    assert(shell.ExecuteCommand("sync src_dir dst_dir", quiet) == 0);
+    assert(shell.ExecuteCommand("echo y >> dst_dir/f", quiet) == 0);
+    assert(contents("dst_dir/f") == "new \ny \n");
+    assert(shell.ExecuteCommand("rmdir src_dir", std::cout) == 0);
+    assert(shell.ExecuteCommand("rmdir dst_dir", std::cout) == 0);
+    assert(shell.ExecuteCommand("echo packed > p.txt", quiet) == 0);
+    assert(shell.ExecuteCommand("compress p.txt", quiet) == 0);
+    assert(shell.ExecuteCommand("echo e >> g.txt", quiet) == 0);
+    assert(shell.ExecuteCommand("decompress p.txt.shz g.txt", quiet) == 0);
+    assert(shell.ExecuteCommand("echo f >> g.txt", quiet) == 0);
+    assert(contents("g.txt") == "packed \nf \n");
+    assert(shell.ExecuteCommand("rm p.txt p.txt.shz g.txt", std::cout) == 0);
+
+    if (::access("/dev/full", W_OK) == 0) {
+        CommandError full;
+        assert(shell.ExecuteCommand("echo lost >> /dev/full", quiet, full) == 0);
+        assert(shell.ExecuteCommand("echo x", quiet, full) == 1 && full.code == ENOSPC && full.path == "/dev/full");
+        assert(!shell.Flush());
+        assert(shell.ExecuteCommand("rmdir no_such_dir", quiet) == 1);  // закрывает кэш дозаписи
+        assert(shell.Flush());
+    }
+
+    shell.SetDurable(true);
+    assert(shell.ExecuteCommand("echo durable > durable.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("echo more >> durable.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("cat durable.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("echo steady > source.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("cat source.txt > copied.txt", std::cout) == 0);
+    std::ostringstream copied;
+    assert(shell.ExecuteCommand("cat copied.txt", copied) == 0);
+    assert(copied.str() == "$ cat copied.txt\nsteady \n");
+    assert(shell.ExecuteCommand("rm copied.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("rm source.txt", std::cout) == 0);
+    shell.SetDurable(false);
+    assert(shell.Stats().syncCalls > 0);
+    assert(fs::file_size("test_solution_1234/durable.txt") == std::string("durable \nmore \n").size());
+    assert(shell.ExecuteCommand("rm durable.txt", std::cout) == 0);
+
+    std::vector<std::string> script;
+    for (int i = 0; i < 20; ++i) {
+        const std::string dir = "dir" + std::to_string(i);
+        script.push_back("mkdir " + dir);
+        script.push_back("echo " + dir + " > " + dir + "/file.txt");
+        script.push_back("cat " + dir + "/file.txt");
+        script.push_back("rmdir " + dir);
+    }
+    std::ostringstream sequential, parallel;
+    assert(shell.RunScript(script, sequential) == shell.RunScript(script, parallel, 4));
+    assert(sequential.str() == parallel.str());
+    assert(shell.Stats().prefetchIssued > 0);
+    std::ostringstream durableParallel;
+    shell.SetDurable(true);
+    assert(shell.RunScript(script, durableParallel, 4) == std::vector<int>(script.size(), 0));
+    shell.SetDurable(false);
+    assert(durableParallel.str() == sequential.str());
+    const std::vector<std::string> failing = {"mkdir failing", "cat failing/none.txt", "echo ok", "rmdir failing"};
+    for (size_t workers : {1, 4}) {
+        std::vector<CommandError> errors;
+        assert(shell.RunScript(failing, quiet, workers, &errors) == std::vector<int>({0, 1, 0, 0}));
+        assert(errors.size() == 4 && errors[1].code == ENOENT && errors[1].message == "cannot open file: No such file or directory");
+        assert(errors[0].message.empty() && errors[2].message.empty());
+    }
+    // Команды под путем, созданным `mkdir -p`, `sync` или `archive extract`, выполняются после них
+    std::vector<std::string> nested;
+    for (int i = 0; i < 8; ++i) {
+        const std::string dir = "nested" + std::to_string(i);
+        nested.push_back("mkdir -p " + dir + "/a/b/c");
+        nested.push_back("touch " + dir + "/a/b/f");
+        nested.push_back("echo x > " + dir + "/a/g");
+        nested.push_back("sync " + dir + "/a " + dir + "/copy/deep");
+        nested.push_back("cat " + dir + "/copy/deep/g");
+        nested.push_back("archive create " + dir + ".tar " + dir + "/a");
+        nested.push_back("archive extract " + dir + ".tar " + dir + "/out/deep");
+        nested.push_back("cat " + dir + "/out/deep/g");
+    }
+    for (int round = 0; round < 20; ++round) {
+        assert(shell.RunScript(nested, quiet, 8) == std::vector<int>(nested.size(), 0));
+        for (int i = 0; i < 8; ++i) {
+            fs::remove_all("test_solution_1234/nested" + std::to_string(i));
+            fs::remove("test_solution_1234/nested" + std::to_string(i) + ".tar");
+        }
+    }
+
+    NullStreambuf nullBuffer;
+    std::ostream null(&nullBuffer);
+    const std::vector<std::string> steadyCommands = {
+        "echo steady state", "echo steady > steady.txt", "echo steady >> steady.txt", "cat steady.txt",
+        "ls", "mkdir steady_dir", "rm steady_dir",
+    };
+    for (int round = 0; round < 3; ++round) {
+        const size_t allocationsBefore = heapAllocations;
+        for (const std::string& command : steadyCommands) {
+            assert(shell.ExecuteCommand(command, null) == 0);
+        }
+        // Первый проход прогревает кэш дескрипторов и буферы
+        assert(round == 0 || heapAllocations == allocationsBefore);
+    }
+    assert(shell.ExecuteCommand("rm steady.txt", std::cout) == 0);
+
+    assert(shell.ExecuteCommand("mkdir -p tree/a/b/c tree/x{1..3}/y", std::cout) == 0);
+    assert(shell.ExecuteCommand("mkdir -p tree/a/b", std::cout) == 0);
+    CommandError expansion;
+    assert(shell.ExecuteCommand("echo {1..100000}{1..100000}", quiet, expansion) == 1);
+    assert(expansion.message == "too many words after brace expansion");
+    assert(shell.ExecuteCommand("echo x > f{a,b}", quiet, expansion) == 1 && expansion.message == "ambiguous redirect");
+    std::ostringstream extremes;
+    assert(shell.ExecuteCommand("echo {-9223372036854775808..9223372036854775807..4611686018427387904}", extremes) == 0);
+    assert(extremes.str().find("\n-9223372036854775808 -4611686018427387904 0 4611686018427387904 \n") != std::string::npos);
+    assert(shell.ExecuteCommand("mkdir tree/a", std::cout) == 1);
+    assert(shell.ExecuteCommand("touch tree/a/b/c/f{a,b,c} tree/a/b/c/fa", std::cout) == 0);
+    assert(fs::is_directory("test_solution_1234/tree/x3/y"));
+    assert(fs::is_regular_file("test_solution_1234/tree/a/b/c/fc"));
+    assert(shell.ExecuteCommand("rm tree/a/b/c/f{a..c}", std::cout) == 0);
+    assert(fs::is_empty("test_solution_1234/tree/a/b/c"));
+    assert(shell.ExecuteCommand("rmdir tree", std::cout) == 0);
+
+    const fs::path indexFile = fs::temp_directory_path() / ("name_index_" + std::to_string(::getpid()));
+    shell.SetIndexFile(indexFile);
+    assert(shell.ExecuteCommand("mkdir -p indexed/src/deep indexed/docs", std::cout) == 0);
+    assert(shell.ExecuteCommand("touch indexed/src/deep/main.cpp indexed/docs/readme", std::cout) == 0);
+    // Директории, измененные в тот же тик часов, что и построение индекса, обновление не переиспользует
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    assert(shell.ExecuteCommand("index build indexed", std::cout) == 0);
+    std::ostringstream located;
+    assert(shell.ExecuteCommand("locate main.c", located) == 0);
+    assert(located.str().find("indexed/src/deep/main.cpp\n") != std::string::npos);
+    assert(shell.ExecuteCommand("touch indexed/docs/guide", std::cout) == 0);
+    const size_t reusedBefore = shell.Stats().indexDirsReused;
+    assert(shell.ExecuteCommand("index update", std::cout) == 0);
+    assert(shell.Stats().indexDirsReused > reusedBefore);
+    located.str("");
+    assert(shell.ExecuteCommand("locate guide", located) == 0);
+    assert(located.str().find("indexed/docs/guide\n") != std::string::npos);
+    fs::remove(indexFile);
+    {
+        // По умолчанию индекс лежит в закрытой директории кэшей пользователя
+        const char* savedCache = std::getenv("XDG_CACHE_HOME");
+        const std::string saved = savedCache ? savedCache : "";
+        const fs::path cacheHome = fs::current_path() / "cache_home_1234";
+        ::setenv("XDG_CACHE_HOME", cacheHome.c_str(), 1);
+        Shell cached(fs::current_path());
+        assert(cached.ExecuteCommand("cd test_solution_1234", quiet) == 0);
+        assert(cached.ExecuteCommand("index build indexed", quiet) == 0);
+        assert(fs::is_regular_file(cacheHome / "shell" / "name_index"));
+        assert((fs::status(cacheHome / "shell").permissions() & fs::perms::all) == fs::perms::owner_all);
+        fs::permissions(cacheHome / "shell", fs::perms::group_write, fs::perm_options::add);
+        assert(cached.ExecuteCommand("locate main.c", quiet) == 1);
+        if (savedCache) {
+            ::setenv("XDG_CACHE_HOME", saved.c_str(), 1);
+        } else {
+            ::unsetenv("XDG_CACHE_HOME");
+        }
+        fs::remove_all(cacheHome);
+    }
+    assert(shell.ExecuteCommand("rmdir indexed", std::cout) == 0);
+
+    assert(shell.ExecuteCommand("mkdir listed", std::cout) == 0);
+    assert(shell.ExecuteCommand("echo a longer line > listed/b", std::cout) == 0);
+    assert(shell.ExecuteCommand("echo x > listed/a", std::cout) == 0);
+    assert(shell.ExecuteCommand("touch listed/c", std::cout) == 0);
+    std::ostringstream listing;
+    assert(shell.ExecuteCommand("ls test_solution_1234/listed > ../listing.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("cat ../listing.txt", listing) == 0);
+    assert(listing.str().find("a\nb\nc\n") != std::string::npos);
+    listing.str("");
+    assert(shell.ExecuteCommand("ls -S test_solution_1234/listed", listing) == 0);
+    assert(listing.str().find("b\na\nc\n") != std::string::npos);
+    ::setenv("COLUMNS", "80", 1);
+    listing.str("");
+    assert(shell.ExecuteCommand("ls -C test_solution_1234/listed", listing) == 0);
+    assert(listing.str().find("a  b  c\n") != std::string::npos);
+    ::setenv("COLUMNS", "3", 1);
+    listing.str("");
+    assert(shell.ExecuteCommand("ls -C test_solution_1234/listed", listing) == 0);
+    assert(listing.str().find("a\nb\nc\n") != std::string::npos);
+    ::unsetenv("COLUMNS");
+    listing.str("");
+    assert(shell.ExecuteCommand("ls -la test_solution_1234/listed", listing) == 0);
+    assert(listing.str().find("\ntotal ") != std::string::npos);
+    assert(listing.str().find(" ..\n") != std::string::npos);
+    assert(listing.str().find("-rw") != std::string::npos);
+    assert(listing.str().find(" 15 ") != std::string::npos);  // размер "a longer line \n"
+    assert(shell.ExecuteCommand("ls -x", std::cout) == 1);
+    assert(shell.ExecuteCommand("rm ../listing.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("rmdir listed", std::cout) == 0);
+
+    assert(shell.ExecuteCommand("mkdir -p packed/sub/deep", std::cout) == 0);
+    assert(shell.ExecuteCommand("echo top > packed/top.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("echo deep > packed/sub/deep/" + std::string(120, 'n'), std::cout) == 0);
+    assert(shell.ExecuteCommand("archive create packed.tar packed", std::cout) == 0);
+    assert(fs::file_size("test_solution_1234/packed.tar") % 10240 == 0);
+    assert(shell.ExecuteCommand("archive extract packed.tar unpacked", std::cout) == 0);
+    std::ostringstream unpacked;
+    assert(shell.ExecuteCommand("cat unpacked/sub/deep/" + std::string(120, 'n'), unpacked) == 0);
+    assert(unpacked.str().find("\ndeep \n") != std::string::npos);
+    assert(shell.ExecuteCommand("archive extract packed/top.txt unpacked", std::cout) == 1);
+    {
+        // pax-запись "2 " короче минимальной "<длина> \n": ее нельзя применять к следующему файлу
+        std::ifstream in("test_solution_1234/packed.tar", std::ios::binary);
+        std::string tar((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::string pax = tar.substr(0, 512);
+        std::fill(pax.begin(), pax.begin() + 100, '\0');
+        std::fill(pax.begin() + 345, pax.begin() + 500, '\0');
+        pax.replace(0, 3, "pax");
+        const std::string records = "2 path=injected\n";
+        std::snprintf(&pax[124], 12, "%011o", static_cast<unsigned>(records.size()));
+        pax[156] = 'x';
+        std::fill(pax.begin() + 148, pax.begin() + 156, ' ');
+        unsigned sum = 0;
+        for (char c : pax) sum += static_cast<unsigned char>(c);
+        std::snprintf(&pax[148], 8, "%06o", sum);
+        std::ofstream("test_solution_1234/paxed.tar", std::ios::binary)
+            << pax << records << std::string(512 - records.size(), '\0') << tar;
+    }
+    assert(shell.ExecuteCommand("archive extract paxed.tar paxed", std::cout) == 0);
+    assert(fs::exists("test_solution_1234/paxed/top.txt") && !fs::exists("test_solution_1234/paxed/injected\n"));
+    assert(shell.ExecuteCommand("rm paxed.tar", std::cout) == 0);
+    assert(shell.ExecuteCommand("rmdir paxed", std::cout) == 0);
+    assert(shell.ExecuteCommand("rm packed.tar", std::cout) == 0);
+    assert(shell.ExecuteCommand("rmdir packed", std::cout) == 0);
+    assert(shell.ExecuteCommand("rmdir unpacked", std::cout) == 0);
+
+    assert(shell.ExecuteCommand("mkdir -p mirror/sub", std::cout) == 0);
+    assert(shell.ExecuteCommand("echo small > mirror/sub/small.txt", std::cout) == 0);
+    {
+        std::ofstream big("test_solution_1234/mirror/big.bin", std::ios::binary);
+        for (uint32_t i = 0; i < 3 * 1024 * 1024; ++i) big.put(static_cast<char>(i * 2654435761u >> 24));
+    }
+    const size_t copiedBefore = shell.Stats().syncCopied;
+    assert(shell.ExecuteCommand("sync mirror mirror_copy", std::cout) == 0);
+    assert(shell.Stats().syncCopied - copiedBefore == 2);
+    assert(shell.ExecuteCommand("echo extra > mirror_copy/extra.txt", std::cout) == 0);
+    {
+        std::fstream big("test_solution_1234/mirror/big.bin", std::ios::binary | std::ios::in | std::ios::out);
+        big.seekp(1500000);
+        big.write("changed", 7);
+    }
+    const uint64_t writtenBefore = shell.Stats().syncBytesWritten;
+    assert(shell.ExecuteCommand("sync mirror mirror_copy --delete", std::cout) == 0);
+    assert(shell.Stats().syncUpdated == 1 && shell.Stats().syncDeleted == 1);
+    assert(shell.Stats().syncBytesWritten - writtenBefore < 256 * 1024);
+    {
+        std::ifstream lhs("test_solution_1234/mirror/big.bin", std::ios::binary);
+        std::ifstream rhs("test_solution_1234/mirror_copy/big.bin", std::ios::binary);
+        assert(std::equal(std::istreambuf_iterator<char>(lhs), std::istreambuf_iterator<char>(),
+                          std::istreambuf_iterator<char>(rhs), std::istreambuf_iterator<char>()));
+    }
+    assert(!fs::exists("test_solution_1234/mirror_copy/extra.txt"));
+    assert(shell.ExecuteCommand("rmdir mirror", std::cout) == 0);
+    assert(shell.ExecuteCommand("rmdir mirror_copy", std::cout) == 0);
+
+    assert(shell.ExecuteCommand("mkdir -p twins/sub", std::cout) == 0);
+    {
+        const std::string large(20000, 'z');
+        std::ofstream("test_solution_1234/twins/a.bin") << large;
+        std::ofstream("test_solution_1234/twins/sub/b.bin") << large;
+        std::ofstream("test_solution_1234/twins/c.bin") << large.substr(1) << 'y';
+    }
+    assert(shell.ExecuteCommand("echo same > twins/x.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("echo same > twins/sub/y.txt", std::cout) == 0);
+    std::ostringstream twins;
+    assert(shell.ExecuteCommand("dedupe twins", twins) == 0);
+    assert(twins.str() == "$ dedupe twins\ntwins/a.bin\ntwins/sub/b.bin\n\ntwins/sub/y.txt\ntwins/x.txt\n");
+    assert(shell.ExecuteCommand("dedupe --link twins", std::cout) == 0);
+    assert(fs::equivalent("test_solution_1234/twins/a.bin", "test_solution_1234/twins/sub/b.bin"));
+    assert(!fs::equivalent("test_solution_1234/twins/a.bin", "test_solution_1234/twins/c.bin"));
+    assert(shell.Stats().dedupeDuplicates == 4);
+    assert(shell.ExecuteCommand("rmdir twins", std::cout) == 0);
+
+    std::ofstream("test_solution_1234/table.csv") << "a,1,x\nb,2.5,y\nplain\nc,-3\n";
+    std::ostringstream columns;
+    assert(shell.ExecuteCommand("cut -d, -f1,3 table.csv", columns) == 0);
+    assert(columns.str() == "$ cut -d, -f1,3 table.csv\na,x\nb,y\nplain\nc\n");
+    columns.str("");
+    assert(shell.ExecuteCommand("colstat -d , -f2-3 table.csv", columns) == 0);
+    assert(columns.str() == "$ colstat -d , -f2-3 table.csv\n2\t3\t0.5\t-3\t2.5\n3\t0\t0\t-\t-\n");
+    assert(shell.ExecuteCommand("colstat -f2- table.csv", std::cout) == 1);
+    // Поля хранятся диапазонами: большие номера не занимают память, а пересекающиеся диапазоны сливаются
+    columns.str("");
+    assert(shell.ExecuteCommand("cut -d, -f3,1-1,2-3 table.csv", columns) == 0);
+    assert(shell.ExecuteCommand("cut -d, -f1000000 table.csv", columns) == 0);
+    assert(columns.str() == "$ cut -d, -f3,1-1,2-3 table.csv\na,1,x\nb,2.5,y\nplain\nc,-3\n"
+                            "$ cut -d, -f1000000 table.csv\n\n\nplain\n\n");
+    assert(shell.ExecuteCommand("cut -d, -f18446744073709551614 table.csv", std::cout) == 1);
+    columns.str("");
+    assert(shell.ExecuteCommand("colstat -d , -f100000000 table.csv", columns) == 0);
+    assert(columns.str() == "$ colstat -d , -f100000000 table.csv\n100000000\t0\t0\t-\t-\n");
+    assert(shell.ExecuteCommand("colstat -d , -f1-100000000 table.csv", std::cout) == 1);
+    assert(shell.LastError().message == "colstat: too many fields");
+    assert(shell.ExecuteCommand("rm table.csv", std::cout) == 0);
+
+    std::ofstream("test_solution_1234/words.txt") << "b\na\nb\nc\nb\na";
+    std::ostringstream counted;
+    assert(shell.ExecuteCommand("count words.txt", counted) == 0);
+    assert(counted.str() == "$ count words.txt\n3\tb\n2\ta\n1\tc\n");
+    counted.str("");
+    assert(shell.ExecuteCommand("count -k 1 -m 64 words.txt", counted) == 0);
+    assert(counted.str() == "$ count -k 1 -m 64 words.txt\n3\tb\n");
+    assert(shell.ExecuteCommand("rm words.txt", std::cout) == 0);
+
+    // Много различных строк при пределе в 1 МиБ: таблицы сбрасываются на диск, а результат тот же
+    {
+        std::ofstream many("test_solution_1234/many.txt");
+        for (int i = 0; i < 200000; ++i) {
+            many << "line_" << i % 150000 << (i % 7 == 0 ? "\nfrequent\n" : "\n");
+        }
+    }
+    std::ostringstream inMemory, spilled;
+    const size_t spillsBefore = shell.Stats().countSpills;
+    assert(shell.ExecuteCommand("count many.txt", inMemory) == 0);
+    assert(shell.Stats().countSpills == spillsBefore);
+    assert(shell.ExecuteCommand("count -m 1 many.txt", spilled) == 0);
+    assert(shell.Stats().countSpills > spillsBefore);
+    assert(spilled.str().substr(spilled.str().find('\n')) == inMemory.str().substr(inMemory.str().find('\n')));
+    assert(inMemory.str().find("\n28572\tfrequent\n2\tline_0\n") != std::string::npos);
+    counted.str("");
+    assert(shell.ExecuteCommand("count -k 2 -m 1 many.txt", counted) == 0);
+    assert(counted.str() == "$ count -k 2 -m 1 many.txt\n28572\tfrequent\n2\tline_0\n");
+    assert(shell.ExecuteCommand("rm many.txt", std::cout) == 0);
+
+    std::ofstream("test_solution_1234/left.txt") << "same\nleft\n";
+    std::ofstream("test_solution_1234/right.txt") << "same\nlest\n";
+    std::ostringstream compared;
+    assert(shell.ExecuteCommand("cmp left.txt left.txt", compared) == 0);
+    assert(shell.ExecuteCommand("cmp left.txt right.txt", compared) == 1);
+    assert(compared.str().find("\nleft.txt right.txt differ: byte 8, line 2\n") != std::string::npos);
+    assert(shell.ExecuteCommand("compress left.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("decompress left.txt.shz copy.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("cmp left.txt copy.txt", std::cout) == 0);
+    std::ostringstream inflated;
+    shell.SetDecompressOnCat(true);
+    assert(shell.ExecuteCommand("cat left.txt.shz", inflated) == 0);
+    shell.SetDecompressOnCat(false);
+    assert(inflated.str() == "$ cat left.txt.shz\nsame\nleft\n");
+    assert(shell.ExecuteCommand("rm left.txt.shz", std::cout) == 0);
+    assert(shell.ExecuteCommand("rm copy.txt", std::cout) == 0);
+
+    // Сжимаемый текст на несколько блоков, а затем поврежденный, оборванный и слишком крупноблочный потоки
+    {
+        std::ofstream text("test_solution_1234/text.txt");
+        for (size_t i = 0; i < 200000; ++i) {
+            text << "record " << i % 1000 << " of the repeated text\n";
+        }
+    }
+    assert(fs::file_size("test_solution_1234/text.txt") > 3 * BlockCodec::kBlockSize);
+    assert(shell.ExecuteCommand("compress text.txt", std::cout) == 0);
+    assert(fs::file_size("test_solution_1234/text.txt.shz") < fs::file_size("test_solution_1234/text.txt") / 4);
+    assert(shell.ExecuteCommand("decompress text.txt.shz copy.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("cmp text.txt copy.txt", std::cout) == 0);
+    std::string packed;
+    {
+        std::ifstream in("test_solution_1234/text.txt.shz", std::ios::binary);
+        packed.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    std::string damaged = packed;
+    damaged[damaged.size() / 2] ^= 0x5a;
+    std::ofstream("test_solution_1234/damaged.shz", std::ios::binary) << damaged;
+    assert(shell.ExecuteCommand("decompress damaged.shz", std::cout) == 1);
+    assert(shell.LastError().code == EBADMSG && !fs::exists("test_solution_1234/damaged"));
+    std::ofstream("test_solution_1234/damaged.shz", std::ios::binary) << packed.substr(0, packed.size() - 100);
+    assert(shell.ExecuteCommand("decompress damaged.shz", std::cout) == 1);
+    assert(shell.LastError().code == EBADMSG);
+    std::ofstream("test_solution_1234/damaged.shz", std::ios::binary) << std::string("SHZ1\0\0\0\x40", 8)
+                                                                     << std::string("\0\0\0\x20\0\0\0\x20\0\0\0\0", 12);
+    assert(shell.ExecuteCommand("decompress damaged.shz", std::cout) == 1);
+    assert(shell.LastError().code == EBADMSG);
+    assert(shell.ExecuteCommand("rm damaged.shz", std::cout) == 0);
+    assert(shell.ExecuteCommand("rm text.txt.shz", std::cout) == 0);
+    assert(shell.ExecuteCommand("rm text.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("rm copy.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("rm left.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("rm right.txt", std::cout) == 0);
+
+    // Файлы на разных устройствах читаются кусками в двух потоках; различие в третьем куске
+    struct stat shmStat, hereStat;
+    if (::stat("/dev/shm", &shmStat) == 0 && ::stat("test_solution_1234", &hereStat) == 0 &&
+        shmStat.st_dev != hereStat.st_dev && ::access("/dev/shm", W_OK) == 0) {
+        std::string contents;
+        while (contents.size() < (10 << 20)) {
+            contents += "0123456789abcde\n";
+        }
+        const std::string remote = "/dev/shm/shell_cmp_1234.txt";
+        std::ofstream("test_solution_1234/local.txt") << contents;
+        std::ofstream(remote) << contents;
+        assert(shell.ExecuteCommand("cmp local.txt " + remote, std::cout) == 0);
+        const size_t at = (9 << 20) + 5;
+        contents[at] = '!';
+        std::ofstream(remote) << contents << "tail";
+        std::ostringstream apart;
+        assert(shell.ExecuteCommand("cmp local.txt " + remote, apart) == 1);
+        assert(apart.str().find(" differ: byte " + std::to_string(at + 1) + ", line " + std::to_string(at / 16 + 1) + "\n") !=
+               std::string::npos);
+        contents[at] = '5';
+        std::ofstream(remote) << contents << "tail";
+        apart.str("");
+        assert(shell.ExecuteCommand("cmp local.txt " + remote, apart) == 1);
+        assert(apart.str().find("cmp: EOF on local.txt after byte " + std::to_string(contents.size()) + ", line " +
+                                std::to_string(contents.size() / 16) + "\n") != std::string::npos);
+        fs::remove(remote);
+        assert(shell.ExecuteCommand("rm local.txt", std::cout) == 0);
+    }
+
+    std::ofstream("test_solution_1234/paced.txt") << std::string(16 * 1024, 'p');
+    std::ostringstream paced;
+    const size_t waitsBefore = shell.Stats().throttleWaits;
+    shell.SetIoLimit(64 * 1024);
+    assert(shell.ExecuteCommand("cat paced.txt", paced) == 0);
+    assert(shell.ExecuteCommand("cat paced.txt", paced) == 0);
+    shell.SetIoLimit(0);
+    assert(shell.Stats().throttleWaits > waitsBefore && shell.Stats().throttleTime.count() > 0);
+    assert(paced.str().size() == 2 * (16 * 1024 + sizeof("$ cat paced.txt\n") - 1));
+    assert(shell.ExecuteCommand("rm paced.txt", std::cout) == 0);
+
+    std::ostringstream spawned;
+    assert(shell.ExecuteCommand("printf spawned", spawned) == 0);
+    assert(spawned.str().find("spawned") != std::string::npos);
+    assert(shell.ExecuteCommand("printf %s-%s a b > spawned.txt", std::cout) == 0);
+    spawned.str("");
+    assert(shell.ExecuteCommand("cat spawned.txt", spawned) == 0);
+    assert(spawned.str().find("\na-b") != std::string::npos);
+    assert(shell.ExecuteCommand("rm spawned.txt", std::cout) == 0);
+    const size_t lookupsBefore = shell.Stats().programLookups;
+    assert(shell.ExecuteCommand("true", std::cout) == 0);
+    assert(shell.ExecuteCommand("true", std::cout) == 0);
+    assert(shell.Stats().programLookups == lookupsBefore + 1);
+    assert(shell.ExecuteCommand("false", std::cout) == 1);
+    assert(shell.LastError().message == "command exited with status 1");
+    assert(shell.ExecuteCommand("no_such_program_1234", std::cout) == 1);
+    assert(shell.LastError().message == "unknown command");
+
+    // Относительный элемент PATH отсчитывается от текущей директории Shell, и результат не кэшируется
+    for (const char* side : {"first", "second"}) {
+        fs::create_directories(std::string("test_solution_1234/") + side + "/bin");
+        const std::string tool = std::string("test_solution_1234/") + side + "/bin/tool_1234";
+        std::ofstream(tool) << "#!/bin/sh\necho " << side << "\n";
+        fs::permissions(tool, fs::perms::owner_all);
+    }
+    const std::string savedPath = std::getenv("PATH") ? std::getenv("PATH") : "";
+    ::setenv("PATH", ("bin:" + savedPath).c_str(), 1);
+    std::ostringstream relative;
+    assert(shell.ExecuteCommand("cd first", std::cout) == 0);
+    assert(shell.ExecuteCommand("tool_1234", relative) == 0);
+    assert(shell.ExecuteCommand("cd ../second", std::cout) == 0);
+    assert(shell.ExecuteCommand("tool_1234", relative) == 0);
+    assert(shell.ExecuteCommand("cd " + fs::absolute("test_solution_1234").string(), std::cout) == 0);
+    ::setenv("PATH", savedPath.c_str(), 1);
+    assert(relative.str().find("\nfirst\n") != std::string::npos);
+    assert(relative.str().find("\nsecond\n") != std::string::npos);
+    fs::remove_all("test_solution_1234/first");
+    fs::remove_all("test_solution_1234/second");
+
+    assert(shell.ExecuteCommand("mkdir -p piped/sub", std::cout) == 0);
+    assert(shell.ExecuteCommand("echo alpha > piped/a.txt", std::cout) == 0);
+    assert(shell.ExecuteCommand("echo beta > piped/sub/b.txt", std::cout) == 0);
+    std::ofstream("test_solution_1234/piped/sub/big.dat") << std::string(100 * 1024, 'x');
+    std::string pipedText[2];
+    for (int structured = 0; structured < 2; ++structured) {
+        shell.SetStructuredPipelines(structured);
+        std::ostringstream piped;
+        assert(shell.ExecuteCommand("find piped | grep .txt | head -n 5", piped) == 0);
+        assert(piped.str().find("\npiped/a.txt\n") != std::string::npos);
+        assert(piped.str().find("\npiped/sub/b.txt\n") != std::string::npos);
+        assert(shell.ExecuteCommand("du piped | head -n 1", piped) == 0);
+        assert(piped.str().find("\tpiped/sub\n") != std::string::npos);
+        assert(shell.ExecuteCommand("grep alpha piped/a.txt piped/sub/b.txt | head", piped) == 0);
+        assert(shell.ExecuteCommand("cat piped/a.txt | grep alp", piped) == 0);
+        // grep сравнивает с тем же текстом, что выводится: "размер\tимя" и "файл:строка"
+        assert(shell.ExecuteCommand("du piped | grep 1", piped) == 0);
+        assert(piped.str().find("\tpiped/sub\n") != piped.str().rfind("\tpiped/sub\n"));
+        assert(shell.ExecuteCommand("grep alpha piped/a.txt piped/sub/b.txt | grep a.txt:al", piped) == 0);
+        pipedText[structured] = piped.str();
+    }
+    assert(pipedText[0] == pipedText[1]);
+    assert(pipedText[0].find("\npiped/a.txt:alpha \n") != pipedText[0].rfind("\npiped/a.txt:alpha \n"));
+    assert(shell.ExecuteCommand("echo x | cat", std::cout) == 1);
+    assert(shell.ExecuteCommand("rmdir piped", std::cout) == 0);
+
+    assert(shell.ExecuteCommand("mkdir watched", std::cout) == 0);
+    std::ostringstream watchOut;
+    std::thread watcher([&shell, &watchOut]() {
+        assert(shell.ExecuteCommand("watch -t 2000 ls test_solution_1234/watched", watchOut) == 0);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::ofstream("test_solution_1234/watched/new.txt").close();
+    std::ofstream("test_solution_1234/watched/temp.txt").close();
+    fs::remove("test_solution_1234/watched/temp.txt");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    shell.StopWatch();
+    watcher.join();
+    assert(watchOut.str().find("+ new.txt\n") != std::string::npos);
+    assert(watchOut.str().find("temp.txt") == std::string::npos);
+    assert(shell.ExecuteCommand("rmdir watched", std::cout) == 0);
+
+    // Непрерывный поток событий не откладывает ни вывод пачки, ни срок `-t`
+    assert(shell.ExecuteCommand("mkdir churn", std::cout) == 0);
+    std::atomic<bool> churning{true};
+    std::thread churner([&churning]() {
+        for (size_t i = 0; churning; ++i) {
+            std::ofstream("test_solution_1234/churn/f" + std::to_string(i % 8)).close();
+            fs::remove("test_solution_1234/churn/f" + std::to_string((i + 4) % 8));
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    });
+    std::ostringstream churnOut;
+    auto watchStart = std::chrono::steady_clock::now();
+    assert(shell.ExecuteCommand("watch -t 800 ls test_solution_1234/churn", churnOut) == 0);
+    auto watchTook = std::chrono::steady_clock::now() - watchStart;
+    churning = false;
+    churner.join();
+    assert(watchTook < std::chrono::milliseconds(1500));
+    assert(churnOut.str().find("+ f") != std::string::npos);
+    assert(shell.ExecuteCommand("rmdir churn", std::cout) == 0);
+
+    const std::string loopScript = "PREFIX=file\n"
+                                   "for n in 1 2 3; do\n"
+                                   "    echo $n > ${PREFIX}_$n.txt; cat ${PREFIX}_$n.txt\n"
+                                   "    rm ${PREFIX}_$n.txt\n"
+                                   "done\n";
+    shell.SetScriptCacheDir(fs::current_path() / "script_cache_1234");
+    assert(shell.ExecuteScript(loopScript, std::cout) == 0);
+    assert(shell.ExecuteScript(loopScript, std::cout) == 0);
+    assert(shell.Stats().scriptCacheHits == 1 && shell.Stats().scriptCacheMisses == 1);
+    assert((fs::status("script_cache_1234").permissions() & fs::perms::all) == fs::perms::owner_all);
+    {
+        // Файл с тем же именем, но от другого скрипта (как при совпадении хэшей), не выполняется
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.sbc", static_cast<unsigned long long>(ScriptProgram::Hash(loopScript)));
+        ScriptProgram other;
+        assert(other.Compile("echo other > other.txt"));
+        assert(other.Save(fs::path("script_cache_1234") / name, "echo other > other.txt"));
+    }
+    assert(shell.ExecuteScript(loopScript, std::cout) == 0);
+    assert(shell.Stats().scriptCacheHits == 1 && shell.Stats().scriptCacheMisses == 2);
+    assert(!fs::exists("test_solution_1234/other.txt"));
+    // В директорию, доступную другим пользователям, кэш не пишется
+    fs::permissions("script_cache_1234", fs::perms::others_write, fs::perm_options::add);
+    assert(shell.ExecuteScript(loopScript, std::cout) == 0);
+    assert(shell.Stats().scriptCacheMisses == 3);
+    assert(shell.ExecuteScript("for x in a b\necho $x", std::cout) == 1);
+    // Строка из одного перенаправления -- синтаксическая ошибка, а не команда без имени
+    assert(shell.ExecuteScript("F=out.txt\n> $F\n", std::cout) == 1);
+    assert(shell.LastError().message == "syntax error");
+    assert(shell.ExecuteCommand("> f", std::cout) == 1);
+    assert(shell.ExecuteCommand(">> f", std::cout) == 1);
+    assert(!fs::exists("test_solution_1234/f") && !fs::exists("test_solution_1234/out.txt"));
+    fs::remove_all("script_cache_1234");
     assert(shell.ExecuteCommand("rm test.txt", std::cout) == 0);
     assert(shell.ExecuteCommand("rm test2.txt", std::cout) == 0);
     assert(shell.ExecuteCommand("ls", std::cout) == 0);
@@ -179,4 +8132,374 @@ int main() {
     assert(shell.ExecuteCommand("rmdir test_solution_1234", std::cout) == 1);
 
     assert(shell.ExecuteCommand("cd test_solution_1234", std::cout) == 1);
+    assert(shell.LastError().code == ENOENT);
+}
+#else
+/*
+ * Набор замеров скорости команд (собирается с -DSHELL_BENCHMARK).
+ * Данные для замеров генерируются заново во временной директории. Каждый замер повторяется `--repeat` раз и
+ * берется медиана. Размеры данных ограничиваются `--max-entries` и `--max-bytes`, чтобы быстрый прогон
+ * умещался в несколько секунд, а полный (до 1M записей и 10 GB) запускался явно.
+ *
+ * Параметры:
+ *   --filter <подстрока>   выполнить только замеры, в имени которых есть подстрока
+ *   --repeat <n>           число повторов каждого замера (3)
+ *   --max-entries <n>      наибольший размер директории для ls и дерева для mkdir/rm (10000)
+ *   --max-bytes <n>        наибольший размер файла для cat (100000000)
+ *   --json <файл>          записать результаты в JSON
+ *   --baseline <файл>      сравнить с результатами из ранее записанного JSON; при замедлении больше чем на
+ *   --tolerance <доля>     эту долю (0.10) программа завершается с кодом 1
+ */
+struct BenchmarkResult {
+    std::string name;
+    double seconds;  // медиана по повторам
+    uint64_t ops;    // сколько команд (или операций) выполняет один повтор
+    uint64_t bytes;  // сколько байт данных обрабатывает один повтор
+};
+
+class BenchmarkSuite {
+public:
+    std::string filter;
+    size_t repeat = 3;
+    uint64_t maxEntries = 10000;
+    uint64_t maxBytes = 100000000;
+
+    explicit BenchmarkSuite(const fs::path& root) : root_(root), shell_(root) {}
+
+    Shell& GetShell() {
+        return shell_;
+    }
+
+    bool Enabled(const std::string& name) const {
+        return name.find(filter) != std::string::npos;
+    }
+
+    /*
+     * Выполнить замер `name`: перед каждым повтором вызывается `setup` (его время не учитывается), затем
+     * замеряется `body`. Если любая команда замера вернула не 0, замер считается ошибочным.
+     */
+    template <typename Setup, typename Body>
+    void Run(const std::string& name, uint64_t ops, uint64_t bytes, Setup&& setup, Body&& body) {
+        if (!Enabled(name)) return;
+        std::vector<double> samples;
+        for (size_t i = 0; i < repeat; ++i) {
+            setup();
+            auto start = std::chrono::steady_clock::now();
+            const bool ok = body();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (!ok) {
+                std::cerr << name << ": command failed: " << shell_.LastError().message << "\n";
+                failed_ = true;
+                return;
+            }
+            samples.push_back(elapsed.count());
+        }
+        std::sort(samples.begin(), samples.end());
+        results_.push_back({name, samples[samples.size() / 2], ops, bytes});
+        const BenchmarkResult& result = results_.back();
+        std::cout << result.name << ": " << result.seconds * 1e3 << " ms";
+        if (ops > 1) std::cout << ", " << result.seconds / ops * 1e9 << " ns/op";
+        if (bytes) std::cout << ", " << bytes / result.seconds / (1 << 20) << " MiB/s";
+        std::cout << std::endl;
+    }
+
+    /*
+     * Выполнить команду, отбрасывая ее вывод. Возвращает true, если команда выполнилась успешно.
+     */
+    bool Execute(const std::string& command) {
+        return shell_.ExecuteCommand(command, null_) == 0;
+    }
+
+    bool Failed() const {
+        return failed_;
+    }
+
+    /*
+     * Отметить набор ошибочным из проверки, сделанной вне `Run`.
+     */
+    void Fail(const std::string& message) {
+        std::cerr << message << "\n";
+        failed_ = true;
+    }
+
+    const std::vector<BenchmarkResult>& Results() const {
+        return results_;
+    }
+
+    /*
+     * Записать результаты в JSON, по одному замеру на строку (так их же проще прочитать как baseline).
+     */
+    bool WriteJson(const std::string& file) const {
+        std::ofstream out(file);
+        out << "{\n  \"benchmarks\": [\n";
+        for (size_t i = 0; i < results_.size(); ++i) {
+            const BenchmarkResult& result = results_[i];
+            out << "    {\"name\": \"" << result.name << "\", \"seconds\": " << result.seconds
+                << ", \"ops\": " << result.ops << ", \"bytes\": " << result.bytes << "}"
+                << (i + 1 < results_.size() ? ",\n" : "\n");
+        }
+        out << "  ]\n}\n";
+        return static_cast<bool>(out);
+    }
+
+    /*
+     * Сравнить результаты с baseline. Возвращает false, если какой-то замер стал медленнее больше чем на
+     * `tolerance`. Замеры, которых нет в baseline, только выводятся.
+     */
+    bool CompareWithBaseline(const std::string& file, double tolerance) const {
+        std::ifstream in(file);
+        if (!in.is_open()) {
+            std::cerr << "cannot open baseline " << file << "\n";
+            return false;
+        }
+        std::unordered_map<std::string, double> baseline;
+        std::string line;
+        const std::string nameKey = "\"name\": \"", secondsKey = "\"seconds\": ";
+        while (std::getline(in, line)) {
+            size_t name = line.find(nameKey), seconds = line.find(secondsKey);
+            if (name == std::string::npos || seconds == std::string::npos) continue;
+            name += nameKey.size();
+            baseline[line.substr(name, line.find('"', name) - name)] = std::strtod(line.c_str() + seconds + secondsKey.size(), nullptr);
+        }
+
+        bool ok = true;
+        std::cout << "\ncomparison with " << file << " (tolerance " << tolerance * 100 << "%):\n";
+        for (const BenchmarkResult& result : results_) {
+            auto it = baseline.find(result.name);
+            if (it == baseline.end() || it->second <= 0) {
+                std::cout << "  " << result.name << ": new\n";
+                continue;
+            }
+            const double change = result.seconds / it->second - 1;
+            const bool regression = change > tolerance;
+            ok = ok && !regression;
+            std::cout << "  " << result.name << ": " << (change >= 0 ? "+" : "") << change * 100 << "%"
+                      << (regression ? "  REGRESSION" : "") << "\n";
+        }
+        return ok;
+    }
+
+private:
+    fs::path root_;
+    Shell shell_;
+    NullStreambuf nullBuffer_;
+    std::ostream null_{&nullBuffer_};
+    std::vector<BenchmarkResult> results_;
+    bool failed_ = false;
+};
+
+/*
+ * Создать файл `path` размера `size` с неслучайным, но и не однородным содержимым.
+ */
+void MakeFile(const fs::path& path, uint64_t size) {
+    std::string block(1 << 20, '\0');
+    for (size_t i = 0; i < block.size(); ++i) {
+        block[i] = static_cast<char>('a' + i * 31 % 26);
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    for (uint64_t left = size; left > 0;) {
+        const size_t chunk = std::min<uint64_t>(left, block.size());
+        out.write(block.data(), chunk);
+        left -= chunk;
+    }
+}
+
+/*
+ * Создать директорию `dir` с `count` пустыми файлами (в обход Shell, чтобы не замерять это).
+ */
+void MakeDirectory(const fs::path& dir, uint64_t count) {
+    fs::create_directories(dir);
+    for (uint64_t i = 0; i < count; ++i) {
+        int fd = ::open((dir / ("entry_" + std::to_string(i))).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0) ::close(fd);
+    }
+}
+
+/*
+ * Прочитать файл целиком (пустая строка, если его нет).
+ */
+std::string ReadWholeFile(const fs::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+/*
+ * Выполнить скрипт на `workers` потоках и сохранить его вывод. Возвращает false, если какая-то команда вернула не 0.
+ */
+bool RunScriptChecked(Shell& shell, const std::vector<std::string>& script, size_t workers, std::string& output) {
+    std::ostringstream out;
+    std::vector<int> results = shell.RunScript(script, out, workers);
+    output = out.str();
+    return std::all_of(results.begin(), results.end(), [](int code) { return code == 0; });
+}
+
+/*
+ * Разобрать значение опции целиком (без знака, пробелов и хвоста); при ошибке `value` не меняется.
+ */
+template <typename T>
+bool ParseOption(const std::string& text, T& value) {
+    T parsed{};
+    const char* end = text.data() + text.size();
+    auto [ptr, ec] = std::from_chars(text.data(), end, parsed);
+    if (ec != std::errc() || ptr != end || text.empty() || text[0] == '-') return false;
+    value = parsed;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const fs::path root = fs::temp_directory_path() / "shell_benchmark";
+    fs::remove_all(root);
+    fs::create_directories(root);
+    fs::current_path(root);
+    BenchmarkSuite suite(root);
+    std::string jsonFile, baselineFile;
+    double tolerance = 0.10;
+    for (int i = 1; i < argc; i += 2) {
+        const std::string option = argv[i];
+        if (i + 1 == argc) {
+            std::cerr << "missing value for option " << option << "\n";
+            return 2;
+        }
+        const std::string value = argv[i + 1];
+        bool valid = true;
+        if (option == "--filter") suite.filter = value;
+        else if (option == "--repeat") valid = ParseOption(value, suite.repeat) && suite.repeat > 0;
+        else if (option == "--max-entries") valid = ParseOption(value, suite.maxEntries);
+        else if (option == "--max-bytes") valid = ParseOption(value, suite.maxBytes);
+        else if (option == "--json") jsonFile = value;
+        else if (option == "--baseline") baselineFile = value;
+        else if (option == "--tolerance") valid = ParseOption(value, tolerance) && tolerance >= 0;
+        else {
+            std::cerr << "unknown option " << option << "\n";
+            return 2;
+        }
+        if (!valid) {
+            std::cerr << "bad value for option " << option << ": " << value << "\n";
+            return 2;
+        }
+    }
+    Shell& shell = suite.GetShell();
+    auto nothing = []() {};
+
+    // Разбор и диспетчеризация команды без работы с файловой системой
+    const uint64_t dispatchCount = 100000;
+    suite.Run("dispatch_echo", dispatchCount, 0, nothing, [&]() {
+        for (uint64_t i = 0; i < dispatchCount; ++i) {
+            if (!suite.Execute("echo a b c d e f g h")) return false;
+        }
+        return true;
+    });
+    suite.Run("dispatch_unknown", dispatchCount, 0, nothing, [&]() {
+        for (uint64_t i = 0; i < dispatchCount; ++i) {
+            suite.Execute("no_such_command with some arguments");
+        }
+        return true;
+    });
+
+    for (uint64_t entries = 1000; entries <= suite.maxEntries; entries *= 10) {
+        const std::string name = "ls_" + std::to_string(entries);
+        if (!suite.Enabled(name) && !suite.Enabled(name + "_l")) continue;
+        const fs::path dir = root / name;
+        MakeDirectory(dir, entries);
+        suite.Run(name, entries, 0, nothing, [&]() { return suite.Execute("ls " + dir.string()); });
+        suite.Run(name + "_l", entries, 0, nothing, [&]() { return suite.Execute("ls -l " + dir.string()); });
+        fs::remove_all(dir);
+    }
+
+    for (uint64_t bytes = 1000000; bytes <= suite.maxBytes; bytes *= 10) {
+        const std::string name = "cat_" + std::to_string(bytes);
+        if (!suite.Enabled(name + "_stdout") && !suite.Enabled(name + "_redirect")) continue;
+        MakeFile(root / "cat_source", bytes);
+        std::ofstream devNull("/dev/null");
+        suite.Run(name + "_stdout", 1, bytes, nothing, [&]() {
+            return shell.ExecuteCommand("cat cat_source", devNull) == 0;
+        });
+        suite.Run(name + "_redirect", 1, bytes, [&]() { fs::remove(root / "cat_copy"); }, [&]() {
+            return suite.Execute("cat cat_source > cat_copy");
+        });
+        fs::remove(root / "cat_source");
+        fs::remove(root / "cat_copy");
+    }
+
+    // Запуск коротких внешних программ: задержка posix_spawn и поиска по PATH
+    const uint64_t spawnCount = 1000;
+    suite.Run("spawn_true", spawnCount, 0, nothing, [&]() {
+        for (uint64_t i = 0; i < spawnCount; ++i) {
+            if (!suite.Execute("true")) return false;
+        }
+        return true;
+    });
+
+    const uint64_t appendCount = 100000;
+    suite.Run("append_storm", appendCount, 0, [&]() { suite.Execute("rm append.log"); }, [&]() {
+        for (uint64_t i = 0; i < appendCount; ++i) {
+            if (!suite.Execute("echo appended line >> append.log")) return false;
+        }
+        shell.Flush();
+        return true;
+    });
+    suite.Execute("rm append.log");
+
+    // Дерево из maxEntries директорий: maxEntries / 100 директорий по 100 поддиректорий
+    const uint64_t fanout = std::max<uint64_t>(1, suite.maxEntries / 100);
+    const std::string tree = "tree/{1.." + std::to_string(fanout) + "}/{1..100}";
+    suite.Run("tree_mkdir", fanout * 100, 0, [&]() { fs::remove_all(root / "tree"); }, [&]() {
+        return suite.Execute("mkdir -p " + tree);
+    });
+    suite.Run("tree_touch", fanout * 100, 0, [&]() {
+        fs::remove_all(root / "tree");
+        suite.Execute("mkdir -p " + tree);
+    }, [&]() { return suite.Execute("touch " + tree + "/f"); });
+    suite.Run("tree_rm", fanout * 100, 0, [&]() {
+        fs::remove_all(root / "tree");
+        suite.Execute("mkdir -p " + tree);
+        suite.Execute("touch " + tree + "/f");
+    }, [&]() { return suite.Execute("rm " + tree + "/f"); });
+    suite.Run("tree_rmdir", fanout * 100, 0, [&]() {
+        fs::remove_all(root / "tree");
+        suite.Execute("mkdir -p " + tree);
+    }, [&]() { return suite.Execute("rmdir tree"); });
+    fs::remove_all(root / "tree");
+
+    // Смешанный скрипт, команды которого в основном затрагивают непересекающиеся директории: последовательно и
+    // параллельно, результаты обоих запусков должны совпасть
+    std::vector<std::string> script;
+    for (int i = 0; script.size() < 100000; ++i) {
+        const std::string dir = "d" + std::to_string(i);
+        script.push_back("mkdir " + dir);
+        script.push_back("echo first > " + dir + "/a.txt");
+        script.push_back("echo second >> " + dir + "/a.txt");
+        script.push_back("cat " + dir + "/a.txt > " + dir + "/b.txt");
+        script.push_back("ls " + (root / dir).string());
+        script.push_back("echo " + dir + " >> log.txt");
+        script.push_back("rm " + dir + "/a.txt");
+        script.push_back("rmdir " + dir);
+    }
+    const size_t workers = std::max(2u, std::thread::hardware_concurrency());
+    std::string sequentialOut, parallelOut, sequentialLog;
+    suite.Run("script_sequential", script.size(), 0, [&]() { suite.Execute("rm log.txt"); }, [&]() {
+        const bool ok = RunScriptChecked(shell, script, 1, sequentialOut) && shell.Flush();
+        sequentialLog = ReadWholeFile(root / "log.txt");
+        return ok;
+    });
+    suite.Run("script_parallel", script.size(), 0, [&]() { suite.Execute("rm log.txt"); }, [&]() {
+        return RunScriptChecked(shell, script, workers, parallelOut) && shell.Flush();
+    });
+    // Сравниваем, только если оба замера выполнились (их могли отфильтровать или прервать из-за ошибки)
+    if (!sequentialOut.empty() && !parallelOut.empty() && !suite.Failed()) {
+        if (sequentialOut != parallelOut) suite.Fail("script_parallel: output differs from sequential execution");
+        if (ReadWholeFile(root / "log.txt") != sequentialLog) suite.Fail("script_parallel: log.txt differs from sequential execution");
+    }
+
+    fs::current_path(fs::temp_directory_path());
+    fs::remove_all(root);
+
+    bool ok = !suite.Failed();
+    if (!jsonFile.empty() && !suite.WriteJson(jsonFile)) {
+        std::cerr << "cannot write " << jsonFile << "\n";
+        ok = false;
+    }
+    if (!baselineFile.empty()) ok = suite.CompareWithBaseline(baselineFile, tolerance) && ok;
+    return ok ? 0 : 1;
 }
+#endif